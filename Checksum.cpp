@@ -0,0 +1,703 @@
+/*
+ *	Internet checksum and copy kernels for the USB CDC Ethernet driver.
+ *
+ *	Vector registers aren't saved for kernel extensions, so there are no
+ *	SSE/AVX kernels. The wide kernels get most of the way there by summing
+ *	32 bits at a time into a 64 bit accumulator and leaving the byte order
+ *	fix up to the end.
+ */
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSByteOrder.h>
+#include <string.h>
+
+#include "Checksum.h"
+
+/****************************************************************************************************/
+//
+//		Function:	fold64
+//
+//		Inputs:		acc - 64 bit accumulator
+//
+//		Outputs:	the folded 16 bit sum
+//
+//		Desc:		Folds the carries back in, 64 bits down to 16
+//
+/****************************************************************************************************/
+
+static inline UInt32 fold64(UInt64 acc)
+{
+
+    acc = (acc & 0xffffffffULL) + (acc >> 32);
+    acc = (acc & 0xffffffffULL) + (acc >> 32);
+
+    return checksumFold((UInt32)acc);
+
+}/* end fold64 */
+
+/****************************************************************************************************/
+//
+//		Function:	referenceSum, referenceCopy
+//
+//		Inputs:		(src) data - the bytes
+//				dst - where to put them (copy only)
+//				len - how many
+//				sum - running sum
+//				odd - data starts on an odd byte of the checksummed region
+//
+//		Outputs:	the folded sum
+//
+//		Desc:		A byte at a time. Slow but obviously right, everything else is
+//				checked against these.
+//
+/****************************************************************************************************/
+
+static UInt32 referenceSum(const UInt8 *data, UInt32 len, UInt32 sum, bool odd)
+{
+    UInt64	acc = sum;
+
+    while (len--)
+    {
+        acc += odd ? *data : (*data << 8);
+        data++;
+        odd = !odd;
+    }
+
+    return fold64(acc);
+
+}/* end referenceSum */
+
+static UInt32 referenceCopy(const UInt8 *src, UInt8 *dst, UInt32 len, UInt32 sum, bool odd)
+{
+    UInt64	acc = sum;
+
+    while (len--)
+    {
+        *dst++ = *src;
+        acc += odd ? *src : (*src << 8);
+        src++;
+        odd = !odd;
+    }
+
+    return fold64(acc);
+
+}/* end referenceCopy */
+
+/****************************************************************************************************/
+//
+//		Function:	wideSum, wideCopy
+//
+//		Inputs:		(src) data - the bytes (any alignment)
+//				dst - where to put them (copy only, any alignment)
+//				len - how many
+//				sum - running sum
+//				odd - data starts on an odd byte of the checksummed region
+//
+//		Outputs:	the folded sum
+//
+//		Desc:		Sums host order words 32 bits at a time, 32 bytes per loop, into
+//				a 64 bit accumulator. The ones complement sum doesn't care about
+//				byte order until the end, where the folded result is swapped to
+//				big endian (RFC 1071). A region starting on an odd byte is the
+//				same sum with the bytes swapped.
+//
+/****************************************************************************************************/
+
+static UInt32 wideSum(const UInt8 *data, UInt32 len, UInt32 sum, bool odd)
+{
+    UInt64	acc = 0;
+    UInt64	w0, w1, w2, w3;
+    UInt32	v;
+    UInt16	h;
+    UInt16	local;
+
+    while (len >= 32)
+    {
+        memcpy(&w0, data, 8);
+        memcpy(&w1, data + 8, 8);
+        memcpy(&w2, data + 16, 8);
+        memcpy(&w3, data + 24, 8);
+        acc += (w0 & 0xffffffffULL) + (w0 >> 32);
+        acc += (w1 & 0xffffffffULL) + (w1 >> 32);
+        acc += (w2 & 0xffffffffULL) + (w2 >> 32);
+        acc += (w3 & 0xffffffffULL) + (w3 >> 32);
+        data += 32;
+        len -= 32;
+    }
+    while (len >= 4)
+    {
+        memcpy(&v, data, 4);
+        acc += v;
+        data += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        memcpy(&h, data, 2);
+        acc += h;
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+    {
+        h = 0;
+        memcpy(&h, data, 1);				// Pads with a zero byte whatever the byte order
+        acc += h;
+    }
+
+    local = OSSwapBigToHostInt16((UInt16)fold64(acc));
+    if (odd)
+    {
+        local = OSSwapInt16(local);
+    }
+
+    return fold64((UInt64)sum + local);
+
+}/* end wideSum */
+
+static UInt32 wideCopy(const UInt8 *src, UInt8 *dst, UInt32 len, UInt32 sum, bool odd)
+{
+    UInt64	acc = 0;
+    UInt64	w0, w1, w2, w3;
+    UInt32	v;
+    UInt16	h;
+    UInt16	local;
+
+    while (len >= 32)
+    {
+        memcpy(&w0, src, 8);
+        memcpy(&w1, src + 8, 8);
+        memcpy(&w2, src + 16, 8);
+        memcpy(&w3, src + 24, 8);
+        memcpy(dst, &w0, 8);
+        memcpy(dst + 8, &w1, 8);
+        memcpy(dst + 16, &w2, 8);
+        memcpy(dst + 24, &w3, 8);
+        acc += (w0 & 0xffffffffULL) + (w0 >> 32);
+        acc += (w1 & 0xffffffffULL) + (w1 >> 32);
+        acc += (w2 & 0xffffffffULL) + (w2 >> 32);
+        acc += (w3 & 0xffffffffULL) + (w3 >> 32);
+        src += 32;
+        dst += 32;
+        len -= 32;
+    }
+    while (len >= 4)
+    {
+        memcpy(&v, src, 4);
+        memcpy(dst, &v, 4);
+        acc += v;
+        src += 4;
+        dst += 4;
+        len -= 4;
+    }
+    if (len >= 2)
+    {
+        memcpy(&h, src, 2);
+        memcpy(dst, &h, 2);
+        acc += h;
+        src += 2;
+        dst += 2;
+        len -= 2;
+    }
+    if (len)
+    {
+        h = 0;
+        memcpy(&h, src, 1);
+        *dst = *src;
+        acc += h;
+    }
+
+    local = OSSwapBigToHostInt16((UInt16)fold64(acc));
+    if (odd)
+    {
+        local = OSSwapInt16(local);
+    }
+
+    return fold64((UInt64)sum + local);
+
+}/* end wideCopy */
+
+const checksumKernels	gChecksumReference = { "Reference", referenceSum, referenceCopy };
+const checksumKernels	gChecksumWide = { "Wide", wideSum, wideCopy };
+
+/****************************************************************************************************/
+//
+//		Function:	advanceCursor
+//
+//		Inputs:		cursor - position in an mbuf chain
+//				len - bytes to skip
+//
+//		Outputs:	
+//
+//		Desc:		Moves the cursor len bytes along the chain
+//
+/****************************************************************************************************/
+
+void advanceCursor(txCursor *cursor, UInt32 len)
+{
+    UInt32	avail;
+
+    while (cursor->m)
+    {
+        avail = mbuf_len(cursor->m) - cursor->offset;
+        if (len < avail)
+        {
+            cursor->offset += len;
+            return;
+        }
+        len -= avail;
+        cursor->m = mbuf_next(cursor->m);
+        cursor->offset = 0;
+    }
+	
+}/* end advanceCursor */
+
+/****************************************************************************************************/
+//
+//		Function:	copyChecksumChain
+//
+//		Inputs:		ck - checksum kernels to use
+//				cursor - where to copy from (advanced past the copied bytes)
+//				dst - where to put them
+//				len - how many
+//				sum - running sum
+//				position - bytes of the checksummed region already summed (updated)
+//
+//		Outputs:	the updated (unfolded) sum
+//
+//		Desc:		Copies and checksums data spread over an mbuf chain in one pass.
+//				position keeps the byte order right when an mbuf ends on an odd byte.
+//
+/****************************************************************************************************/
+
+UInt32 copyChecksumChain(const checksumKernels *ck, txCursor *cursor, UInt8 *dst, UInt32 len, UInt32 sum, UInt32 *position)
+{
+    UInt32	avail, count;
+
+    while ((len != 0) && cursor->m)
+    {
+        avail = mbuf_len(cursor->m) - cursor->offset;
+        if (avail == 0)
+        {
+            cursor->m = mbuf_next(cursor->m);
+            cursor->offset = 0;
+            continue;
+        }
+        count = (len < avail) ? len : avail;
+        sum = ck->copy((UInt8 *)mbuf_data(cursor->m) + cursor->offset, dst, count, sum, (*position & 1) != 0);
+        *position += count;
+        cursor->offset += count;
+        dst += count;
+        len -= count;
+    }
+    
+    return sum;
+	
+}/* end copyChecksumChain */
+
+/****************************************************************************************************/
+//
+//		Function:	copyChain
+//
+//		Inputs:		cursor - where to copy from (advanced past the copied bytes)
+//				dst - where to put them
+//				len - how many
+//
+//		Outputs:	Return code - bytes copied
+//
+//		Desc:		Copies data spread over an mbuf chain
+//
+/****************************************************************************************************/
+
+UInt32 copyChain(txCursor *cursor, UInt8 *dst, UInt32 len)
+{
+    UInt32	avail, count, copied = 0;
+
+    while ((len != 0) && cursor->m)
+    {
+        avail = mbuf_len(cursor->m) - cursor->offset;
+        if (avail == 0)
+        {
+            cursor->m = mbuf_next(cursor->m);
+            cursor->offset = 0;
+            continue;
+        }
+        count = (len < avail) ? len : avail;
+        memcpy(dst, (UInt8 *)mbuf_data(cursor->m) + cursor->offset, count);
+        cursor->offset += count;
+        dst += count;
+        len -= count;
+        copied += count;
+    }
+    
+    return copied;
+	
+}/* end copyChain */
+
+/****************************************************************************************************/
+//
+//		Function:	copyChecksumPacket
+//
+//		Inputs:		ck - checksum kernels to use
+//				packet - the packet
+//				length - its length
+//				dst - where to put it
+//				demand - checksums the stack left to us (kChecksumInsertIP/TCP/UDP)
+//
+//		Outputs:	Return code - true (checksums inserted), false (packet copied as is)
+//
+//		Desc:		Copies an IPv4 packet, computing and inserting the checksums
+//				asked for. The TCP or UDP checksum is worked out as the payload
+//				is copied rather than in a separate pass.
+//
+/****************************************************************************************************/
+
+bool copyChecksumPacket(const checksumKernels *ck, mbuf_t packet, UInt32 length, UInt8 *dst, UInt32 demand)
+{
+    txCursor	cursor;
+    UInt32	done, ethLen, ipLen, ipTotal, l4Len, count;
+    UInt32	sum, position, field;
+    UInt8	*ip, *l4;
+    UInt16	old;
+    bool	ok = false;
+
+    cursor.m = packet;
+    cursor.offset = 0;
+    
+        // Ethernet (maybe VLAN tagged) and IPv4 headers first, so we know where things are
+    
+    ethLen = 14;
+    done = copyChain(&cursor, dst, ethLen);
+    if ((done == ethLen) && (OSReadBigInt16(dst, 12) == 0x8100))		// VLAN tagged
+    {
+        ethLen += 4;
+        done += copyChain(&cursor, &dst[done], 4);
+    }
+    if ((done != ethLen) || (OSReadBigInt16(dst, ethLen - 2) != 0x0800) || (length < ethLen + 20))
+    {
+        goto plain;
+    }
+    ip = &dst[ethLen];
+    done += copyChain(&cursor, ip, 1);
+    ipLen = (ip[0] & 0x0f) * 4;
+    if (((ip[0] >> 4) != 4) || (ipLen < 20) || (length < ethLen + ipLen))
+    {
+        goto plain;
+    }
+    done += copyChain(&cursor, &ip[1], ipLen - 1);
+    ipTotal = OSReadBigInt16(ip, 2);
+    if ((ipTotal < ipLen) || (ipTotal > length - ethLen))
+    {
+        goto plain;
+    }
+    
+    if (demand & kChecksumInsertIP)
+    {
+        OSWriteBigInt16(ip, 10, 0);
+        OSWriteBigInt16(ip, 10, ~ck->sum(ip, ipLen, 0, false));
+        ok = true;
+    }
+    
+        // Fragments carry no complete TCP or UDP header, leave those alone
+    
+    if (OSReadBigInt16(ip, 6) & 0x3fff)
+    {
+        goto plain;
+    }
+    
+    l4 = &ip[ipLen];
+    l4Len = ipTotal - ipLen;
+    if ((ip[9] == kChecksumProtocolTCP) && (demand & kChecksumInsertTCP) && (l4Len >= 20))
+    {
+        field = 16;
+    } else if ((ip[9] == kChecksumProtocolUDP) && (demand & kChecksumInsertUDP) && (l4Len >= 8)) {
+        field = 6;
+    } else {
+        goto plain;
+    }
+    
+    sum = ck->sum(&ip[12], 8, 0, false);
+    sum += ip[9] + l4Len;
+    position = 0;
+    sum = copyChecksumChain(ck, &cursor, l4, l4Len, sum, &position);
+    done += l4Len;
+    
+        // The stack's value of the checksum field went into the sum, take it out again
+    
+    old = OSReadBigInt16(l4, field);
+    sum += (UInt16)~old;
+    sum = (UInt16)~checksumFold(sum);
+    if ((sum == 0) && (ip[9] == kChecksumProtocolUDP))
+    {
+        sum = 0xffff;
+    }
+    OSWriteBigInt16(l4, field, sum);
+    ok = true;
+
+plain:
+    count = length - done;
+    copyChain(&cursor, &dst[done], count);
+    
+    return ok;
+	
+}/* end copyChecksumPacket */
+
+/****************************************************************************************************/
+//
+//		Function:	tsoParseHeaders
+//
+//		Inputs:		hdr - the start of a large send
+//				count - bytes of it in hdr
+//				mss - maximum segment size the stack asked for (0 - none)
+//
+//		Outputs:	Return code - true (TCP/IPv4 with all its headers in hdr), false (not)
+//				tso - where the headers are, and the segment size to use
+//
+//		Desc:		Picks a large send's headers apart. The MSS is capped so no
+//				segment is longer than an Ethernet frame.
+//
+/****************************************************************************************************/
+
+bool tsoParseHeaders(const UInt8 *hdr, UInt32 count, UInt32 mss, tsoHeaders *tso)
+{
+    const UInt8	*ip, *tcp;
+    UInt32	maxFrame = kTSOMaxFrameSize;
+
+    tso->ethLen = 14;
+    if ((count >= 18) && (OSReadBigInt16(hdr, 12) == 0x8100))		// VLAN tagged
+    {
+        tso->ethLen += 4;
+        maxFrame += 4;
+    }
+    if ((count < tso->ethLen + 20) || (OSReadBigInt16(hdr, tso->ethLen - 2) != 0x0800))
+    {
+        return false;
+    }
+    ip = &hdr[tso->ethLen];
+    tso->ipLen = (ip[0] & 0x0f) * 4;
+    if (((ip[0] >> 4) != 4) || (tso->ipLen < 20) || (ip[9] != kChecksumProtocolTCP) || (count < tso->ethLen + tso->ipLen + 20))
+    {
+        return false;
+    }
+    tcp = &ip[tso->ipLen];
+    tso->tcpLen = (tcp[12] >> 4) * 4;
+    tso->hdrLen = tso->ethLen + tso->ipLen + tso->tcpLen;
+    if ((tso->tcpLen < 20) || (tso->hdrLen > count))
+    {
+        return false;
+    }
+    
+    if ((mss == 0) || (mss > maxFrame - tso->hdrLen))
+    {
+        mss = maxFrame - tso->hdrLen;
+    }
+    tso->mss = mss;
+    
+    return true;
+	
+}/* end tsoParseHeaders */
+
+/****************************************************************************************************/
+//
+//		Function:	tsoBuildSegment
+//
+//		Inputs:		ck - checksum kernels to use
+//				hdr - the large send's headers
+//				tso - from tsoParseHeaders
+//				cursor - the segment's payload (advanced past it)
+//				dst - where the segment goes
+//				offset - where its payload starts in the large send's payload
+//				count - payload length
+//				segment - which segment it is (0 - first)
+//				last - it's the last one
+//
+//		Outputs:	
+//
+//		Desc:		Copies the headers in front of one piece of payload and fixes up
+//				the IP length, id and checksum and the TCP sequence number, flags
+//				and checksum. The payload is checksummed as it's copied.
+//
+/****************************************************************************************************/
+
+void tsoBuildSegment(const checksumKernels *ck, const UInt8 *hdr, const tsoHeaders *tso, txCursor *cursor, UInt8 *dst,
+                     UInt32 offset, UInt32 count, UInt32 segment, bool last)
+{
+    UInt8	*ip, *tcp;
+    UInt32	sum, position;
+
+    memcpy(dst, hdr, tso->hdrLen);
+    ip = &dst[tso->ethLen];
+    tcp = &ip[tso->ipLen];
+    
+    OSWriteBigInt16(ip, 2, tso->ipLen + tso->tcpLen + count);
+    OSWriteBigInt16(ip, 4, OSReadBigInt16(ip, 4) + segment);
+    OSWriteBigInt16(ip, 10, 0);
+    OSWriteBigInt16(ip, 10, ~ck->sum(ip, tso->ipLen, 0, false));
+    
+    OSWriteBigInt32(tcp, 4, OSReadBigInt32(tcp, 4) + offset);
+    if (!last)
+    {
+        tcp[13] &= ~kTSOFlagsLastOnly;
+    }
+    if (segment != 0)
+    {
+        tcp[13] &= ~kTSOFlagsFirstOnly;
+    }
+    OSWriteBigInt16(tcp, 16, 0);
+    
+        // Pseudo header, TCP header, then the payload as it's copied
+    
+    sum = ck->sum(&ip[12], 8, 0, false);
+    sum += kChecksumProtocolTCP + tso->tcpLen + count;
+    sum = ck->sum(tcp, tso->tcpLen, sum, false);
+    position = tso->tcpLen;
+    sum = copyChecksumChain(ck, cursor, &dst[tso->hdrLen], count, sum, &position);
+    OSWriteBigInt16(tcp, 16, ~checksumFold(sum));
+	
+}/* end tsoBuildSegment */
+
+/****************************************************************************************************/
+//
+//		Function:	checkOne
+//
+//		Inputs:		kernels - the kernels being checked
+//				src - test data
+//				dst, refDst - copy destinations
+//				len - length
+//				sum - starting sum
+//				odd - starting parity
+//
+//		Outputs:	Return code - true (same as the reference), false (not)
+//
+//		Desc:		Runs one case through both sets of kernels and compares
+//
+/****************************************************************************************************/
+
+static bool checkOne(const checksumKernels *kernels, const UInt8 *src, UInt8 *dst, UInt8 *refDst, UInt32 len, UInt32 sum, bool odd)
+{
+    UInt32	expected;
+
+    expected = referenceSum(src, len, sum, odd);
+    if (kernels->sum(src, len, sum, odd) != expected)
+    {
+        return false;
+    }
+
+    bzero(dst, len + 1);
+    bzero(refDst, len + 1);
+    if ((kernels->copy(src, dst, len, sum, odd) != referenceCopy(src, refDst, len, sum, odd)) || (kernels->copy(src, dst, len, sum, odd) != expected))
+    {
+        return false;
+    }
+
+    return (memcmp(dst, refDst, len + 1) == 0);		// Includes the byte after, nothing may be written there
+
+}/* end checkOne */
+
+/****************************************************************************************************/
+//
+//		Function:	checksumSelfCheck
+//
+//		Inputs:		kernels - the kernels to check
+//
+//		Outputs:	Return code - true (they agree with the reference), false (they don't)
+//
+//		Desc:		Differential test against the reference kernels. Every length up
+//				to kChecksumTestMaxLen and a jumbo frame, at every source and
+//				destination alignment up to kChecksumTestOffsets, both parities
+//				and a few starting sums including ones that carry.
+//
+/****************************************************************************************************/
+
+bool checksumSelfCheck(const checksumKernels *kernels)
+{
+    static const UInt32	sums[] = { 0, 1, 0xffff, 0xfffffff0 };
+    UInt32		bufSize = kChecksumTestBigLen + kChecksumTestOffsets + 1;
+    UInt8		*src, *dst, *refDst;
+    UInt32		seed = 0x12345678;
+    UInt32		i, len, offset, s;
+    bool		ok = true;
+
+    if (kernels == &gChecksumReference)
+    {
+        return true;
+    }
+
+    src = (UInt8 *)IOMalloc(bufSize * 3);
+    if (!src)
+    {
+        return false;
+    }
+    dst = src + bufSize;
+    refDst = dst + bufSize;
+
+    for (i=0; i<bufSize; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        src[i] = (UInt8)(seed >> 16);
+    }
+    for (i=0; i<64; i++)				// Make sure runs of 0xff (lots of carries) are covered
+    {
+        src[i] = 0xff;
+    }
+
+    for (offset=0; ok && (offset<kChecksumTestOffsets); offset++)
+    {
+        for (len=0; ok && (len<=kChecksumTestMaxLen); len++)
+        {
+            for (s=0; ok && (s<(sizeof(sums) / sizeof(sums[0]))); s++)
+            {
+                ok = checkOne(kernels, src + offset, dst + ((offset * 3) % kChecksumTestOffsets), refDst, len, sums[s], false) &&
+                     checkOne(kernels, src + offset, dst + ((offset * 3) % kChecksumTestOffsets), refDst, len, sums[s], true);
+            }
+        }
+        if (ok)
+        {
+            ok = checkOne(kernels, src + offset, dst + offset, refDst, kChecksumTestBigLen, 0, (offset & 1) != 0);
+        }
+    }
+
+    IOFree(src, bufSize * 3);
+
+    return ok;
+
+}/* end checksumSelfCheck */
+
+/****************************************************************************************************/
+//
+//		Function:	checksumSelectKernels
+//
+//		Inputs:
+//
+//		Outputs:	the kernels to use
+//
+//		Desc:		Picks the fastest kernels that pass the self-check on this machine.
+//				The check runs once per load, every instance after the first gets
+//				the same answer. Two instances racing through here just both run
+//				it and agree. Only a failed check is logged, the driver publishes
+//				the choice in its ChecksumKernel property.
+//
+/****************************************************************************************************/
+
+const checksumKernels *checksumSelectKernels()
+{
+    static const checksumKernels	*selected = NULL;
+    const checksumKernels		*kernels;
+
+    if (selected)
+    {
+        return selected;
+    }
+
+    if (checksumSelfCheck(&gChecksumWide))
+    {
+        kernels = &gChecksumWide;
+    } else {
+        IOLog("com_apple_driver_dts_USBCDCEthernet: checksumSelectKernels - %s kernels failed the self-check, using %s\n", gChecksumWide.name, gChecksumReference.name);
+        kernels = &gChecksumReference;
+    }
+    selected = kernels;
+
+    return selected;
+
+}/* end checksumSelectKernels */
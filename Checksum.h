@@ -0,0 +1,91 @@
+/*
+ *	Internet checksum and copy kernels for the USB CDC Ethernet driver.
+ *
+ *	Every kernel computes the ones complement sum of big endian 16 bit words
+ *	(RFC 1071). "odd" says the data starts on an odd byte of the region being
+ *	checksummed, which is how sums are carried across mbufs. The sum going in
+ *	may be any 32 bit value, the sum coming out is folded to 16 bits.
+ *
+ *	The chain routines copy an outgoing packet out of its mbufs, inserting
+ *	the IPv4, TCP or UDP checksums the stack left to the driver on the way,
+ *	or cut a TCP/IPv4 large send into MSS sized segments (software TSO).
+ */
+
+#ifndef USBCDCEthernet_Checksum_h
+#define USBCDCEthernet_Checksum_h
+
+#include <libkern/OSTypes.h>
+
+extern "C"
+{
+    #include <sys/kpi_mbuf.h>
+}
+
+typedef UInt32	(*checksumSumProc)(const UInt8 *data, UInt32 len, UInt32 sum, bool odd);
+typedef UInt32	(*checksumCopyProc)(const UInt8 *src, UInt8 *dst, UInt32 len, UInt32 sum, bool odd);
+
+typedef struct
+{
+    const char			*name;
+    checksumSumProc		sum;		// Sum only
+    checksumCopyProc		copy;		// Copy src to dst and sum in the same pass
+} checksumKernels;
+
+#define kChecksumTestMaxLen	320		// Self-check covers every length up to here
+#define kChecksumTestBigLen	9000		// plus one jumbo sized run
+#define kChecksumTestOffsets	8		// at every alignment up to here
+
+#define kChecksumInsertIP	0x0001		// copyChecksumPacket demand, the same values as
+#define kChecksumInsertTCP	0x0002		// IONetworkController's kChecksumIP, TCP and UDP
+#define kChecksumInsertUDP	0x0004
+#define kChecksumProtocolTCP	6
+#define kChecksumProtocolUDP	17
+
+#define kTSOMaxFrameSize	1514		// Longest segment on the wire, FCS not included (+ 4 if VLAN tagged)
+#define kTSOFlagsLastOnly	0x09		// FIN and PSH, only on a large send's last segment
+#define kTSOFlagsFirstOnly	0x80		// CWR, only on its first
+
+typedef struct
+{
+    mbuf_t			m;		// Current mbuf
+    UInt32			offset;		// Offset within it
+} txCursor;
+
+typedef struct
+{
+    UInt32			ethLen;		// Ethernet header, VLAN tag included
+    UInt32			ipLen;
+    UInt32			tcpLen;
+    UInt32			hdrLen;		// All three, copied in front of every segment
+    UInt32			mss;		// Payload per segment
+} tsoHeaders;
+
+    // The byte at a time reference kernels and the 64 bit accumulator ones
+
+extern const checksumKernels	gChecksumReference;
+extern const checksumKernels	gChecksumWide;
+
+const checksumKernels	*checksumSelectKernels(void);
+bool			checksumSelfCheck(const checksumKernels *kernels);
+
+void			advanceCursor(txCursor *cursor, UInt32 len);
+UInt32			copyChain(txCursor *cursor, UInt8 *dst, UInt32 len);
+UInt32			copyChecksumChain(const checksumKernels *ck, txCursor *cursor, UInt8 *dst, UInt32 len, UInt32 sum, UInt32 *position);
+bool			copyChecksumPacket(const checksumKernels *ck, mbuf_t packet, UInt32 length, UInt8 *dst, UInt32 demand);
+bool			tsoParseHeaders(const UInt8 *hdr, UInt32 count, UInt32 mss, tsoHeaders *tso);
+void			tsoBuildSegment(const checksumKernels *ck, const UInt8 *hdr, const tsoHeaders *tso, txCursor *cursor, UInt8 *dst,
+                                        UInt32 offset, UInt32 count, UInt32 segment, bool last);
+
+static inline UInt32 checksumFold(UInt32 sum)
+{
+
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return sum;
+
+}/* end checksumFold */
+
+#endif /* USBCDCEthernet_Checksum_h */
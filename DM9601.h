@@ -36,10 +36,41 @@ enum DM9601Registers {
   RCRPromiscuous	= 0x02,	// Promiscuous
   RCRRXEnable		= 0x01,	// RX enable
   
+	RegRSR	= 0x06,	// RX Status Register (also the first byte of every received frame)
+  RSRRuntFrame		= 0x80,	// Runt frame (shorter than 64 bytes)
+  RSRMulticast		= 0x40,	// Set on ordinary good frames too, not a multicast indication
+  RSRLateCollision	= 0x20,	// Late collision seen while receiving
+  RSRWatchdogTimeout	= 0x10,	// Receive watchdog timeout (frame over 2048 bytes)
+  RSRPhyError		= 0x08,	// Physical layer error
+  RSRAlignError		= 0x04,	// Alignment error
+  RSRCRCError		= 0x02,	// CRC error
+  RSRFIFOOverflow	= 0x01,	// FIFO overflow error
+  RSRDropMask		= 0xbf,	// Errors that make the frame unusable (everything but bit 6)
+  
+	RegROCR	= 0x07,	// Receive Overflow Counter Register (read clear)
+  ROCRCountOver	= 0x80,	// Counter overflowed
+  ROCRCountMask	= 0x7f,	// [6:0] RX FIFO overflow count
+  
+	RegBPTR	= 0x08,	// Back Pressure Threshold Register
+  BPTRHighWaterShift	= 4,	// [7:4] back pressure high water threshold (KB)
+  BPTRJamTime200us	= 0x07,	// [3:0] jam pattern time, 200us (default)
+  
+	RegFCTR	= 0x09,	// Flow Control Threshold Register
+  FCTRHighWaterShift	= 4,	// [7:4] RX FIFO high water overflow threshold (KB free)
+  FCTRLowWaterMask	= 0x0f,	// [3:0] RX FIFO low water overflow threshold (KB free)
+  
+	RegFCR	= 0x0a,	// RX/TX Flow Control Register
+  FCRTXPauseEnable	= 0x20,	// Send pause packets on FIFO high/low water
+  FCRBackPressure	= 0x08,	// Back pressure mode (half duplex)
+  FCRRXPauseStatus	= 0x04,	// RX pause packet received (latched, read clear)
+  FCRRXPauseCurrent	= 0x02,	// RX pause packet current status
+  FCRFlowControl	= 0x01,	// Honour received pause packets
+  
 	RegEPCR	= 0x0b,	// EEPROM & PHY Control Register
   EPCROpSelect	= 0x08,	// EEPROM or PHY Operation Select
   EPCRRegRead		= 0x04,	// EEPROM or PHY Register Read Command
   EPCRRegWrite	= 0x02,	// EEPROM or PHY Register Write Command
+  EPCRBusy		= 0x01,	// EEPROM or PHY access in progress
   
 	RegEPAR	= 0x0c,	// EEPROM & PHY Address Register
   EPARIntPHY		= 0x40,	// [7:6] force to 01 if Internal PHY is selected
@@ -66,4 +97,15 @@ enum DM9601Registers {
   
 };
 
+// Internal PHY registers (accessed through EPCR/EPAR/EPDR)
+
+enum DM9601PHYRegisters {
+	PHYBMCR	= 0x00,	// Basic Mode Control Register
+  BMCRAutoNeg		= 0x1000,	// Auto-negotiation enable
+  BMCRRestartAutoNeg	= 0x0200,	// Restart auto-negotiation
+  
+	PHYANAR	= 0x04,	// Auto-negotiation Advertisement Register
+  ANARPause		= 0x0400,	// Advertise 802.3x pause capability
+};
+
 #endif
@@ -0,0 +1,209 @@
+/*
+ *	Early receive filter for the USB CDC Ethernet driver.
+ */
+
+#include <IOKit/IOLib.h>
+#include <string.h>
+
+#include "RxFilter.h"
+
+/****************************************************************************************************/
+//
+//		Function:	rxFilterInit
+//
+//		Inputs:		filter - the filter
+//
+//		Outputs:
+//
+//		Desc:		Empties every set and clears the counters, everything passes
+//
+/****************************************************************************************************/
+
+void rxFilterInit(rxFilter *filter)
+{
+
+    bzero(filter, sizeof(*filter));
+
+}/* end rxFilterInit */
+
+/****************************************************************************************************/
+//
+//		Function:	rxFilterAddDestination, rxFilterAddValue
+//
+//		Inputs:		filter/set - where it goes
+//				address/value - what to add
+//
+//		Outputs:	Return code - true (added), false (it's full)
+//
+//		Desc:		Adds a rule. The caller sets the filter active.
+//
+/****************************************************************************************************/
+
+bool rxFilterAddDestination(rxFilter *filter, const UInt8 *address)
+{
+    rxFilterAddresses	*list = &filter->destinations;
+
+    if (list->count >= kRxFilterDestinations)
+    {
+        return false;
+    }
+    memcpy(list->addresses[list->count], address, 6);
+    list->hits[list->count] = 0;
+    list->count++;
+
+    return true;
+
+}/* end rxFilterAddDestination */
+
+bool rxFilterAddValue(rxFilterSet *set, UInt16 value)
+{
+
+    if (set->count >= kRxFilterSetSize)
+    {
+        return false;
+    }
+    set->values[set->count] = value;
+    set->hits[set->count] = 0;
+    set->count++;
+
+    return true;
+
+}/* end rxFilterAddValue */
+
+/****************************************************************************************************/
+//
+//		Function:	findValue
+//
+//		Inputs:		set - the set
+//				value - what to look for
+//
+//		Outputs:	its index, set->count if it isn't there
+//
+//		Desc:		The sets are small, a linear search is fine
+//
+/****************************************************************************************************/
+
+static UInt32 findValue(const rxFilterSet *set, UInt16 value)
+{
+    UInt32	i;
+
+    for (i=0; i<set->count; i++)
+    {
+        if (set->values[i] == value)
+        {
+            break;
+        }
+    }
+
+    return i;
+
+}/* end findValue */
+
+/****************************************************************************************************/
+//
+//		Function:	checkSets
+//
+//		Inputs:		allow, deny - the sets
+//				value - the frame's EtherType or VLAN ID
+//
+//		Outputs:	Return code - true (passes), false (drop it)
+//				miss - incremented if it's dropped for not being allowed
+//
+//		Desc:		Deny wins, then a non-empty allow set must have it
+//
+/****************************************************************************************************/
+
+static bool checkSets(rxFilterSet *allow, rxFilterSet *deny, UInt16 value, UInt32 *miss)
+{
+    UInt32	i;
+
+    i = findValue(deny, value);
+    if (i < deny->count)
+    {
+        deny->hits[i]++;
+        return false;
+    }
+
+    if (allow->count)
+    {
+        i = findValue(allow, value);
+        if (i == allow->count)
+        {
+            (*miss)++;
+            return false;
+        }
+        allow->hits[i]++;
+    }
+
+    return true;
+
+}/* end checkSets */
+
+/****************************************************************************************************/
+//
+//		Function:	rxFilterPass
+//
+//		Inputs:		filter - the filter
+//				frame - the received frame (in the bulk-in buffer)
+//				length - its length, FCS not included
+//				station - our address, it's always allowed
+//
+//		Outputs:	Return code - true (hand it up), false (drop it)
+//
+//		Desc:		Runs a frame through the rules. The destination list only
+//				applies to unicast, broadcast and multicast (ARP, neighbour
+//				discovery, DHCP) are left to the EtherType and VLAN sets.
+//
+/****************************************************************************************************/
+
+bool rxFilterPass(rxFilter *filter, const UInt8 *frame, UInt32 length, const UInt8 *station)
+{
+    rxFilterAddresses	*list = &filter->destinations;
+    UInt16		type;
+    UInt32		i;
+    bool		pass = true;
+
+    if (length < 14)
+    {
+        return true;					// Not ours to judge
+    }
+
+    type = (frame[12] << 8) | frame[13];
+    if ((type == 0x8100) && (length >= 18))
+    {
+        pass = checkSets(&filter->vlanAllow, &filter->vlanDeny, ((frame[14] << 8) | frame[15]) & 0x0fff, &filter->vlanMisses);
+        type = (frame[16] << 8) | frame[17];
+    }
+
+    if (pass)
+    {
+        pass = checkSets(&filter->typeAllow, &filter->typeDeny, type, &filter->typeMisses);
+    }
+
+    if (pass && list->count && !(frame[0] & 0x01) && (memcmp(frame, station, 6) != 0))
+    {
+        for (i=0; i<list->count; i++)
+        {
+            if (memcmp(frame, list->addresses[i], 6) == 0)
+            {
+                list->hits[i]++;
+                break;
+            }
+        }
+        if (i == list->count)
+        {
+            filter->destinationMisses++;
+            pass = false;
+        }
+    }
+
+    if (pass)
+    {
+        filter->passed++;
+    } else {
+        filter->dropped++;
+    }
+
+    return pass;
+
+}/* end rxFilterPass */
@@ -0,0 +1,55 @@
+/*
+ *	Early receive filter for the USB CDC Ethernet driver.
+ *
+ *	Frames are checked in the bulk-in buffer, before an mbuf is taken for
+ *	them, so what the host would throw away anyway (promiscuous or all
+ *	multicast mode) costs no allocation or copy. VLAN IDs are checked first,
+ *	then the EtherType (inside any VLAN tag), then the destination address.
+ *	An empty allow set lets everything through, a deny set drops what's in
+ *	it. Each rule counts the frames it matched. Runs on the driver's
+ *	workloop, the configuration is changed there too.
+ */
+
+#ifndef USBCDCEthernet_RxFilter_h
+#define USBCDCEthernet_RxFilter_h
+
+#include <libkern/OSTypes.h>
+
+#define kRxFilterDestinations	16		// Destination addresses the allow list holds
+#define kRxFilterSetSize	16		// EtherTypes or VLAN IDs a set holds
+
+typedef struct
+{
+    UInt16			values[kRxFilterSetSize];
+    UInt32			hits[kRxFilterSetSize];	// Frames each one matched
+    UInt32			count;
+} rxFilterSet;
+
+typedef struct
+{
+    UInt8			addresses[kRxFilterDestinations][6];
+    UInt32			hits[kRxFilterDestinations];
+    UInt32			count;
+} rxFilterAddresses;
+
+typedef struct
+{
+    rxFilterAddresses		destinations;		// Unicast allowed besides the station address (group addresses always pass)
+    rxFilterSet			typeAllow;
+    rxFilterSet			typeDeny;
+    rxFilterSet			vlanAllow;		// Tagged frames only, untagged ones aren't affected
+    rxFilterSet			vlanDeny;
+    UInt32			destinationMisses;	// Dropped for not being on an allow list
+    UInt32			typeMisses;
+    UInt32			vlanMisses;
+    UInt32			passed;
+    UInt32			dropped;
+    bool			active;			// Something is set
+} rxFilter;
+
+void		rxFilterInit(rxFilter *filter);
+bool		rxFilterAddDestination(rxFilter *filter, const UInt8 *address);
+bool		rxFilterAddValue(rxFilterSet *set, UInt16 value);
+bool		rxFilterPass(rxFilter *filter, const UInt8 *frame, UInt32 length, const UInt8 *station);
+
+#endif /* USBCDCEthernet_RxFilter_h */
@@ -0,0 +1,83 @@
+/*
+ *	Receive latency histogram for the USB CDC Ethernet driver.
+ *
+ *	serviceReceive counts the time from each bulk-in transfer completing to
+ *	it being processed in power of two microsecond buckets, and the
+ *	statistics publish percentiles read off them. Kept apart from the driver
+ *	so the host busy poll model (Tests/BusyPollTest.cpp) reports the same
+ *	numbers the driver does.
+ */
+
+#ifndef USBCDCEthernet_RxLatency_h
+#define USBCDCEthernet_RxLatency_h
+
+#include <libkern/OSTypes.h>
+
+#define kRxLatencyBuckets	16		// Bucket n is under 2^n microseconds, the last takes the rest
+
+/****************************************************************************************************/
+//
+//		Function:	rxLatencyBucket
+//
+//		Inputs:		us - a latency in microseconds
+//
+//		Outputs:	the histogram bucket it goes in
+//
+//		Desc:		Bucket 0 is under a microsecond, bucket n under 2^n
+//
+/****************************************************************************************************/
+
+static inline UInt32 rxLatencyBucket(UInt64 us)
+{
+    UInt32	bucket;
+
+    for (bucket = 0; us && (bucket < (kRxLatencyBuckets - 1)); us >>= 1)
+    {
+        bucket++;
+    }
+
+    return bucket;
+
+}/* end rxLatencyBucket */
+
+/****************************************************************************************************/
+//
+//		Function:	rxLatencyPercentile
+//
+//		Inputs:		histogram - kRxLatencyBuckets power of two microsecond buckets
+//				percent - which percentile
+//
+//		Outputs:	the percentile (upper bound of its bucket, microseconds)
+//
+//		Desc:		Reads a percentile off a latency histogram
+//
+/****************************************************************************************************/
+
+static inline UInt64 rxLatencyPercentile(const UInt32 *histogram, UInt32 percent)
+{
+    UInt64	total = 0, count = 0;
+    UInt32	i;
+
+    for (i=0; i<kRxLatencyBuckets; i++)
+    {
+        total += histogram[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    for (i=0; i<kRxLatencyBuckets; i++)
+    {
+        count += histogram[i];
+        if ((count * 100) >= (total * percent))
+        {
+            break;
+        }
+    }
+
+    return 1ULL << i;
+
+}/* end rxLatencyPercentile */
+
+#endif /* USBCDCEthernet_RxLatency_h */
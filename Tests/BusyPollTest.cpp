@@ -0,0 +1,260 @@
+/*
+ *	Host model of receive delivery with and without busy polling.
+ *
+ *	The real latencies come from the USB controller and the scheduler, which
+ *	a host program can't reproduce, so this is a model: a stream of bulk-in
+ *	completions (single transfers and short bursts) and a stream of other
+ *	workloop work (transmit completions, timers) are run against one
+ *	workloop, following what the driver does:
+ *
+ *	- BusyPoll 0: every completion signals the receive event source. If the
+ *	  workloop is idle its thread has to be woken first; if it's busy the
+ *	  pass runs as soon as it's done. A pass takes whatever has completed
+ *	  by the time it gets to it.
+ *	- BusyPoll on: a completion that finds the workloop idle is processed
+ *	  in the completion (receiveInline), never spinning. One that finds it
+ *	  busy signals the event source, and that pass, once caught up, spins
+ *	  for the next completion until one BusyPoll window after its first
+ *	  wait (serviceReceive's per pass deadline).
+ *
+ *	Completion to processing times go into the driver's histogram
+ *	(RxLatency.h) and p50/p99 are read off it the way RxLatencyP50US and
+ *	RxLatencyP99US are. The spin's cost shows up as delay to the other
+ *	workloop work. The wake up, processing and traffic figures are
+ *	assumptions, so the absolute numbers only say which way things move.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libkern/OSTypes.h>
+#include "RxLatency.h"
+
+#define kCompletions	200000
+#define kOtherEvents	100000
+#define kProcessNS	4000				// serviceReceive's work per transfer
+#define kWakeMinNS	15000				// Waking the workloop thread when it's idle
+#define kWakeMaxNS	60000
+#define kGapMeanNS	200000				// Between bursts of completions
+#define kBurstGapNS	12000				// Between transfers in a burst
+#define kOtherGapNS	400000				// Between other workloop events
+#define kOtherMinNS	5000				// and how long each one takes
+#define kOtherMaxNS	30000
+#define kBusyPollMaxUS	100				// As in USBCDCEthernet.h
+
+typedef struct
+{
+    UInt64		time;
+    UInt64		duration;
+} otherEvent;
+
+typedef struct
+{
+    UInt32		rxLatency[kRxLatencyBuckets];
+    UInt32		otherLatency[kRxLatencyBuckets];
+    UInt64		spinNS;
+    UInt64		maxPassSpinNS;
+    UInt64		maxOtherNS;		// Longest any other work waited
+    UInt32		hits;
+    UInt32		misses;
+    UInt32		inlinePasses;
+} pollResult;
+
+static UInt64		gCompletions[kCompletions];
+static otherEvent	gOther[kOtherEvents];
+static UInt32		gSeed;
+
+static UInt32 nextRandom()
+{
+
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 17;
+    gSeed ^= gSeed << 5;
+
+    return gSeed;
+
+}/* end nextRandom */
+
+static UInt64 between(UInt64 low, UInt64 high)
+{
+
+    return low + (nextRandom() % (high - low + 1));
+
+}/* end between */
+
+/****************************************************************************************************/
+//
+//		Function:	makeTraffic
+//
+//		Inputs:
+//
+//		Outputs:
+//
+//		Desc:		Completions arrive alone or in bursts of up to four transfers,
+//				other workloop events at random with random lengths
+//
+/****************************************************************************************************/
+
+static void makeTraffic()
+{
+    UInt64	t = 0;
+    UInt32	i, burst;
+
+    gSeed = 0x1b873593;
+    for (i=0; i<kCompletions; )
+    {
+        t += between(kGapMeanNS / 4, kGapMeanNS * 7 / 4);
+        burst = (nextRandom() % 10 < 3) ? between(2, 4) : 1;
+        for (; burst && (i<kCompletions); burst--, i++)
+        {
+            gCompletions[i] = t;
+            t += kBurstGapNS;
+        }
+    }
+
+    t = 0;
+    for (i=0; i<kOtherEvents; i++)
+    {
+        t += between(kOtherGapNS / 4, kOtherGapNS * 7 / 4);
+        gOther[i].time = t;
+        gOther[i].duration = between(kOtherMinNS, kOtherMaxNS);
+    }
+
+}/* end makeTraffic */
+
+/****************************************************************************************************/
+//
+//		Function:	runModel
+//
+//		Inputs:		busyPollUS - the BusyPoll setting (0 - off)
+//
+//		Outputs:	result - histograms and spin figures
+//
+//		Desc:		Runs both event streams against one workloop. freeAt is when the
+//				workloop (or the completion processing inline) is next free.
+//
+/****************************************************************************************************/
+
+static void runModel(UInt32 busyPollUS, pollResult *result)
+{
+    UInt64	freeAt = 0, now, deadline, passSpin, window = (UInt64)busyPollUS * 1000;
+    UInt32	rx = 0, other = 0;
+    bool	spin, idle;
+
+    memset(result, 0, sizeof(*result));
+    gSeed = 0x85ebca6b;
+
+    while (rx < kCompletions)
+    {
+        if ((other < kOtherEvents) && (gOther[other].time < gCompletions[rx]))
+        {
+            if (gOther[other].time >= freeAt)
+            {
+                now = gOther[other].time + between(kWakeMinNS, kWakeMaxNS);	// The workloop thread has to wake up
+            } else {
+                now = freeAt;
+            }
+            result->otherLatency[rxLatencyBucket((now - gOther[other].time) / 1000)]++;
+            if ((now - gOther[other].time) > result->maxOtherNS)
+            {
+                result->maxOtherNS = now - gOther[other].time;
+            }
+            freeAt = now + gOther[other].duration;
+            other++;
+            continue;
+        }
+
+            // A receive pass, started by completion rx
+
+        idle = (gCompletions[rx] >= freeAt);
+        if (!idle)
+        {
+            now = freeAt;					// Event source, runs when the workloop is done
+            spin = (window != 0);
+        } else if (window != 0) {
+            now = gCompletions[rx];				// receiveInline, no spin
+            spin = false;
+            result->inlinePasses++;
+        } else {
+            now = gCompletions[rx] + between(kWakeMinNS, kWakeMaxNS);
+            spin = false;
+        }
+
+        deadline = 0;
+        passSpin = 0;
+        while (true)
+        {
+            while ((rx < kCompletions) && (gCompletions[rx] <= now))
+            {
+                result->rxLatency[rxLatencyBucket((now - gCompletions[rx]) / 1000)]++;
+                now += kProcessNS;
+                rx++;
+            }
+            if (!spin)
+            {
+                break;
+            }
+            if (deadline == 0)
+            {
+                deadline = now + window;
+            }
+            if ((rx < kCompletions) && (gCompletions[rx] < deadline))
+            {
+                passSpin += gCompletions[rx] - now;
+                now = gCompletions[rx];
+                result->hits++;
+            } else {
+                passSpin += deadline - now;
+                now = deadline;
+                result->misses++;
+                break;
+            }
+        }
+        result->spinNS += passSpin;
+        if (passSpin > result->maxPassSpinNS)
+        {
+            result->maxPassSpinNS = passSpin;
+        }
+        freeAt = now;
+    }
+
+}/* end runModel */
+
+int main()
+{
+    static const UInt32	settings[] = { 0, 25, 50, kBusyPollMaxUS };
+    pollResult		results[sizeof(settings) / sizeof(settings[0])];
+    UInt32		i, failures = 0;
+
+    makeTraffic();
+
+    printf("%9s %9s %9s %7s %7s %7s %8s %11s %11s\n", "BusyPoll", "rx p50", "rx p99", "inline", "hits", "misses", "spin", "other p99", "other max");
+    for (i=0; i<(sizeof(settings) / sizeof(settings[0])); i++)
+    {
+        runModel(settings[i], &results[i]);
+        printf("%7uus %7lluus %7lluus %7u %7u %7u %7.2f%% %9lluus %9lluus\n", settings[i],
+               (unsigned long long)rxLatencyPercentile(results[i].rxLatency, 50),
+               (unsigned long long)rxLatencyPercentile(results[i].rxLatency, 99),
+               results[i].inlinePasses, results[i].hits, results[i].misses,
+               100.0 * results[i].spinNS / gCompletions[kCompletions - 1],
+               (unsigned long long)rxLatencyPercentile(results[i].otherLatency, 99),
+               (unsigned long long)(results[i].maxOtherNS / 1000));
+
+        if (results[i].maxPassSpinNS > (UInt64)settings[i] * 1000)
+        {
+            printf("  BusyPoll %uus: a pass spun for %lluns\n", settings[i], (unsigned long long)results[i].maxPassSpinNS);
+            failures++;
+        }
+        if ((i != 0) && ((rxLatencyPercentile(results[i].rxLatency, 50) >= rxLatencyPercentile(results[0].rxLatency, 50)) ||
+                         (rxLatencyPercentile(results[i].rxLatency, 99) > rxLatencyPercentile(results[0].rxLatency, 99))))
+        {
+            printf("  BusyPoll %uus: no better than deferred delivery\n", settings[i]);
+            failures++;
+        }
+    }
+
+    printf("%u failures\n", failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/*
+ *	Host microbenchmark for the checksum and copy kernels (Checksum.cpp).
+ *
+ *	Times sum-only and copy-and-sum for each set of kernels, and a plain
+ *	memcpy for comparison, at lengths from a bare header up to a jumbo
+ *	frame. Numbers are from the host compiler and CPU, not the kernel, so
+ *	they're only good for comparing kernels against each other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Checksum.h"
+
+#define kTargetBytes	(64ULL * 1024 * 1024)		// Work per measurement
+
+static const checksumKernels	*gKernels[] = { &gChecksumReference, &gChecksumWide };
+static const UInt32		gLengths[] = { 20, 40, 64, 128, 256, 576, 1024, 1460, 1500, 4096, 9000 };
+static volatile UInt32		gSink;
+
+static double now()
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}/* end now */
+
+/****************************************************************************************************/
+//
+//		Function:	rate
+//
+//		Inputs:		ck - kernels (NULL - memcpy)
+//				copy - time the copy kernel rather than the sum
+//				src, dst - buffers
+//				len - length
+//
+//		Outputs:	MB/s
+//
+//		Desc:		Runs one kernel over the same buffer until kTargetBytes are done
+//
+/****************************************************************************************************/
+
+static double rate(const checksumKernels *ck, bool copy, const UInt8 *src, UInt8 *dst, UInt32 len)
+{
+    UInt64	i, loops = kTargetBytes / len;
+    UInt32	sum = 0;
+    double	start, elapsed;
+
+    if (ck == &gChecksumReference)
+    {
+        loops /= 8;						// It's slow, the rate is what matters
+    }
+
+    start = now();
+    for (i=0; i<loops; i++)
+    {
+        if (!ck)
+        {
+            memcpy(dst, src, len);
+            sum += dst[i % len];
+        } else if (copy) {
+            sum += ck->copy(src, dst, len, sum, false);
+        } else {
+            sum += ck->sum(src, len, sum, false);
+        }
+    }
+    elapsed = now() - start;
+    gSink = sum;
+
+    return (loops * len) / elapsed / 1e6;
+
+}/* end rate */
+
+int main()
+{
+    UInt8	*src, *dst;
+    char	label[32];
+    UInt32	i, k;
+
+    src = (UInt8 *)malloc(9000 + 1);
+    dst = (UInt8 *)malloc(9000 + 1);
+    if (!src || !dst)
+    {
+        return 2;
+    }
+    for (i=0; i<9000 + 1; i++)
+    {
+        src[i] = (UInt8)(i * 131 + 7);
+    }
+
+    printf("%7s %10s", "bytes", "memcpy");
+    for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+    {
+        snprintf(label, sizeof(label), "%s-sum", gKernels[k]->name);
+        printf(" %13s", label);
+        snprintf(label, sizeof(label), "%s-copy", gKernels[k]->name);
+        printf(" %13s", label);
+    }
+    printf("   (MB/s, +1 = misaligned source)\n");
+
+    for (i=0; i<(sizeof(gLengths) / sizeof(gLengths[0])); i++)
+    {
+        printf("%7u %10.0f", gLengths[i], rate(NULL, true, src, dst, gLengths[i]));
+        for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+        {
+            printf(" %13.0f %13.0f", rate(gKernels[k], false, src, dst, gLengths[i]), rate(gKernels[k], true, src, dst, gLengths[i]));
+        }
+        printf("\n%5u+1 %10.0f", gLengths[i], rate(NULL, true, src + 1, dst, gLengths[i]));
+        for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+        {
+            printf(" %13.0f %13.0f", rate(gKernels[k], false, src + 1, dst, gLengths[i]), rate(gKernels[k], true, src + 1, dst, gLengths[i]));
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(dst);
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ *	Host test for transmit checksum insertion (copyChecksumPacket).
+ *
+ *	Builds random IPv4 packets - TCP, UDP and others, with and without IP
+ *	options and a VLAN tag, some of them fragments - with junk where the
+ *	stack would have left its partial checksum, cuts each into a random
+ *	mbuf chain (odd lengths, empty mbufs) and has copyChecksumPacket copy
+ *	it with each set of kernels. The copy must match the packet byte for
+ *	byte apart from the checksum fields, which must match ones worked out
+ *	independently here with the field zeroed (RFC 1071, RFC 768 for a zero
+ *	UDP sum).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libkern/OSByteOrder.h>
+
+#include "Checksum.h"
+
+#define kRuns		200000
+#define kMaxPacket	9018
+#define kMaxMbufs	64
+
+static const checksumKernels	*gKernels[] = { &gChecksumReference, &gChecksumWide };
+static UInt32			gSeed = 0x9e3779b9;
+
+static UInt32 nextRandom()
+{
+
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 17;
+    gSeed ^= gSeed << 5;
+
+    return gSeed;
+
+}/* end nextRandom */
+
+static UInt16 referenceChecksum(const UInt8 *data, UInt32 len, UInt32 sum)
+{
+    UInt32	i;
+
+    for (i=0; i<len; i++)
+    {
+        sum += (i & 1) ? data[i] : (data[i] << 8);
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return (UInt16)~sum;
+
+}/* end referenceChecksum */
+
+/****************************************************************************************************/
+//
+//		Function:	buildPacket
+//
+//		Inputs:		pkt - where to build it
+//
+//		Outputs:	its length
+//				demand - checksums to ask for
+//				expected - the packet with the right checksums in it
+//
+//		Desc:		Makes up a random packet and works out what copyChecksumPacket
+//				should turn it into
+//
+/****************************************************************************************************/
+
+static UInt32 buildPacket(UInt8 *pkt, UInt8 *expected, UInt32 *demand)
+{
+    static const UInt8	protocols[] = { kChecksumProtocolTCP, kChecksumProtocolUDP, 1, kChecksumProtocolTCP, kChecksumProtocolUDP };
+    UInt32		ethLen = (nextRandom() & 3) ? 14 : 18;
+    UInt32		ipLen = 20 + ((nextRandom() & 3) ? 0 : (nextRandom() % 11) * 4);
+    UInt32		l4Len, length, field, sum, i;
+    UInt8		*ip, *l4;
+    UInt16		check;
+
+    l4Len = nextRandom() % ((nextRandom() & 1) ? 128 : (kMaxPacket - 18 - 60));
+    length = ethLen + ipLen + l4Len;
+    for (i=0; i<length; i++)
+    {
+        pkt[i] = (UInt8)nextRandom();
+    }
+    if (nextRandom() % 8 == 0)
+    {
+        memset(&pkt[ethLen + ipLen], 0, l4Len);			// Gives sums of zero a chance
+    }
+
+    if (ethLen == 18)
+    {
+        pkt[12] = 0x81;
+        pkt[13] = 0x00;
+    }
+    pkt[ethLen - 2] = 0x08;
+    pkt[ethLen - 1] = 0x00;
+    ip = &pkt[ethLen];
+    ip[0] = 0x40 | (ipLen / 4);
+    OSWriteBigInt16(ip, 2, ipLen + l4Len);
+    OSWriteBigInt16(ip, 6, (nextRandom() % 8 == 0) ? (nextRandom() & 0x3fff) | 0x2000 : 0x4000);
+    ip[9] = protocols[nextRandom() % sizeof(protocols)];
+    if (nextRandom() % 16 == 0)
+    {
+        length += nextRandom() % 32;					// Ethernet padding after the IP packet
+    }
+    *demand = nextRandom() & (kChecksumInsertIP | kChecksumInsertTCP | kChecksumInsertUDP);
+
+    memcpy(expected, pkt, length);
+    ip = &expected[ethLen];
+    l4 = &ip[ipLen];
+    if (*demand & kChecksumInsertIP)
+    {
+        OSWriteBigInt16(ip, 10, 0);
+        OSWriteBigInt16(ip, 10, referenceChecksum(ip, ipLen, 0));
+    }
+    if (OSReadBigInt16(ip, 6) & 0x3fff)
+    {
+        return length;
+    }
+    if ((ip[9] == kChecksumProtocolTCP) && (*demand & kChecksumInsertTCP) && (l4Len >= 20))
+    {
+        field = 16;
+    } else if ((ip[9] == kChecksumProtocolUDP) && (*demand & kChecksumInsertUDP) && (l4Len >= 8)) {
+        field = 6;
+    } else {
+        return length;
+    }
+    OSWriteBigInt16(l4, field, 0);
+    sum = OSReadBigInt16(ip, 12) + OSReadBigInt16(ip, 14) + OSReadBigInt16(ip, 16) + OSReadBigInt16(ip, 18) + ip[9] + l4Len;
+    check = referenceChecksum(l4, l4Len, sum);
+    if ((check == 0) && (ip[9] == kChecksumProtocolUDP))
+    {
+        check = 0xffff;
+    }
+    OSWriteBigInt16(l4, field, check);
+
+    return length;
+
+}/* end buildPacket */
+
+/****************************************************************************************************/
+//
+//		Function:	buildChain
+//
+//		Inputs:		pkt - the packet
+//				length - its length
+//				mbufs - room for kMaxMbufs
+//
+//		Outputs:	the first mbuf
+//
+//		Desc:		Cuts the packet into a random chain, odd sizes and empty mbufs
+//				included
+//
+/****************************************************************************************************/
+
+static mbuf_t buildChain(UInt8 *pkt, UInt32 length, struct mbuf *mbufs)
+{
+    UInt32	i, done, piece;
+
+    for (i=0, done=0; i<kMaxMbufs; i++)
+    {
+        piece = (i == kMaxMbufs - 1) ? length - done : nextRandom() % ((nextRandom() & 1) ? 16 : 2048);
+        if (piece > length - done)
+        {
+            piece = length - done;
+        }
+        mbufs[i].data = &pkt[done];
+        mbufs[i].len = piece;
+        mbufs[i].next = NULL;
+        if (i)
+        {
+            mbufs[i - 1].next = &mbufs[i];
+        }
+        done += piece;
+        if ((done == length) && (nextRandom() & 1))
+        {
+            break;
+        }
+    }
+
+    return mbufs;
+
+}/* end buildChain */
+
+int main()
+{
+    static UInt8	pkt[kMaxPacket + 64], expected[kMaxPacket + 64], out[kMaxPacket + 65];
+    static struct mbuf	mbufs[kMaxMbufs];
+    UInt32		run, k, length, demand, failures = 0;
+    mbuf_t		chain;
+
+    for (run=0; run<kRuns; run++)
+    {
+        length = buildPacket(pkt, expected, &demand);
+        chain = buildChain(pkt, length, mbufs);
+        for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+        {
+            memset(out, 0xa5, length + 1);
+            copyChecksumPacket(gKernels[k], chain, length, out, demand);
+            if ((memcmp(out, expected, length) != 0) || (out[length] != 0xa5))
+            {
+                if (failures++ < 10)
+                {
+                    printf("  %s: run %u length %u demand %x\n", gKernels[k]->name, run, length, demand);
+                }
+            }
+        }
+    }
+
+    printf("%u random packets, %u failures\n", kRuns, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/*
+ *	Host differential test for the checksum and copy kernels (Checksum.cpp).
+ *
+ *	The driver runs a short self-check when it loads. This goes further:
+ *	every length up to kMaxLen at every source and destination alignment up
+ *	to kOffsets, both parities and a spread of starting sums, plus chains
+ *	cut at random points with the sum carried across the cuts the way
+ *	copyChecksumChain() carries it across mbufs. Everything is compared
+ *	with the byte at a time reference kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Checksum.h"
+
+#define kMaxLen		2048
+#define kBigLen		9000
+#define kOffsets	16
+#define kChainRuns	20000
+
+static const checksumKernels	*gKernels[] = { &gChecksumWide };
+static UInt32			gSeed = 0x2545f491;
+
+static UInt32 nextRandom()
+{
+
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 17;
+    gSeed ^= gSeed << 5;
+
+    return gSeed;
+
+}/* end nextRandom */
+
+/****************************************************************************************************/
+//
+//		Function:	checkLengths
+//
+//		Inputs:		ck - the kernels under test
+//				src - random data, kBigLen + kOffsets bytes
+//				dst, refDst - copy destinations, the same size plus one
+//
+//		Outputs:	failures
+//
+//		Desc:		Every length, alignment, parity and starting sum
+//
+/****************************************************************************************************/
+
+static UInt32 checkLengths(const checksumKernels *ck, const UInt8 *src, UInt8 *dst, UInt8 *refDst)
+{
+    static const UInt32	sums[] = { 0, 1, 0xfffe, 0xffff, 0x10000, 0x7fffffff, 0xfffffff0, 0xffffffff };
+    UInt32		srcOff, dstOff, len, s, expected, failures = 0;
+    bool		odd;
+
+    for (srcOff=0; srcOff<kOffsets; srcOff++)
+    {
+        for (dstOff=0; dstOff<kOffsets; dstOff++)
+        {
+            for (len=0; len<=kMaxLen; len += ((srcOff == dstOff) || (len < 256)) ? 1 : 7)
+            {
+                for (s=0; s<(sizeof(sums) / sizeof(sums[0])); s++)
+                {
+                    odd = (len + s) & 1;
+                    expected = gChecksumReference.sum(src + srcOff, len, sums[s], odd);
+                    if (ck->sum(src + srcOff, len, sums[s], odd) != expected)
+                    {
+                        printf("  %s sum: len %u offset %u sum %08x odd %d\n", ck->name, len, srcOff, sums[s], odd);
+                        failures++;
+                    }
+                    memset(dst, 0x5a, kMaxLen + kOffsets + 1);
+                    memset(refDst, 0x5a, kMaxLen + kOffsets + 1);
+                    gChecksumReference.copy(src + srcOff, refDst + dstOff, len, sums[s], odd);
+                    if ((ck->copy(src + srcOff, dst + dstOff, len, sums[s], odd) != expected) ||
+                        (memcmp(dst, refDst, kMaxLen + kOffsets + 1) != 0))
+                    {
+                        printf("  %s copy: len %u offsets %u/%u sum %08x odd %d\n", ck->name, len, srcOff, dstOff, sums[s], odd);
+                        failures++;
+                    }
+                }
+            }
+        }
+        if (ck->sum(src + srcOff, kBigLen, 0, srcOff & 1) != gChecksumReference.sum(src + srcOff, kBigLen, 0, srcOff & 1))
+        {
+            printf("  %s sum: len %u offset %u\n", ck->name, kBigLen, srcOff);
+            failures++;
+        }
+    }
+
+    return failures;
+
+}/* end checkLengths */
+
+/****************************************************************************************************/
+//
+//		Function:	checkChains
+//
+//		Inputs:		ck - the kernels under test
+//				src - random data
+//				dst - copy destination
+//
+//		Outputs:	failures
+//
+//		Desc:		Cuts a buffer into random pieces and sums it piece by piece,
+//				carrying the sum and the parity, as if it were an mbuf chain
+//
+/****************************************************************************************************/
+
+static UInt32 checkChains(const checksumKernels *ck, const UInt8 *src, UInt8 *dst)
+{
+    UInt32	run, len, done, piece, sum, expected, failures = 0;
+
+    for (run=0; run<kChainRuns; run++)
+    {
+        len = nextRandom() % (kBigLen + 1);
+        expected = gChecksumReference.sum(src, len, 0, false);
+        for (done=0, sum=0; done<len; done += piece)
+        {
+            piece = 1 + (nextRandom() % ((nextRandom() & 1) ? 8 : 1600));
+            if (piece > len - done)
+            {
+                piece = len - done;
+            }
+            sum = ck->copy(src + done, dst + done, piece, sum, (done & 1) != 0);
+        }
+        if ((sum != expected) || (memcmp(src, dst, len) != 0))
+        {
+            printf("  %s chain: len %u\n", ck->name, len);
+            failures++;
+        }
+    }
+
+    return failures;
+
+}/* end checkChains */
+
+int main()
+{
+    UInt8	*src, *dst, *refDst;
+    UInt32	i, k, failures, total = 0;
+
+    src = (UInt8 *)malloc(kBigLen + kOffsets);
+    dst = (UInt8 *)malloc(kBigLen + kOffsets + 1);
+    refDst = (UInt8 *)malloc(kBigLen + kOffsets + 1);
+    if (!src || !dst || !refDst)
+    {
+        return 2;
+    }
+    for (i=0; i<kBigLen + kOffsets; i++)
+    {
+        src[i] = (i < 64) ? 0xff : (UInt8)nextRandom();		// Runs of 0xff carry the most
+    }
+
+    for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+    {
+        failures = checkLengths(gKernels[k], src, dst, refDst) + checkChains(gKernels[k], src, dst);
+        failures += checksumSelfCheck(gKernels[k]) ? 0 : 1;
+        printf("%-10s %s\n", gKernels[k]->name, failures ? "FAILED" : "ok");
+        total += failures;
+    }
+    printf("checksumSelectKernels picked %s\n", checksumSelectKernels()->name);
+
+    free(src);
+    free(dst);
+    free(refDst);
+
+    return total ? 1 : 0;
+}
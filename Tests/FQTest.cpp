@@ -0,0 +1,337 @@
+/*
+ *	Host test for the FQ-CoDel transmit scheduler (TxQueue.cpp).
+ *
+ *	Packets are pushed through fqEnqueue/fqDequeue the way the driver's
+ *	transmit queue does, with a simulated 100 Mb/s link as the clock:
+ *
+ *	- backlogged flows with different packet sizes must get equal byte
+ *	  shares (deficit round robin), whatever their packet sizes
+ *	- packets from sparse flows arriving alongside bulk flows must go out
+ *	  ahead of the bulk flows' backlog, and the bulk flows must keep the
+ *	  rest of the link
+ *	- when the entry pool fills, the packet dropped to make room must come
+ *	  from the bulk flow, never a sparse one
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TxQueue.h"
+
+#define kQuantum	1514
+#define kNsPerByte	80				// 100 Mb/s
+#define kMaxFlows	8
+#define kMbufs		(kTxQueueEntries + 16)
+
+static struct mbuf	gMbufs[kMbufs];
+static UInt8		gFlowOf[kMbufs];
+static UInt32		gFree[kMbufs];
+static UInt32		gFreeCount;
+static UInt64		gNow;
+static UInt32		gFailures;
+
+static void check(bool ok, const char *what)
+{
+
+    printf("  %-58s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok)
+    {
+        gFailures++;
+    }
+
+}/* end check */
+
+/****************************************************************************************************/
+//
+//		Function:	setUp
+//
+//		Inputs:		fq, pool - the scheduler and its entries
+//				params - CoDel settings
+//				target - CoDel target (ns)
+//
+//		Outputs:
+//
+//		Desc:		Empty queues, every test mbuf free, the clock at zero
+//
+/****************************************************************************************************/
+
+static void setUp(fqScheduler *fq, txEntryPool *pool, codelParams *params, UInt64 target)
+{
+    UInt32	i;
+
+    txPoolInit(pool);
+    fqInit(fq, kQuantum, 0);
+    params->target = target;
+    params->interval = 100000000;				// 100ms
+    params->mtu = 1514;
+    for (i=0; i<kMbufs; i++)
+    {
+        gFree[i] = i;
+    }
+    gFreeCount = kMbufs;
+    gNow = 0;
+
+}/* end setUp */
+
+static bool enqueue(fqScheduler *fq, txEntryPool *pool, UInt32 flow, UInt32 length, UInt32 *droppedFlow)
+{
+    mbuf_t	m, dropped;
+    UInt32	i;
+
+    if (gFreeCount == 0)
+    {
+        return false;
+    }
+    i = gFree[--gFreeCount];
+    m = &gMbufs[i];
+    memset(m, 0, sizeof(*m));
+    m->pktlen = length;
+    gFlowOf[i] = flow;
+
+    if (!fqEnqueue(fq, pool, m, length, flow, gNow, &dropped))		// The flow number is its hash
+    {
+        gFree[gFreeCount++] = i;
+        return false;
+    }
+    if (dropped)
+    {
+        *droppedFlow = gFlowOf[dropped - gMbufs];
+        gFree[gFreeCount++] = dropped - gMbufs;
+    }
+
+    return true;
+
+}/* end enqueue */
+
+/****************************************************************************************************/
+//
+//		Function:	dequeue
+//
+//		Inputs:		fq, pool - the scheduler and its entries
+//				params - CoDel settings
+//
+//		Outputs:	Return code - the packet's flow, kMaxFlows if nothing was queued
+//				length - its length
+//				drops - CoDel drops on the way (added to)
+//
+//		Desc:		Takes the next packet and advances the clock by its time on the wire
+//
+/****************************************************************************************************/
+
+static UInt32 dequeue(fqScheduler *fq, txEntryPool *pool, const codelParams *params, UInt32 *length, UInt32 *drops)
+{
+    UInt64	enqueueTime;
+    mbuf_t	m, dropped = NULL;
+    UInt32	flow;
+
+    m = fqDequeue(fq, params, pool, gNow, &enqueueTime, &dropped, drops);
+    while (dropped)
+    {
+        gFree[gFreeCount++] = dropped - gMbufs;
+        dropped = mbuf_nextpkt(dropped);
+    }
+    if (!m)
+    {
+        return kMaxFlows;
+    }
+
+    flow = gFlowOf[m - gMbufs];
+    *length = mbuf_pkthdr_len(m);
+    gNow += *length * kNsPerByte;
+    gFree[gFreeCount++] = m - gMbufs;
+
+    return flow;
+
+}/* end dequeue */
+
+/****************************************************************************************************/
+//
+//		Function:	testByteShares
+//
+//		Desc:		Three backlogged flows sending 1514, 576 and 64 byte packets
+//				must each get a third of the bytes, give or take a quantum
+//
+/****************************************************************************************************/
+
+static void testByteShares()
+{
+    static const UInt32	sizes[] = { 1514, 576, 64 };
+    fqScheduler		fq;
+    txEntryPool		pool;
+    codelParams		params;
+    UInt64		bytes[3] = { 0, 0, 0 }, total = 0;
+    UInt32		i, f, flow, length, dropFlow, drops = 0;
+    char		what[80];
+
+    setUp(&fq, &pool, &params, 1000000000ULL);			// No CoDel drops, just the scheduling
+    for (f=0; f<3; f++)
+    {
+        for (i=0; i<40; i++)
+        {
+            enqueue(&fq, &pool, f, sizes[f], &dropFlow);
+        }
+    }
+
+    while (total < 20000000)
+    {
+        flow = dequeue(&fq, &pool, &params, &length, &drops);
+        if (flow >= 3)
+        {
+            break;
+        }
+        bytes[flow] += length;
+        total += length;
+        enqueue(&fq, &pool, flow, sizes[flow], &dropFlow);		// Keep every flow backlogged
+    }
+
+    for (f=0; f<3; f++)
+    {
+        snprintf(what, sizeof(what), "%4u byte flow gets a third of the bytes (%.4f)", sizes[f], (double)bytes[f] / total);
+        check((bytes[f] * 3 > total - (total / 100)) && (bytes[f] * 3 < total + (total / 100)), what);
+    }
+    check(drops == 0, "no CoDel drops with a long target");
+
+}/* end testByteShares */
+
+/****************************************************************************************************/
+//
+//		Function:	testSparseFlows
+//
+//		Desc:		Three bulk flows keep 40 full frames each queued while five sparse
+//				flows (1-5) each send a small packet every few milliseconds. Every
+//				sparse packet must go out within as many packets as there are
+//				sparse packets queued with it, and the bulk flows must get the rest.
+//
+/****************************************************************************************************/
+
+static void testSparseFlows()
+{
+    fqScheduler		fq;
+    txEntryPool		pool;
+    codelParams		params;
+    UInt64		next[kMaxFlows], sent[kMaxFlows], bulkBytes = 0, sparseBytes = 0;
+    UInt32		waiting[kMaxFlows], queuedAt[kMaxFlows];
+    UInt32		i, f, flow, length, dropFlow, drops = 0, packets = 0;
+    UInt32		worst = 0, sparsePending, sparseSent = 0;
+    char		what[80];
+
+    setUp(&fq, &pool, &params, 5000000);				// 5ms
+    for (i=0; i<40; i++)
+    {
+        enqueue(&fq, &pool, 0, 1514, &dropFlow);
+        enqueue(&fq, &pool, 6, 1514, &dropFlow);
+        enqueue(&fq, &pool, 7, 1514, &dropFlow);
+    }
+    for (f=1; f<6; f++)
+    {
+        next[f] = f * 700000;					// Staggered, every 3ms
+        waiting[f] = 0;
+        sent[f] = 0;
+    }
+
+    while (gNow < 2000000000ULL)					// Two seconds of link time
+    {
+        sparsePending = 0;
+        for (f=1; f<6; f++)
+        {
+            if (!waiting[f] && (gNow >= next[f]))
+            {
+                if (enqueue(&fq, &pool, f, 100, &dropFlow))
+                {
+                    waiting[f] = 1;
+                    queuedAt[f] = packets;
+                }
+                next[f] += 3000000;
+            }
+            sparsePending += waiting[f];
+        }
+
+        flow = dequeue(&fq, &pool, &params, &length, &drops);
+        if (flow >= kMaxFlows)
+        {
+            break;
+        }
+        packets++;
+        if ((flow == 0) || (flow > 5))
+        {
+            bulkBytes += length;
+            enqueue(&fq, &pool, flow, 1514, &dropFlow);
+        } else {
+            if ((packets - queuedAt[flow]) > worst)
+            {
+                worst = packets - queuedAt[flow];
+            }
+            if ((packets - queuedAt[flow]) > sparsePending)
+            {
+                printf("    flow %u waited %u packets with %u sparse packets queued\n", flow, packets - queuedAt[flow], sparsePending);
+                gFailures++;
+            }
+            waiting[flow] = 0;
+            sent[flow]++;
+            sparseSent++;
+            sparseBytes += length;
+        }
+    }
+
+    snprintf(what, sizeof(what), "sparse packets go out ahead of the backlog (worst %u)", worst);
+    check(worst <= 5, what);
+    for (f=1; f<6; f++)
+    {
+        if (sent[f] < 600)
+        {
+            printf("    flow %u only sent %llu packets\n", f, (unsigned long long)sent[f]);
+            gFailures++;
+        }
+    }
+    snprintf(what, sizeof(what), "bulk flows keep the rest of the link (%.4f)", (double)bulkBytes / (bulkBytes + sparseBytes));
+    check(bulkBytes > (bulkBytes + sparseBytes) * 95 / 100, what);
+    check(sparseSent > 3000, "every sparse packet was sent");
+
+}/* end testSparseFlows */
+
+/****************************************************************************************************/
+//
+//		Function:	testOverflow
+//
+//		Desc:		With the pool full of a bulk flow's packets, a sparse flow's
+//				packet still gets in and the bulk flow pays for it
+//
+/****************************************************************************************************/
+
+static void testOverflow()
+{
+    fqScheduler		fq;
+    txEntryPool		pool;
+    codelParams		params;
+    UInt32		i, dropFlow = kMaxFlows, flow, length, drops = 0;
+    bool		queued;
+
+    setUp(&fq, &pool, &params, 5000000);
+    for (i=0; i<kTxQueueEntries; i++)
+    {
+        enqueue(&fq, &pool, 0, 1514, &dropFlow);
+    }
+    queued = enqueue(&fq, &pool, 1, 100, &dropFlow);
+    check(queued && (dropFlow == 0) && (fq.overflowDrops == 1), "a full pool drops from the bulk flow, not the newcomer");
+
+    flow = dequeue(&fq, &pool, &params, &length, &drops);
+    flow = (flow == 0) ? dequeue(&fq, &pool, &params, &length, &drops) : flow;
+    check(flow == 1, "and the newcomer goes out next");
+
+}/* end testOverflow */
+
+int main()
+{
+
+    printf("DRR byte shares\n");
+    testByteShares();
+    printf("Sparse flows\n");
+    testSparseFlows();
+    printf("Pool overflow\n");
+    testOverflow();
+
+    printf("%u failures\n", gFailures);
+
+    return gFailures ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+/*
+ *	Host test for software TSO (tsoParseHeaders and tsoBuildSegment).
+ *
+ *	Builds random TCP/IPv4 large sends - with and without a VLAN tag, IP
+ *	and TCP options, any MSS including none and ones too big for a frame -
+ *	cuts each into a random mbuf chain and segments it the way
+ *	transmitSegments does, into a stand-in for the output pipe. Every
+ *	segment must fit an Ethernet frame and carry the right IP length, id
+ *	and checksum, sequence number, flags and TCP checksum (worked out
+ *	independently here), and the payloads must add back up to the original.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libkern/OSByteOrder.h>
+
+#include "Checksum.h"
+
+#define kRuns		20000
+#define kMaxPayload	65535
+#define kMaxHeaders	(18 + 60 + 60)
+#define kMaxMbufs	64
+#define kMaxFrame	1536
+#define kEthernetMaxFrame	1514			// 802.3, FCS not included (1518 VLAN tagged)
+
+static const checksumKernels	*gKernels[] = { &gChecksumReference, &gChecksumWide };
+static UInt32			gSeed = 0x6d2b79f5;
+
+static UInt32 nextRandom()
+{
+
+    gSeed ^= gSeed << 13;
+    gSeed ^= gSeed >> 17;
+    gSeed ^= gSeed << 5;
+
+    return gSeed;
+
+}/* end nextRandom */
+
+static UInt16 referenceChecksum(const UInt8 *data, UInt32 len, UInt32 sum)
+{
+    UInt32	i;
+
+    for (i=0; i<len; i++)
+    {
+        sum += (i & 1) ? data[i] : (data[i] << 8);
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    return (UInt16)~sum;
+
+}/* end referenceChecksum */
+
+/****************************************************************************************************/
+//
+//		Function:	buildLargeSend
+//
+//		Inputs:		pkt - where to build it
+//
+//		Outputs:	its length
+//				mss - the MSS to ask for
+//
+//		Desc:		Makes up a random TCP/IPv4 large send
+//
+/****************************************************************************************************/
+
+static UInt32 buildLargeSend(UInt8 *pkt, UInt32 *mss)
+{
+    UInt32	ethLen = (nextRandom() & 3) ? 14 : 18;
+    UInt32	ipLen = 20 + ((nextRandom() & 3) ? 0 : (nextRandom() % 11) * 4);
+    UInt32	tcpLen = 20 + ((nextRandom() & 1) ? 12 : (nextRandom() % 11) * 4);
+    UInt32	payload, length, i;
+    UInt8	*ip, *tcp;
+
+    payload = nextRandom() % ((nextRandom() & 1) ? 4000 : (kMaxPayload - ipLen - tcpLen + 1));
+    length = ethLen + ipLen + tcpLen + payload;
+    for (i=0; i<length; i++)
+    {
+        pkt[i] = (UInt8)nextRandom();
+    }
+
+    if (ethLen == 18)
+    {
+        pkt[12] = 0x81;
+        pkt[13] = 0x00;
+    }
+    pkt[ethLen - 2] = 0x08;
+    pkt[ethLen - 1] = 0x00;
+    ip = &pkt[ethLen];
+    ip[0] = 0x40 | (ipLen / 4);
+    OSWriteBigInt16(ip, 2, 0);					// The stack leaves these to us
+    OSWriteBigInt16(ip, 6, 0x4000);
+    ip[9] = kChecksumProtocolTCP;
+    tcp = &ip[ipLen];
+    tcp[12] = (tcpLen / 4) << 4;
+
+    switch (nextRandom() % 4)
+    {
+        case 0:
+            *mss = 0;
+            break;
+        case 1:
+            *mss = 1 + nextRandom() % 3000;				// Often more than fits a frame
+            break;
+        default:
+            *mss = 1460 - (nextRandom() % 64);
+            break;
+    }
+
+    return length;
+
+}/* end buildLargeSend */
+
+/****************************************************************************************************/
+//
+//		Function:	buildChain
+//
+//		Inputs:		pkt - the packet
+//				length - its length
+//				mbufs - room for kMaxMbufs
+//
+//		Outputs:	the first mbuf
+//
+//		Desc:		Cuts the packet into a random chain, odd sizes and empty mbufs
+//				included
+//
+/****************************************************************************************************/
+
+static mbuf_t buildChain(UInt8 *pkt, UInt32 length, struct mbuf *mbufs)
+{
+    UInt32	i, done, piece;
+
+    for (i=0, done=0; i<kMaxMbufs; i++)
+    {
+        piece = (i == kMaxMbufs - 1) ? length - done : nextRandom() % ((nextRandom() & 1) ? 64 : 4096);
+        if (piece > length - done)
+        {
+            piece = length - done;
+        }
+        mbufs[i].data = &pkt[done];
+        mbufs[i].len = piece;
+        mbufs[i].next = NULL;
+        if (i)
+        {
+            mbufs[i - 1].next = &mbufs[i];
+        }
+        done += piece;
+        if ((done == length) && (nextRandom() & 1))
+        {
+            break;
+        }
+    }
+
+    return mbufs;
+
+}/* end buildChain */
+
+/****************************************************************************************************/
+//
+//		Function:	checkSegment
+//
+//		Inputs:		orig - the large send
+//				tso - its headers
+//				frame - one segment as written to the pipe
+//				frameLen - its length
+//				offset - where its payload should start in the large send's payload
+//				segment - its number
+//				last - it should be the last
+//
+//		Outputs:	Return code - true (right), false (not)
+//
+//		Desc:		Checks one segment against the large send it came from
+//
+/****************************************************************************************************/
+
+static bool checkSegment(const UInt8 *orig, const tsoHeaders *tso, const UInt8 *frame, UInt32 frameLen,
+                         UInt32 offset, UInt32 segment, bool last)
+{
+    const UInt8	*ip = &frame[tso->ethLen], *tcp = &ip[tso->ipLen];
+    const UInt8	*origIP = &orig[tso->ethLen], *origTCP = &origIP[tso->ipLen];
+    UInt32	count = frameLen - tso->hdrLen, sum;
+    UInt8	flags = origTCP[13];
+
+    if (frameLen > kEthernetMaxFrame + ((tso->ethLen == 18) ? 4 : 0))
+    {
+        return false;
+    }
+    if ((memcmp(frame, orig, tso->ethLen) != 0) || (memcmp(&frame[tso->hdrLen], &orig[tso->hdrLen + offset], count) != 0))
+    {
+        return false;
+    }
+
+    if ((OSReadBigInt16(ip, 2) != tso->ipLen + tso->tcpLen + count) ||
+        (OSReadBigInt16(ip, 4) != (UInt16)(OSReadBigInt16(origIP, 4) + segment)) ||
+        (referenceChecksum(ip, tso->ipLen, 0) != 0) ||
+        (memcmp(&ip[6], &origIP[6], 4) != 0) || (memcmp(&ip[12], &origIP[12], tso->ipLen - 12) != 0))
+    {
+        return false;
+    }
+
+    if (!last)
+    {
+        flags &= ~kTSOFlagsLastOnly;
+    }
+    if (segment != 0)
+    {
+        flags &= ~kTSOFlagsFirstOnly;
+    }
+    if ((OSReadBigInt32(tcp, 4) != OSReadBigInt32(origTCP, 4) + offset) || (tcp[13] != flags) ||
+        (memcmp(tcp, origTCP, 4) != 0) || (memcmp(&tcp[8], &origTCP[8], 5) != 0) ||
+        (memcmp(&tcp[14], &origTCP[14], 2) != 0) || (memcmp(&tcp[18], &origTCP[18], tso->tcpLen - 18) != 0))
+    {
+        return false;
+    }
+    sum = OSReadBigInt16(ip, 12) + OSReadBigInt16(ip, 14) + OSReadBigInt16(ip, 16) + OSReadBigInt16(ip, 18);
+    sum += kChecksumProtocolTCP + tso->tcpLen + count;
+    if (referenceChecksum(tcp, tso->tcpLen + count, sum) != 0)
+    {
+        return false;
+    }
+
+    return true;
+
+}/* end checkSegment */
+
+int main()
+{
+    static UInt8	pkt[kMaxHeaders + kMaxPayload], frame[kMaxFrame];
+    static struct mbuf	mbufs[kMaxMbufs];
+    UInt32		run, k, length, mss, payload, offset, count, segment, expected;
+    UInt32		segments = 0, failures = 0;
+    tsoHeaders		tso;
+    txCursor		cursor;
+    bool		last, ok;
+
+    for (run=0; run<kRuns; run++)
+    {
+        length = buildLargeSend(pkt, &mss);
+        if (!tsoParseHeaders(pkt, (length < kMaxHeaders) ? length : kMaxHeaders, mss, &tso))
+        {
+            printf("  run %u: headers not recognised\n", run);
+            failures++;
+            continue;
+        }
+        expected = ((mss == 0) || (mss > tso.mss)) ? tso.mss : mss;
+        payload = length - tso.hdrLen;
+
+        for (k=0; k<(sizeof(gKernels) / sizeof(gKernels[0])); k++)
+        {
+            cursor.m = buildChain(pkt, length, mbufs);
+            cursor.offset = 0;
+            advanceCursor(&cursor, tso.hdrLen);
+            ok = (tso.mss == expected);
+            offset = 0;
+            segment = 0;
+            do
+            {
+                count = ((payload - offset) < tso.mss) ? (payload - offset) : tso.mss;
+                last = ((offset + count) >= payload);
+                memset(frame, 0xa5, sizeof(frame));
+                tsoBuildSegment(gKernels[k], pkt, &tso, &cursor, frame, offset, count, segment, last);
+                ok = ok && (frame[tso.hdrLen + count] == 0xa5) &&
+                     checkSegment(pkt, &tso, frame, tso.hdrLen + count, offset, segment, last);
+                segment++;
+                offset += count;
+            } while (!last && (tso.mss != 0));
+            ok = ok && (offset == payload) && (segment == ((payload == 0) ? 1 : (payload + tso.mss - 1) / tso.mss));
+            segments += segment;
+            if (!ok && (failures++ < 10))
+            {
+                printf("  %s: run %u length %u mss %u (used %u) headers %u\n", gKernels[k]->name, run, length, mss, tso.mss, tso.hdrLen);
+            }
+        }
+    }
+
+    printf("%u random large sends, %u segments, %u failures\n", kRuns, segments, failures);
+
+    return failures ? 1 : 0;
+}
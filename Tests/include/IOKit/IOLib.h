@@ -0,0 +1,19 @@
+/*
+ *	Host stand-in for <IOKit/IOLib.h>, just what the driver's portable
+ *	sources (Checksum.cpp, TxQueue.cpp) use.
+ */
+
+#ifndef USBCDCEthernet_Tests_IOLib_h
+#define USBCDCEthernet_Tests_IOLib_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include <libkern/OSTypes.h>
+
+#define IOMalloc(size)		malloc(size)
+#define IOFree(ptr, size)	free(ptr)
+#define IOLog			printf
+
+#endif /* USBCDCEthernet_Tests_IOLib_h */
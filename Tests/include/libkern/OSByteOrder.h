@@ -0,0 +1,55 @@
+/*
+ *	Host stand-in for <libkern/OSByteOrder.h>.
+ */
+
+#ifndef USBCDCEthernet_Tests_OSByteOrder_h
+#define USBCDCEthernet_Tests_OSByteOrder_h
+
+#include <libkern/OSTypes.h>
+
+#define OSSwapInt16(x)		((UInt16)__builtin_bswap16((UInt16)(x)))
+#define OSSwapInt32(x)		((UInt32)__builtin_bswap32((UInt32)(x)))
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define OSSwapBigToHostInt16(x)	((UInt16)(x))
+#define OSSwapBigToHostInt32(x)	((UInt32)(x))
+#else
+#define OSSwapBigToHostInt16(x)	OSSwapInt16(x)
+#define OSSwapBigToHostInt32(x)	OSSwapInt32(x)
+#endif
+#define OSSwapHostToBigInt16(x)	OSSwapBigToHostInt16(x)
+#define OSSwapHostToBigInt32(x)	OSSwapBigToHostInt32(x)
+
+static inline UInt16 OSReadBigInt16(const volatile void *base, UInt32 offset)
+{
+    const volatile UInt8	*p = (const volatile UInt8 *)base + offset;
+
+    return (UInt16)((p[0] << 8) | p[1]);
+}
+
+static inline UInt32 OSReadBigInt32(const volatile void *base, UInt32 offset)
+{
+    const volatile UInt8	*p = (const volatile UInt8 *)base + offset;
+
+    return ((UInt32)p[0] << 24) | ((UInt32)p[1] << 16) | ((UInt32)p[2] << 8) | p[3];
+}
+
+static inline void OSWriteBigInt16(volatile void *base, UInt32 offset, UInt16 value)
+{
+    volatile UInt8	*p = (volatile UInt8 *)base + offset;
+
+    p[0] = (UInt8)(value >> 8);
+    p[1] = (UInt8)value;
+}
+
+static inline void OSWriteBigInt32(volatile void *base, UInt32 offset, UInt32 value)
+{
+    volatile UInt8	*p = (volatile UInt8 *)base + offset;
+
+    p[0] = (UInt8)(value >> 24);
+    p[1] = (UInt8)(value >> 16);
+    p[2] = (UInt8)(value >> 8);
+    p[3] = (UInt8)value;
+}
+
+#endif /* USBCDCEthernet_Tests_OSByteOrder_h */
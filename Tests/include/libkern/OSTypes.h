@@ -0,0 +1,19 @@
+/*
+ *	Host stand-in for <libkern/OSTypes.h>.
+ */
+
+#ifndef USBCDCEthernet_Tests_OSTypes_h
+#define USBCDCEthernet_Tests_OSTypes_h
+
+#include <stdint.h>
+
+typedef uint8_t		UInt8;
+typedef uint16_t	UInt16;
+typedef uint32_t	UInt32;
+typedef uint64_t	UInt64;
+typedef int8_t		SInt8;
+typedef int16_t		SInt16;
+typedef int32_t		SInt32;
+typedef int64_t		SInt64;
+
+#endif /* USBCDCEthernet_Tests_OSTypes_h */
@@ -0,0 +1,51 @@
+/*
+ *	Host stand-in for <sys/kpi_mbuf.h>. An mbuf is just a buffer and a link
+ *	to the next one, enough for the chain walking code to run over, plus the
+ *	packet length and packet link the transmit queues use.
+ */
+
+#ifndef USBCDCEthernet_Tests_kpi_mbuf_h
+#define USBCDCEthernet_Tests_kpi_mbuf_h
+
+#include <stddef.h>
+#include <string.h>
+
+typedef int		errno_t;
+
+struct mbuf
+{
+    struct mbuf		*next;
+    void		*data;
+    size_t		len;
+    struct mbuf		*nextpkt;	// Packet chain (first mbuf only)
+    size_t		pktlen;		// Packet header length (first mbuf only)
+};
+typedef struct mbuf	*mbuf_t;
+
+static inline void *mbuf_data(mbuf_t m)			{ return m->data; }
+static inline size_t mbuf_len(mbuf_t m)			{ return m->len; }
+static inline mbuf_t mbuf_next(mbuf_t m)		{ return m->next; }
+static inline size_t mbuf_pkthdr_len(mbuf_t m)		{ return m->pktlen; }
+static inline mbuf_t mbuf_nextpkt(mbuf_t m)		{ return m->nextpkt; }
+static inline void mbuf_setnextpkt(mbuf_t m, mbuf_t n)	{ m->nextpkt = n; }
+
+static inline errno_t mbuf_copydata(mbuf_t m, size_t offset, size_t length, void *out)
+{
+    size_t	count;
+
+    for (; m && (offset >= m->len); m = m->next)
+    {
+        offset -= m->len;
+    }
+    for (; m && length; m = m->next, offset = 0)
+    {
+        count = (length < m->len - offset) ? length : m->len - offset;
+        memcpy(out, (char *)m->data + offset, count);
+        out = (char *)out + count;
+        length -= count;
+    }
+
+    return length ? 22 : 0;					// EINVAL if the chain is too short
+}
+
+#endif /* USBCDCEthernet_Tests_kpi_mbuf_h */
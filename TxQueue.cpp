@@ -0,0 +1,860 @@
+/*
+ *	Driver side transmit queueing for the USB CDC Ethernet driver.
+ *
+ *	The CoDel dequeue follows the pseudocode in RFC 8289, section 5 and the
+ *	flow scheduler the one in RFC 8290, section 4.
+ */
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSByteOrder.h>
+#include <string.h>
+
+#include "TxQueue.h"
+
+/****************************************************************************************************/
+//
+//		Function:	txPoolInit, txFifoInit
+//
+//		Inputs:		pool/fifo - the pool or queue
+//
+//		Outputs:
+//
+//		Desc:		Every entry starts on the free list, a queue starts empty
+//
+/****************************************************************************************************/
+
+void txPoolInit(txEntryPool *pool)
+{
+    UInt32	i;
+
+    for (i=0; i<kTxQueueEntries; i++)
+    {
+        pool->entries[i].m = NULL;
+        pool->entries[i].next = (i + 1 < kTxQueueEntries) ? (UInt16)(i + 1) : kTxNoEntry;
+    }
+    pool->freeList = 0;
+    pool->freeCount = kTxQueueEntries;
+
+}/* end txPoolInit */
+
+void txFifoInit(txFifo *fifo)
+{
+
+    fifo->head = kTxNoEntry;
+    fifo->tail = kTxNoEntry;
+    fifo->count = 0;
+    fifo->bytes = 0;
+
+}/* end txFifoInit */
+
+/****************************************************************************************************/
+//
+//		Function:	txFifoEnqueue
+//
+//		Inputs:		pool - where the entry comes from
+//				fifo - the queue
+//				m - the packet
+//				length - its length
+//				hash - its flow hash
+//				now - uptime
+//
+//		Outputs:	Return code - true (queued), false (the pool is empty)
+//
+//		Desc:		Adds a packet to the tail of a queue
+//
+/****************************************************************************************************/
+
+bool txFifoEnqueue(txEntryPool *pool, txFifo *fifo, mbuf_t m, UInt32 length, UInt32 hash, UInt64 now)
+{
+    txEntry	*entry;
+    UInt16	indx = pool->freeList;
+
+    if (indx == kTxNoEntry)
+    {
+        return false;
+    }
+
+    entry = &pool->entries[indx];
+    pool->freeList = entry->next;
+    pool->freeCount--;
+
+    entry->m = m;
+    entry->enqueueTime = now;
+    entry->length = length;
+    entry->hash = hash;
+    entry->next = kTxNoEntry;
+
+    if (fifo->tail == kTxNoEntry)
+    {
+        fifo->head = indx;
+    } else {
+        pool->entries[fifo->tail].next = indx;
+    }
+    fifo->tail = indx;
+    fifo->count++;
+    fifo->bytes += length;
+
+    return true;
+
+}/* end txFifoEnqueue */
+
+/****************************************************************************************************/
+//
+//		Function:	txFifoDequeue
+//
+//		Inputs:		pool - where the entry goes back to
+//				fifo - the queue
+//
+//		Outputs:	the packet at the head, NULL if the queue is empty
+//				enqueueTime - when it was queued
+//
+//		Desc:		Takes the packet at the head of a queue
+//
+/****************************************************************************************************/
+
+mbuf_t txFifoDequeue(txEntryPool *pool, txFifo *fifo, UInt64 *enqueueTime)
+{
+    txEntry	*entry;
+    UInt16	indx = fifo->head;
+    mbuf_t	m;
+
+    if (indx == kTxNoEntry)
+    {
+        return NULL;
+    }
+
+    entry = &pool->entries[indx];
+    fifo->head = entry->next;
+    if (fifo->head == kTxNoEntry)
+    {
+        fifo->tail = kTxNoEntry;
+    }
+    fifo->count--;
+    fifo->bytes -= entry->length;
+
+    m = entry->m;
+    *enqueueTime = entry->enqueueTime;
+
+    entry->m = NULL;
+    entry->next = pool->freeList;
+    pool->freeList = indx;
+    pool->freeCount++;
+
+    return m;
+
+}/* end txFifoDequeue */
+
+/****************************************************************************************************/
+//
+//		Function:	squareRoot
+//
+//		Inputs:		value
+//
+//		Outputs:	its integer square root
+//
+//		Desc:		Newton's method, for the control law
+//
+/****************************************************************************************************/
+
+static UInt64 squareRoot(UInt64 value)
+{
+    UInt64	x = value;
+    UInt64	y = (x + 1) / 2;
+
+    while (y < x)
+    {
+        x = y;
+        y = (x + value / x) / 2;
+    }
+
+    return x;
+
+}/* end squareRoot */
+
+/****************************************************************************************************/
+//
+//		Function:	codelInit
+//
+//		Inputs:		state - a queue's CoDel state
+//
+//		Outputs:
+//
+//		Desc:		Not dropping, nothing seen above target yet
+//
+/****************************************************************************************************/
+
+void codelInit(codelState *state)
+{
+
+    state->firstAboveTime = 0;
+    state->dropNext = 0;
+    state->count = 0;
+    state->lastCount = 0;
+    state->dropping = false;
+
+}/* end codelInit */
+
+/****************************************************************************************************/
+//
+//		Function:	controlLaw, doDequeue
+//
+//		Desc:		RFC 8289 - the next drop comes interval/sqrt(count) after the last,
+//				and a packet is ok to drop once the sojourn time has been above
+//				target for an interval (and there's more than an MTU queued)
+//
+/****************************************************************************************************/
+
+static UInt64 controlLaw(const codelParams *params, UInt64 t, UInt32 count)
+{
+
+    return t + ((params->interval << 16) / squareRoot((UInt64)count << 32));	// interval / sqrt(count), 16 bits of fraction
+
+}/* end controlLaw */
+
+static mbuf_t doDequeue(codelState *state, const codelParams *params, txEntryPool *pool, txFifo *fifo, UInt64 now,
+			UInt64 *enqueueTime, bool *okToDrop)
+{
+    mbuf_t	m;
+
+    *okToDrop = false;
+    m = txFifoDequeue(pool, fifo, enqueueTime);
+    if (!m)
+    {
+        state->firstAboveTime = 0;
+        return NULL;
+    }
+
+    if (((now - *enqueueTime) < params->target) || (fifo->bytes <= params->mtu))
+    {
+        state->firstAboveTime = 0;
+    } else if (state->firstAboveTime == 0) {
+        state->firstAboveTime = now + params->interval;
+    } else if (now >= state->firstAboveTime) {
+        *okToDrop = true;
+    }
+
+    return m;
+
+}/* end doDequeue */
+
+/****************************************************************************************************/
+//
+//		Function:	codelDequeue
+//
+//		Inputs:		state - the queue's CoDel state
+//				params - target, interval and MTU
+//				pool, fifo - the queue
+//				now - uptime
+//
+//		Outputs:	the packet to send, NULL if the queue is empty
+//				enqueueTime - when it was queued
+//				dropped - dropped packets are added to this chain (mbuf_nextpkt)
+//				dropCount - incremented for each one
+//
+//		Desc:		Dequeues with CoDel. The caller frees the dropped packets.
+//
+/****************************************************************************************************/
+
+mbuf_t codelDequeue(codelState *state, const codelParams *params, txEntryPool *pool, txFifo *fifo, UInt64 now,
+		    UInt64 *enqueueTime, mbuf_t *dropped, UInt32 *dropCount)
+{
+    mbuf_t	m;
+    bool	okToDrop;
+    UInt32	delta;
+
+    m = doDequeue(state, params, pool, fifo, now, enqueueTime, &okToDrop);
+
+    if (state->dropping)
+    {
+        if (!okToDrop)
+        {
+            state->dropping = false;				// Back under target
+        }
+        while (state->dropping && (now >= state->dropNext))
+        {
+            mbuf_setnextpkt(m, *dropped);
+            *dropped = m;
+            (*dropCount)++;
+            state->count++;
+            m = doDequeue(state, params, pool, fifo, now, enqueueTime, &okToDrop);
+            if (!okToDrop)
+            {
+                state->dropping = false;
+            } else {
+                state->dropNext = controlLaw(params, state->dropNext, state->count);
+            }
+        }
+    } else if (okToDrop) {
+        mbuf_setnextpkt(m, *dropped);
+        *dropped = m;
+        (*dropCount)++;
+        m = doDequeue(state, params, pool, fifo, now, enqueueTime, &okToDrop);
+        state->dropping = true;
+
+            // Start where the last dropping state left off if it was recent
+
+        delta = state->count - state->lastCount;
+        if ((delta > 1) && ((now - state->dropNext) < (16 * params->interval)))
+        {
+            state->count = delta;
+        } else {
+            state->count = 1;
+        }
+        state->dropNext = controlLaw(params, now, state->count);
+        state->lastCount = state->count;
+    }
+
+    return m;
+
+}/* end codelDequeue */
+
+/****************************************************************************************************/
+//
+//		Function:	hashMix, hashBytes
+//
+//		Desc:		Mixes 32 bit words into the flow hash (multiply and shift, good
+//				enough to spread flows over the buckets)
+//
+/****************************************************************************************************/
+
+static inline UInt32 hashMix(UInt32 h, UInt32 v)
+{
+
+    h ^= v;
+    h *= 0x9e3779b1;
+
+    return h ^ (h >> 15);
+
+}/* end hashMix */
+
+static UInt32 hashBytes(UInt32 h, const UInt8 *data, UInt32 len)
+{
+    UInt32	v;
+
+    while (len >= 4)
+    {
+        memcpy(&v, data, 4);
+        h = hashMix(h, v);
+        data += 4;
+        len -= 4;
+    }
+
+    return h;
+
+}/* end hashBytes */
+
+/****************************************************************************************************/
+//
+//		Function:	txClassify
+//
+//		Inputs:		m - the packet (Ethernet header first)
+//				seed - hash perturbation
+//
+//		Outputs:	info - what was found
+//
+//		Desc:		Looks through the Ethernet, IP and TCP/UDP headers and hashes the
+//				addresses, protocol and ports. Fragments hash without ports so they
+//				stay with the rest of their datagram, anything that isn't IP
+//				hashes on its EtherType. The addresses, TCP sequence numbers,
+//				flags, options and payload length are picked up on the way.
+//
+/****************************************************************************************************/
+
+void txClassify(mbuf_t m, UInt32 seed, txPacketInfo *info)
+{
+    UInt8	hdr[40];
+    UInt8	tcp[14];
+    UInt8	options[40];
+    UInt32	offset = 14;
+    UInt32	h = seed;
+    UInt32	ihl, tcpLen, i;
+    UInt32	ipPayload = 0;				// Bytes after the IP header
+    bool	hasPorts = false;
+
+    bzero(info, sizeof(*info));
+
+    if (mbuf_copydata(m, 12, 2, hdr) != 0)
+    {
+        info->hash = hashMix(h, 0);
+        return;
+    }
+    info->etherType = (hdr[0] << 8) | hdr[1];
+    if ((info->etherType == 0x8100) && (mbuf_copydata(m, 16, 2, hdr) == 0))	// Skip a VLAN tag
+    {
+        info->etherType = (hdr[0] << 8) | hdr[1];
+        offset += 4;
+    }
+
+    if ((info->etherType == 0x0800) && (mbuf_copydata(m, offset, 20, hdr) == 0))
+    {
+        info->ipVersion = 4;
+        info->protocol = hdr[9];
+        info->dscp = hdr[1] >> 2;
+        ihl = (hdr[0] & 0x0f) * 4;
+        h = hashBytes(h, &hdr[12], 8);					// Source and destination
+        memcpy(info->addresses, &hdr[12], 8);
+        info->addrLength = 8;
+        if (((OSReadBigInt16(hdr, 6) & 0x3fff) == 0) && (ihl >= 20) && (OSReadBigInt16(hdr, 2) >= ihl))	// Not a fragment
+        {
+            offset += ihl;
+            ipPayload = OSReadBigInt16(hdr, 2) - ihl;
+            hasPorts = true;
+        }
+    } else if ((info->etherType == 0x86dd) && (mbuf_copydata(m, offset, 40, hdr) == 0)) {
+        info->ipVersion = 6;
+        info->protocol = hdr[6];
+        info->dscp = (OSReadBigInt16(hdr, 0) >> 6) & 0x3f;
+        h = hashBytes(h, &hdr[8], 32);
+        memcpy(info->addresses, &hdr[8], 32);
+        info->addrLength = 32;
+        offset += 40;
+        ipPayload = OSReadBigInt16(hdr, 4);
+        hasPorts = true;
+    } else {
+        info->hash = hashMix(h, info->etherType);
+        return;
+    }
+
+    if (hasPorts && ((info->protocol == 6) || (info->protocol == 17)) && (mbuf_copydata(m, offset, 4, tcp) == 0))
+    {
+        info->srcPort = OSReadBigInt16(tcp, 0);
+        info->dstPort = OSReadBigInt16(tcp, 2);
+        if ((info->protocol == 6) && (mbuf_copydata(m, offset, 14, tcp) == 0) && (ipPayload >= (tcpLen = (tcp[12] >> 4) * 4)) && (tcpLen >= 20))
+        {
+            info->tcpSeq = OSReadBigInt32(tcp, 4);
+            info->tcpAck = OSReadBigInt32(tcp, 8);
+            info->tcpFlags = tcp[13];
+            info->tcpPayload = ipPayload - tcpLen;
+            info->tcpPlainOptions = (tcpLen == 20);
+            if ((tcpLen > 20) && (mbuf_copydata(m, offset + 20, tcpLen - 20, options) == 0))
+            {
+                info->tcpPlainOptions = true;
+                for (i=0; info->tcpPlainOptions && (i<tcpLen - 20); )
+                {
+                    if (options[i] == 0)				// End of options
+                    {
+                        break;
+                    } else if (options[i] == 1) {			// NOP
+                        i++;
+                    } else if ((options[i] == 8) && (i + 10 <= tcpLen - 20)) {	// Timestamps
+                        i += 10;
+                    } else {
+                        info->tcpPlainOptions = false;		// SACK blocks and the rest matter
+                    }
+                }
+            }
+        }
+    }
+    h = hashMix(h, info->protocol);
+    h = hashMix(h, ((UInt32)info->srcPort << 16) | info->dstPort);
+
+    info->hash = h;
+
+}/* end txClassify */
+
+/****************************************************************************************************/
+//
+//		Function:	txPriorityClass
+//
+//		Inputs:		info - from txClassify
+//
+//		Outputs:	the packet's class, kTxClassNormal unless it should jump the queue
+//
+//		Desc:		Pure ACKs (no data, no SYN, FIN or RST), ARP and DSCP EF are small
+//				and latency sensitive, everything else is normal
+//
+/****************************************************************************************************/
+
+UInt32 txPriorityClass(const txPacketInfo *info)
+{
+
+    if (info->etherType == 0x0806)
+    {
+        return kTxClassARP;
+    }
+    if (info->ipVersion && (info->dscp == 46))
+    {
+        return kTxClassEF;
+    }
+    if ((info->protocol == 6) && ((info->tcpFlags & 0x17) == 0x10) && (info->tcpPayload == 0))	// ACK, not SYN, FIN or RST
+    {
+        return kTxClassACK;
+    }
+
+    return kTxClassNormal;
+
+}/* end txPriorityClass */
+
+/****************************************************************************************************/
+//
+//		Function:	txThinnableAck
+//
+//		Inputs:		info - from txClassify
+//
+//		Outputs:	Return code - true (a later ACK on the same flow makes it redundant)
+//
+//		Desc:		A pure cumulative ACK - no data, no SYN, FIN, RST, URG or ECN
+//				flags and no options a later ACK wouldn't repeat (so no SACK)
+//
+/****************************************************************************************************/
+
+bool txThinnableAck(const txPacketInfo *info)
+{
+    
+    return info->ipVersion && (info->protocol == 6) && ((info->tcpFlags & 0xf7) == 0x10) &&
+	   (info->tcpPayload == 0) && info->tcpPlainOptions;
+
+}/* end txThinnableAck */
+
+/****************************************************************************************************/
+//
+//		Function:	txFifoReplaceAck
+//
+//		Inputs:		pool, fifo - the queue
+//				m - a thinnable ACK (txThinnableAck)
+//				length - its length
+//				info - from txClassify
+//				seed - hash perturbation info was classified with
+//
+//		Outputs:	Return code - true (m took an older ACK's place), false (nothing to replace)
+//				replaced - the older ACK, for the caller to free
+//
+//		Desc:		Looks for ACKs on the same flow that m acknowledges past and puts
+//				m in place of the latest one, so it goes where that would have.
+//				Entries are only looked at closely when the flow hash matches.
+//				Duplicate ACKs are left alone, fast retransmit counts them.
+//
+/****************************************************************************************************/
+
+bool txFifoReplaceAck(txEntryPool *pool, txFifo *fifo, mbuf_t m, UInt32 length, const txPacketInfo *info,
+		      UInt32 seed, mbuf_t *replaced)
+{
+    txEntry		*entry;
+    txEntry		*match = NULL;
+    txPacketInfo	queued;
+    UInt16		indx;
+
+    for (indx=fifo->head; indx!=kTxNoEntry; indx=entry->next)
+    {
+        entry = &pool->entries[indx];
+        if (entry->hash != info->hash)
+        {
+            continue;
+        }
+        txClassify(entry->m, seed, &queued);
+        if (txThinnableAck(&queued) && (queued.addrLength == info->addrLength) &&
+            (memcmp(queued.addresses, info->addresses, info->addrLength) == 0) &&
+            (queued.srcPort == info->srcPort) && (queued.dstPort == info->dstPort) &&
+            ((SInt32)(info->tcpAck - queued.tcpAck) > 0))
+        {
+            match = entry;
+        }
+    }
+
+    if (!match)
+    {
+        return false;
+    }
+
+    *replaced = match->m;
+    fifo->bytes = fifo->bytes - match->length + length;
+    match->m = m;
+    match->length = length;
+
+    return true;
+
+}/* end txFifoReplaceAck */
+
+/****************************************************************************************************/
+//
+//		Function:	fqInit
+//
+//		Inputs:		fq - the scheduler
+//				quantum - bytes per flow per round
+//				seed - hash perturbation
+//
+//		Outputs:
+//
+//		Desc:		Every flow empty and on neither list
+//
+/****************************************************************************************************/
+
+void fqInit(fqScheduler *fq, UInt32 quantum, UInt32 seed)
+{
+    UInt32	i;
+
+    for (i=0; i<kFQFlows; i++)
+    {
+        txFifoInit(&fq->flows[i].fifo);
+        codelInit(&fq->flows[i].codel);
+        fq->flows[i].deficit = 0;
+        fq->flows[i].next = kFQNoFlow;
+        fq->flows[i].list = kFQListNone;
+    }
+    fq->newFlows.head = fq->newFlows.tail = kFQNoFlow;
+    fq->oldFlows.head = fq->oldFlows.tail = kFQNoFlow;
+    fq->quantum = quantum;
+    fq->seed = seed;
+    fq->count = 0;
+    fq->newFlowCount = 0;
+    fq->overflowDrops = 0;
+
+}/* end fqInit */
+
+/****************************************************************************************************/
+//
+//		Function:	listAppend, listPop
+//
+//		Desc:		Flow lists are singly linked, flows only ever leave from the head
+//
+/****************************************************************************************************/
+
+static void listAppend(fqScheduler *fq, fqList *list, UInt8 which, UInt16 flow)
+{
+
+    fq->flows[flow].next = kFQNoFlow;
+    fq->flows[flow].list = which;
+    if (list->tail == kFQNoFlow)
+    {
+        list->head = flow;
+    } else {
+        fq->flows[list->tail].next = flow;
+    }
+    list->tail = flow;
+
+}/* end listAppend */
+
+static void listPop(fqScheduler *fq, fqList *list)
+{
+    UInt16	flow = list->head;
+
+    list->head = fq->flows[flow].next;
+    if (list->head == kFQNoFlow)
+    {
+        list->tail = kFQNoFlow;
+    }
+    fq->flows[flow].next = kFQNoFlow;
+    fq->flows[flow].list = kFQListNone;
+
+}/* end listPop */
+
+/****************************************************************************************************/
+//
+//		Function:	fqEnqueue
+//
+//		Inputs:		fq - the scheduler
+//				pool - where the entry comes from
+//				m - the packet
+//				length - its length
+//				hash - its flow hash (txClassify)
+//				now - uptime
+//
+//		Outputs:	Return code - true (queued), false (couldn't be)
+//				dropped - set to a packet dropped to make room, NULL if none
+//
+//		Desc:		Adds a packet to its flow's queue, putting the flow on the new
+//				list if it wasn't active. When the pool is full the packet at the
+//				head of the flow with the most bytes queued is dropped instead of
+//				refusing the new one, so a bulk flow can't lock everyone else out.
+//
+/****************************************************************************************************/
+
+bool fqEnqueue(fqScheduler *fq, txEntryPool *pool, mbuf_t m, UInt32 length, UInt32 hash, UInt64 now, mbuf_t *dropped)
+{
+    UInt16	flow = (UInt16)(hash % kFQFlows);
+    UInt16	fattest = 0;
+    UInt64	enqueueTime;
+    UInt32	i;
+
+    *dropped = NULL;
+
+    if (pool->freeCount == 0)
+    {
+        for (i=1; i<kFQFlows; i++)
+        {
+            if (fq->flows[i].fifo.bytes > fq->flows[fattest].fifo.bytes)
+            {
+                fattest = i;
+            }
+        }
+        *dropped = txFifoDequeue(pool, &fq->flows[fattest].fifo, &enqueueTime);
+        if (!*dropped)
+        {
+            return false;						// The pool is being used by someone else
+        }
+        fq->count--;
+        fq->overflowDrops++;
+    }
+
+    if (!txFifoEnqueue(pool, &fq->flows[flow].fifo, m, length, hash, now))
+    {
+        return false;
+    }
+    fq->count++;
+
+    if (fq->flows[flow].list == kFQListNone)
+    {
+        fq->flows[flow].deficit = fq->quantum;
+        listAppend(fq, &fq->newFlows, kFQListNew, flow);
+        fq->newFlowCount++;
+    }
+
+    return true;
+
+}/* end fqEnqueue */
+
+/****************************************************************************************************/
+//
+//		Function:	fqDequeue
+//
+//		Inputs:		fq - the scheduler
+//				params - CoDel target, interval and MTU
+//				pool - where the entries go back to
+//				now - uptime
+//
+//		Outputs:	the packet to send, NULL if every flow is empty
+//				enqueueTime - when it was queued
+//				dropped - packets CoDel dropped are added to this chain (mbuf_nextpkt)
+//				dropCount - incremented for each one
+//
+//		Desc:		Deficit round robin over the active flows, new flows first. A flow
+//				that has used up its quantum goes to the back of the old list with
+//				another quantum. A new flow that empties goes to the old list
+//				(so it can't keep jumping the queue), an old one that empties
+//				becomes inactive.
+//
+/****************************************************************************************************/
+
+mbuf_t fqDequeue(fqScheduler *fq, const codelParams *params, txEntryPool *pool, UInt64 now,
+		 UInt64 *enqueueTime, mbuf_t *dropped, UInt32 *dropCount)
+{
+    fqList	*list;
+    fqFlow	*flow;
+    UInt16	indx;
+    UInt32	before;
+    mbuf_t	m;
+
+    while (true)
+    {
+        if (fq->newFlows.head != kFQNoFlow)
+        {
+            list = &fq->newFlows;
+        } else if (fq->oldFlows.head != kFQNoFlow) {
+            list = &fq->oldFlows;
+        } else {
+            return NULL;
+        }
+        indx = list->head;
+        flow = &fq->flows[indx];
+
+        if (flow->deficit <= 0)
+        {
+            flow->deficit += fq->quantum;
+            listPop(fq, list);
+            listAppend(fq, &fq->oldFlows, kFQListOld, indx);
+            continue;
+        }
+
+        before = flow->fifo.count;
+        m = codelDequeue(&flow->codel, params, pool, &flow->fifo, now, enqueueTime, dropped, dropCount);
+        fq->count -= before - flow->fifo.count;
+
+        if (!m)
+        {
+            listPop(fq, list);
+            if ((list == &fq->newFlows) && (fq->oldFlows.head != kFQNoFlow))
+            {
+                listAppend(fq, &fq->oldFlows, kFQListOld, indx);
+            }
+            continue;
+        }
+
+        flow->deficit -= mbuf_pkthdr_len(m);
+
+        return m;
+    }
+
+}/* end fqDequeue */
+
+/****************************************************************************************************/
+//
+//		Function:	fqRemove
+//
+//		Inputs:		fq - the scheduler
+//				pool - where the entry goes back to
+//
+//		Outputs:	any queued packet, NULL if there are none
+//
+//		Desc:		For flushing, the caller frees the packets. Flows are left on
+//				their lists, fqDequeue takes them off as it finds them empty.
+//
+/****************************************************************************************************/
+
+mbuf_t fqRemove(fqScheduler *fq, txEntryPool *pool)
+{
+    UInt64	enqueueTime;
+    UInt32	i;
+    mbuf_t	m;
+
+    for (i=0; i<kFQFlows; i++)
+    {
+        m = txFifoDequeue(pool, &fq->flows[i].fifo, &enqueueTime);
+        if (m)
+        {
+            fq->count--;
+            return m;
+        }
+    }
+
+    return NULL;
+
+}/* end fqRemove */
+
+/****************************************************************************************************/
+//
+//		Function:	fqFlowQueue
+//
+//		Inputs:		fq - the scheduler
+//				hash - a flow hash
+//
+//		Outputs:	the queue packets with that hash go in
+//
+//		Desc:		For looking through one flow's packets
+//
+/****************************************************************************************************/
+
+txFifo *fqFlowQueue(fqScheduler *fq, UInt32 hash)
+{
+
+    return &fq->flows[hash % kFQFlows].fifo;
+
+}/* end fqFlowQueue */
+
+/****************************************************************************************************/
+//
+//		Function:	fqActiveFlows
+//
+//		Inputs:		fq - the scheduler
+//
+//		Outputs:	the number of flows with packets queued
+//
+//		Desc:		For the statistics
+//
+/****************************************************************************************************/
+
+UInt32 fqActiveFlows(const fqScheduler *fq)
+{
+    UInt32	i;
+    UInt32	active = 0;
+
+    for (i=0; i<kFQFlows; i++)
+    {
+        if (fq->flows[i].fifo.count)
+        {
+            active++;
+        }
+    }
+
+    return active;
+
+}/* end fqActiveFlows */
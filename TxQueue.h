@@ -0,0 +1,153 @@
+/*
+ *	Driver side transmit queueing for the USB CDC Ethernet driver.
+ *
+ *	Packets waiting to be sent are kept in entries taken from a fixed pool,
+ *	so the queue never allocates. Each entry remembers when its packet was
+ *	queued, which is what CoDel (RFC 8289) works from: it drops at the head
+ *	of the queue once packets have been waiting longer than the target for
+ *	at least an interval. FQ-CoDel (RFC 8290) splits the packets into
+ *	per-flow queues by hashing their addresses and ports, serves the flows
+ *	deficit round robin a quantum of bytes at a time, and runs CoDel on each
+ *	flow. Everything here runs on the driver's workloop.
+ */
+
+#ifndef USBCDCEthernet_TxQueue_h
+#define USBCDCEthernet_TxQueue_h
+
+#include <libkern/OSTypes.h>
+
+extern "C"
+{
+    #include <sys/kpi_mbuf.h>
+}
+
+#define kTxQueueEntries		256		// Packets the pool can hold, all queues together
+#define kTxNoEntry		0xffff
+#define kFQFlows		64		// Flow queues (hash buckets)
+#define kFQNoFlow		0xffff
+
+typedef struct
+{
+    mbuf_t			m;
+    UInt64			enqueueTime;	// Uptime the packet was queued
+    UInt32			length;
+    UInt32			hash;		// Flow hash (txClassify), 0 if it wasn't classified
+    UInt16			next;		// Next entry in the same queue (or the free list)
+} txEntry;
+
+typedef struct
+{
+    txEntry			entries[kTxQueueEntries];
+    UInt16			freeList;
+    UInt32			freeCount;
+} txEntryPool;
+
+typedef struct
+{
+    UInt16			head;
+    UInt16			tail;
+    UInt32			count;
+    UInt32			bytes;
+} txFifo;
+
+typedef struct
+{
+    UInt64			target;		// Acceptable standing delay (uptime units)
+    UInt64			interval;	// How long it must be exceeded before dropping
+    UInt32			mtu;		// A queue holding no more than this is never dropped from
+} codelParams;
+
+typedef struct
+{
+    UInt64			firstAboveTime;	// When the delay will have been above target for an interval (0 - it isn't)
+    UInt64			dropNext;	// Next drop while in the dropping state
+    UInt32			count;		// Drops this dropping state
+    UInt32			lastCount;
+    bool			dropping;
+} codelState;
+
+enum
+{
+    kFQListNone = 0,
+    kFQListNew,					// Flows that have just become active, served first
+    kFQListOld
+};
+
+typedef struct
+{
+    txFifo			fifo;
+    codelState			codel;
+    SInt32			deficit;	// Bytes the flow may still send this round
+    UInt16			next;		// Next flow in the same list
+    UInt8			list;		// Which list it's on
+} fqFlow;
+
+typedef struct
+{
+    UInt16			head;
+    UInt16			tail;
+} fqList;
+
+typedef struct
+{
+    fqFlow			flows[kFQFlows];
+    fqList			newFlows;
+    fqList			oldFlows;
+    UInt32			quantum;	// Bytes a flow gets per round
+    UInt32			seed;		// Hash perturbation
+    UInt32			count;		// Packets queued, all flows
+    UInt32			newFlowCount;	// Times a flow became active
+    UInt32			overflowDrops;	// Dropped from the longest flow because the pool was full
+} fqScheduler;
+
+typedef struct
+{
+    UInt16			etherType;	// After any VLAN tag
+    UInt8			ipVersion;	// 4 or 6, 0 - not IP
+    UInt8			protocol;
+    UInt8			dscp;
+    UInt8			tcpFlags;	// TCP only
+    bool			tcpPlainOptions;// No TCP options other than NOP and timestamps
+    UInt8			addrLength;	// Bytes of addresses - 8 (IPv4) or 32 (IPv6)
+    UInt8			addresses[32];	// Source then destination
+    UInt16			srcPort;	// TCP and UDP only, 0 otherwise
+    UInt16			dstPort;
+    UInt32			tcpSeq;
+    UInt32			tcpAck;
+    UInt32			tcpPayload;	// TCP data bytes
+    UInt32			hash;		// Of the addresses, protocol and ports
+} txPacketInfo;
+
+enum
+{
+    kTxClassNormal = 0,
+    kTxClassACK,				// Pure TCP acknowledgements
+    kTxClassARP,
+    kTxClassEF,					// DSCP Expedited Forwarding (RFC 3246)
+    kTxClasses
+};
+
+void		txPoolInit(txEntryPool *pool);
+void		txFifoInit(txFifo *fifo);
+bool		txFifoEnqueue(txEntryPool *pool, txFifo *fifo, mbuf_t m, UInt32 length, UInt32 hash, UInt64 now);
+mbuf_t		txFifoDequeue(txEntryPool *pool, txFifo *fifo, UInt64 *enqueueTime);
+
+void		codelInit(codelState *state);
+mbuf_t		codelDequeue(codelState *state, const codelParams *params, txEntryPool *pool, txFifo *fifo, UInt64 now,
+			     UInt64 *enqueueTime, mbuf_t *dropped, UInt32 *dropCount);
+
+void		txClassify(mbuf_t m, UInt32 seed, txPacketInfo *info);
+UInt32		txPriorityClass(const txPacketInfo *info);
+bool		txThinnableAck(const txPacketInfo *info);
+bool		txFifoReplaceAck(txEntryPool *pool, txFifo *fifo, mbuf_t m, UInt32 length, const txPacketInfo *info,
+				 UInt32 seed, mbuf_t *replaced);
+
+void		fqInit(fqScheduler *fq, UInt32 quantum, UInt32 seed);
+bool		fqEnqueue(fqScheduler *fq, txEntryPool *pool, mbuf_t m, UInt32 length, UInt32 hash, UInt64 now, mbuf_t *dropped);
+mbuf_t		fqDequeue(fqScheduler *fq, const codelParams *params, txEntryPool *pool, UInt64 now,
+			  UInt64 *enqueueTime, mbuf_t *dropped, UInt32 *dropCount);
+mbuf_t		fqRemove(fqScheduler *fq, txEntryPool *pool);
+txFifo		*fqFlowQueue(fqScheduler *fq, UInt32 hash);
+UInt32		fqActiveFlows(const fqScheduler *fq);
+
+#endif /* USBCDCEthernet_TxQueue_h */
@@ -80,8 +80,6 @@
 
 #define MIN_BAUD (50 << 1)
 
-static globals	g;	// Instantiate the globals
-    
 static struct MediumTable
 {
     UInt32	type;
@@ -118,12 +116,47 @@ UInt16	stats[13] = {	kXMIT_OK_REQ,
 
 OSDefineMetaClassAndStructors(com_apple_driver_dts_USBCDCEthernet, IOEthernetController);
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::operator new, operator delete
+//
+//		Inputs:		size - size of the instance
+//				mem - the instance (delete only)
+//
+//		Outputs:	the zeroed instance (new only)
+//
+//		Desc:		kalloc only guarantees 16 byte alignment, the receive, transmit and
+//				control blocks are laid out on cache lines so the instance has to
+//				start on one too
+//
+/****************************************************************************************************/
+
+void *com_apple_driver_dts_USBCDCEthernet::operator new(size_t size)
+{
+    void	*mem = IOMallocAligned(size, kCacheLineSize);
+    
+    if (mem)
+    {
+        bzero(mem, size);
+    }
+    
+    return mem;
+    
+}/* end operator new */
+
+void com_apple_driver_dts_USBCDCEthernet::operator delete(void *mem, size_t size)
+{
+    
+    IOFreeAligned(mem, size);
+    
+}/* end operator delete */
+
 #if USE_ELG
 /****************************************************************************************************/
 //
 //		Function:	AllocateEventLog
 //
-//		Inputs:		size - amount of memory to allocate
+//		Inputs:		log - the instance's event log, size - amount of memory to allocate
 //
 //		Outputs:	None
 //
@@ -131,27 +164,27 @@ OSDefineMetaClassAndStructors(com_apple_driver_dts_USBCDCEthernet, IOEthernetCon
 //
 /****************************************************************************************************/
 
-static void AllocateEventLog(UInt32 size)
+static void AllocateEventLog(eventLog *log, UInt32 size)
 {
-    if (g.evLogBuf)
+    if (log->evLogBuf)
         return;
 
-    g.evLogFlag = 0;            // assume insufficient memory
-    g.evLogBuf = (UInt8*)IOMalloc(size);
-    if (!g.evLogBuf)
+    log->evLogFlag = 0;            // assume insufficient memory
+    log->evLogBuf = (UInt8*)IOMalloc(size);
+    if (!log->evLogBuf)
     {
         kprintf("com_apple_driver_dts_USBCDCEthernet evLog allocation failed ");
         return;
     }
 
-    bzero(g.evLogBuf, size);
-    g.evLogBufp	= g.evLogBuf;
-    g.evLogBufe	= g.evLogBufp + kEvLogSize - 0x20; // ??? overran buffer?
-    g.evLogFlag  = 0xFEEDBEEF;	// continuous wraparound
-//	g.evLogFlag  = 'step';		// stop at each ELG
-//	g.evLogFlag  = 0x0333;		// any nonzero - don't wrap - stop logging at buffer end
+    bzero(log->evLogBuf, size);
+    log->evLogBufp	= log->evLogBuf;
+    log->evLogBufe	= log->evLogBufp + kEvLogSize - 0x20; // ??? overran buffer?
+    log->evLogFlag  = 0xFEEDBEEF;	// continuous wraparound
+//	log->evLogFlag  = 'step';		// stop at each ELG
+//	log->evLogFlag  = 0x0333;		// any nonzero - don't wrap - stop logging at buffer end
 
-    IOLog("AllocateEventLog - &globals=%8x buffer=%8x", (unsigned int)&g, (unsigned int)g.evLogBuf);
+    IOLog("AllocateEventLog - log=%8x buffer=%8x", (unsigned int)log, (unsigned int)log->evLogBuf);
 
     return;
 	
@@ -161,7 +194,8 @@ static void AllocateEventLog(UInt32 size)
 //
 //		Function:	EvLog
 //
-//		Inputs:		a - anything, b - anything, ascii - 4 charater tag, str - any info string			
+//		Inputs:		log - the instance's event log
+//				a - anything, b - anything, ascii - 4 charater tag, str - any info string			
 //
 //		Outputs:	None
 //
@@ -169,36 +203,36 @@ static void AllocateEventLog(UInt32 size)
 //
 /****************************************************************************************************/
 
-static void EvLog(UInt32 a, UInt32 b, UInt32 ascii, char* str)
+static void EvLog(eventLog *log, UInt32 a, UInt32 b, UInt32 ascii, const char* str)
 {
     register UInt32	*lp;           // Long pointer
     mach_timespec_t	time;
 
-    if (g.evLogFlag == 0)
+    if (log->evLogFlag == 0)
         return;
 
     IOGetTime(&time);
 
-    lp = (UInt32*)g.evLogBufp;
-    g.evLogBufp += 0x10;
+    lp = (UInt32*)log->evLogBufp;
+    log->evLogBufp += 0x10;
 
-    if (g.evLogBufp >= g.evLogBufe)       // handle buffer wrap around if any
+    if (log->evLogBufp >= log->evLogBufe)       // handle buffer wrap around if any
     {    
-        g.evLogBufp  = g.evLogBuf;
-        if (g.evLogFlag != 0xFEEDBEEF)    // make 0xFEEDBEEF a symbolic ???
-            g.evLogFlag = 0;                // stop tracing if wrap undesired
+        log->evLogBufp  = log->evLogBuf;
+        if (log->evLogFlag != 0xFEEDBEEF)    // make 0xFEEDBEEF a symbolic ???
+            log->evLogFlag = 0;                // stop tracing if wrap undesired
     }
 
         // compose interrupt level with 3 byte time stamp:
 
-    *lp++ = (g.intLevel << 24) | ((time.tv_nsec >> 10) & 0x003FFFFF);   // ~ 1 microsec resolution
+    *lp++ = (log->intLevel << 24) | ((time.tv_nsec >> 10) & 0x003FFFFF);   // ~ 1 microsec resolution
     *lp++ = a;
     *lp++ = b;
     *lp   = ascii;
 
-    if(g.evLogFlag == 'step')
+    if(log->evLogFlag == 'step')
     {	
-        static char	code[ 5 ] = {0,0,0,0,0};
+        char	code[ 5 ] = {0,0,0,0,0};
         *(UInt32*)&code = ascii;
         IOLog("%8x com_apple_driver_dts_USBCDCEthernet: %8x %8x %s\n", time.tv_nsec>>10, (unsigned int)a, (unsigned int)b, code);
     }
@@ -329,6 +363,7 @@ void com_apple_driver_dts_USBCDCEthernet::commReadComplete(void *obj, void *para
   com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet*)obj;
   IOReturn		ior;
   UInt8		notif, status;
+  ELG_INSTANCE(me);
   
   ELG(rc, 0, 'cRC+', "com_apple_driver_dts_USBCDCEthernet::commReadComplete");
   
@@ -338,27 +373,36 @@ void com_apple_driver_dts_USBCDCEthernet::commReadComplete(void *obj, void *para
     status = me->fCommPipeBuffer[0];
     if (status & 0x40)
     {
-      me->fLinkStatus = 1;
+      if (!me->fLinkStatus)				// Only on a change, both directions read it
+      {
+        me->fLinkStatus = 1;
+      }
+      me->fLinkMbps = (status & NSRSpeed10) ? 10 : 100;
       me->setLinkStatus(0);
     }
     else
     {
-      me->fLinkStatus = 0;
+      if (me->fLinkStatus)
+      {
+        me->fLinkStatus = 0;
+      }
       me->setLinkStatus(1);
     }
     notif = me->fCommPipeBuffer[1];
     if (!(notif & kResponse_Available))
     {
-      UInt8 control = 0;
+      UInt8 control = me->fRCRValid ? me->fRCR : 0;
       
       control |= RCRDiscardLong | RCRDiscardCRC | RCRRXEnable;
-      me->Write1Register(RegRCR, control); // 0x31
+      me->Write1Register(RegRCR, control); // 0x31 plus the filter bits
       
       control &= ~RCRRXEnable;
       me->Write1Register(RegRCR, control); // 0x30
       
       control |= RCRRXEnable;
       me->Write1Register(RegRCR, control); // 0x31
+      me->fRCR = control;
+      me->fRCRValid = true;
     }
   }
   else if (rc == kIOReturnAborted)
@@ -392,36 +436,48 @@ void com_apple_driver_dts_USBCDCEthernet::commReadComplete(void *obj, void *para
 //		Method:		com_apple_driver_dts_USBCDCEthernet::dataReadComplete
 //
 //		Inputs:		obj - me
-//				param - unused
+//				param - buffer index and generation
 //				rc - return code
 //				remaining - what's left
 //
 //		Outputs:	None
 //
-//		Desc:		BulkIn pipe (Data interface) read completion routine
+//		Desc:		BulkIn pipe (Data interface) read completion routine. Only notes
+//				the transfer is done and keeps the pipe busy, the frames are
+//				handed up on the workloop (serviceReceive).
 //
 /****************************************************************************************************/
 
 void com_apple_driver_dts_USBCDCEthernet::dataReadComplete(void *obj, void *param, IOReturn rc, UInt32 remaining)
 {
     com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet*)obj;
-    IOReturn		ior;
+    UInt32		indx = (UInt32)(uintptr_t)param & 0xff;
+    UInt32		generation = (UInt32)(uintptr_t)param >> 8;
+    ELG_INSTANCE(me);
 
     ELG(rc, remaining, 'dRC-', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete");
+    
+        // Ignore anything posted before the pipe was last aborted
+    
+    if ((indx >= kInBufPool) || (generation != (me->fRxGeneration & 0xffffff)))
+    {
+        ELG(indx, generation, 'dRCs', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Stale completion");
+        return;
+    }
+    
     if (rc == kIOReturnSuccess)	// If operation returned ok
     {
-        ELG(me->fMax_Block_Size, remaining, 'dRC+', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Moving the incoming bytes up the stack");
-		
-        LogData(kUSBIn, (me->fMax_Block_Size - remaining), me->fPipeInBuffer);
-	
-            // Move the incoming bytes up the stack
-
-        me->receivePacket(me->fPipeInBuffer, me->fMax_Block_Size - remaining);
-	
+        ELG(me->fRxBlockSize, remaining, 'dRC+', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Transfer done");
+        me->fRxCompletions++;
+        me->fPipeInBuff[indx].rxLength = me->fRxBlockSize - remaining;
+        me->fPipeInBuff[indx].rxFailed = false;
     } else {
         ELG(0, rc, 'dRc-', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Read completion io err");
+        me->fPipeInBuff[indx].rxLength = 0;
+        me->fPipeInBuff[indx].rxFailed = true;
         if (rc != kIOReturnAborted)
         {
+            OSIncrementAtomic((SInt32 *)&me->fRxReadErrors);
             rc = me->clearPipeStall(me->fInPipe);
             if (rc != kIOReturnSuccess)
             {
@@ -429,25 +485,18 @@ void com_apple_driver_dts_USBCDCEthernet::dataReadComplete(void *obj, void *para
             }
         }
     }
+    clock_get_uptime(&me->fPipeInBuff[indx].doneTime);
+    OSIncrementAtomic((SInt32 *)&me->fRxDone);
     
-        // Queue the next read, only if not aborted
+        // Queue the next read, only if not aborted, and have the workloop process this one
+        // (unless busy polling and it's free, then it's done here)
 	
     if (rc != kIOReturnAborted)
     {
-        ior = me->fInPipe->Read(me->fPipeInMDP, &me->fReadCompletionInfo, NULL);
-        if (ior != kIOReturnSuccess)
+        me->postReads();
+        if (!me->receiveInline())
         {
-            ELG(0, ior, 'dRe-', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Failed to queue read");
-            if (ior == kIOUSBPipeStalled)
-            {
-                me->fInPipe->Reset();
-                ior = me->fInPipe->Read(me->fPipeInMDP, &me->fReadCompletionInfo, NULL);
-                if (ior != kIOReturnSuccess)
-                {
-                    ELG(0, ior, 'dR--', "com_apple_driver_dts_USBCDCEthernet::dataReadComplete - Failed, read dead");
-                    me->fDataDead = true;
-                }
-            }
+            me->fRxEventSource->interruptOccurred(NULL, NULL, 0);
         }
     }
 
@@ -455,12 +504,102 @@ void com_apple_driver_dts_USBCDCEthernet::dataReadComplete(void *obj, void *para
 	
 }/* end dataReadComplete */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::rxEventOccurred
+//
+//		Inputs:		owner - me
+//				sender - the receive event source
+//				count - unused
+//
+//		Outputs:	None
+//
+//		Desc:		Runs on the workloop when bulk-in transfers have completed
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::rxEventOccurred(OSObject *owner, IOInterruptEventSource * /*sender*/, int /*count*/)
+{
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)owner;
+    
+    me->serviceReceive(me->fBusyPollUS != 0);
+    
+}/* end rxEventOccurred */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::txEventOccurred
+//
+//		Inputs:		owner - me
+//				sender - the transmit event source
+//				count - unused
+//
+//		Outputs:	None
+//
+//		Desc:		Runs on the workloop when there's room to send from the
+//				driver's own queue again
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::txEventOccurred(OSObject *owner, IOInterruptEventSource * /*sender*/, int /*count*/)
+{
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)owner;
+    
+    me->serviceTransmit();
+    
+}/* end txEventOccurred */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::shaperFired
+//
+//		Inputs:		owner - me
+//				sender - the shaper timer
+//
+//		Outputs:	None
+//
+//		Desc:		Runs on the workloop once the rate limit has let enough tokens
+//				build up for the frame that was waiting
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::shaperFired(OSObject *owner, IOTimerEventSource * /*sender*/)
+{
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)owner;
+    
+    OSCompareAndSwap(1, 0, &me->fShaperArmed);
+    me->restartTransmit();
+    
+}/* end shaperFired */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::paceFired
+//
+//		Inputs:		owner - me
+//				sender - the pacing timer
+//
+//		Outputs:	None
+//
+//		Desc:		Runs on the workloop when the next paced frame is due
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::paceFired(OSObject *owner, IOTimerEventSource * /*sender*/)
+{
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)owner;
+    
+    OSCompareAndSwap(1, 0, &me->fPaceArmed);
+    me->restartTransmit();
+    
+}/* end paceFired */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::dataWriteComplete
 //
 //		Inputs:		obj - me
-//				param - pool index
+//				param - pool index and generation
 //				rc - return code
 //				remaining - what's left
 //
@@ -473,49 +612,46 @@ void com_apple_driver_dts_USBCDCEthernet::dataReadComplete(void *obj, void *para
 void com_apple_driver_dts_USBCDCEthernet::dataWriteComplete(void *obj, void *param, IOReturn rc, UInt32 remaining)
 {
     com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)obj;
-    mbuf_t		m;
-    UInt32		pktLen = 0;
-#if LDEBUG
-    UInt32		numbufs = 0;
-#endif /* LDEBUG */
+    UInt32		txLength;
     UInt32		poolIndx;
+    UInt32		generation;
+    IOUSBCompletion	zlpCompletion;
+    ELG_INSTANCE(me);
 
-    poolIndx = (uintptr_t)param;
+    poolIndx = (uintptr_t)param & 0xff;
+    generation = ((uintptr_t)param >> 8) & 0xffffff;
+    
+        // The transmit watchdog may already have given up on this buffer (and reused it).
+        // Claiming it decides which of us releases it
+    
+    if (poolIndx < kOutBufPool)
+    {
+        txLength = me->fPipeOutBuff[poolIndx].txLength;		// Only ours if the claim succeeds
+        if (!me->releaseTxBuffer(poolIndx, kOutBufOwned | generation))	// Frees the mbuf (only a large send's last frame has one)
+        {
+            ELG(rc, poolIndx, 'dWCs', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete - Stale completion ignored");
+            return;
+        }
+    }
     
     if (rc == kIOReturnSuccess)						// If operation returned ok
     {	
         ELG(rc, poolIndx, 'dWC+', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete");
-        if (me->fPipeOutBuff[poolIndx].m != NULL)			// Null means zero length write
+        me->fTxCompletions++;
+        if (poolIndx < kOutBufPool)					// kOutBufZLP means zero length write
         {
-            m = me->fPipeOutBuff[poolIndx].m;
-            while (m)
-            {
-                pktLen += mbuf_len(m);
-#if LDEBUG
-                numbufs++;
-#endif /* LDEBUG */
-                m = mbuf_next(m);
-            }
-            
-            me->freePacket(me->fPipeOutBuff[poolIndx].m);		// Free the mbuf
-            me->fPipeOutBuff[poolIndx].m = NULL;
-        
-            if ((pktLen % me->fOutPacketSize) == 0)			// If it was a multiple of max packet size then we need to do a zero length write
+            if ((txLength % me->fOutPacketSize) == 0)			// If it was a multiple of max packet size then we need to do a zero length write
             {
-                ELG(rc, pktLen, 'dWCz', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete - writing zero length packet");
-                me->fPipeOutBuff[poolIndx].pipeOutMDP->setLength(0);
-                me->fWriteCompletionInfo.parameter = NULL;
-                me->fOutPipe->Write(me->fPipeOutBuff[poolIndx].pipeOutMDP, &me->fWriteCompletionInfo);
+                ELG(rc, txLength, 'dWCz', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete - writing zero length packet");
+                zlpCompletion = me->fWriteCompletionInfo;		// Our own copy, sendTxBuffer may be writing at the same time
+                zlpCompletion.parameter = (void *)kOutBufZLP;
+                me->fOutPipe->Write(me->fPipeOutBuff[poolIndx].pipeOutMDP, 0, 0, 0, &zlpCompletion);
             }
+            me->completeTransmit(true);
         }
     } else {
         ELG(rc, poolIndx, 'dWe-', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete - IO err");
 
-        if (me->fPipeOutBuff[poolIndx].m != NULL)
-        {
-            me->freePacket(me->fPipeOutBuff[poolIndx].m);		// Free the mbuf anyway
-            me->fPipeOutBuff[poolIndx].m = NULL;
-        }
         if (rc != kIOReturnAborted)
         {
             rc = me->clearPipeStall(me->fOutPipe);
@@ -524,6 +660,7 @@ void com_apple_driver_dts_USBCDCEthernet::dataWriteComplete(void *obj, void *par
                 ELG(0, rc, 'dW--', "com_apple_driver_dts_USBCDCEthernet::dataWriteComplete - clear stall failed (trying to continue)");
             }
         }
+        me->completeTransmit(false);
     }
         
     return;
@@ -547,8 +684,10 @@ void com_apple_driver_dts_USBCDCEthernet::dataWriteComplete(void *obj, void *par
 
 void com_apple_driver_dts_USBCDCEthernet::merWriteComplete(void *obj, void *param, IOReturn rc, UInt32 remaining)
 {
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)obj;
     IOUSBDevRequest	*MER = (IOUSBDevRequest*)param;
     UInt16		dataLen;
+    ELG_INSTANCE(me);
 	
     if (MER)
     {
@@ -561,11 +700,7 @@ void com_apple_driver_dts_USBCDCEthernet::merWriteComplete(void *obj, void *para
 		
         dataLen = MER->wLength;
         ELG(0, dataLen, 'mWC ', "com_apple_driver_dts_USBCDCEthernet::merWriteComplete - data length");
-        if ((dataLen != 0) && (MER->pData))
-        {
-            IOFree(MER->pData, dataLen);
-        }
-        IOFree(MER, sizeof(IOUSBDevRequest));
+        me->releaseControlRequest((controlRequest *)MER);
 		
     } else {
         if (rc == kIOReturnSuccess)
@@ -600,6 +735,8 @@ void com_apple_driver_dts_USBCDCEthernet::statsWriteComplete(void *obj, void *pa
     com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)obj;
     IOUSBDevRequest	*STREQ = (IOUSBDevRequest*)param;
     UInt16		currStat;
+    UInt32		statValue;
+    ELG_INSTANCE(me);
 	
     if (STREQ)
     {
@@ -607,46 +744,47 @@ void com_apple_driver_dts_USBCDCEthernet::statsWriteComplete(void *obj, void *pa
         {
             ELG(STREQ->bRequest, remaining, 'sWC+', "com_apple_driver_dts_USBCDCEthernet::statsWriteComplete");
             currStat = STREQ->wValue;
+            statValue = OSReadLittleInt32(STREQ->pData, 0);
             switch(currStat)
             {
                 case kXMIT_OK_REQ:
-                    me->fpNetStats->outputPackets = USBToHostLong(me->fStatValue);
+                    me->fpNetStats->outputPackets = statValue;
                     break;
                 case kRCV_OK_REQ:
-                    me->fpNetStats->inputPackets = USBToHostLong(me->fStatValue);
+                    me->fpNetStats->inputPackets = statValue;
                     break;
                 case kXMIT_ERROR_REQ:
-                    me->fpNetStats->outputErrors = USBToHostLong(me->fStatValue);
+                    me->fpNetStats->outputErrors = statValue;
                     break;
                 case kRCV_ERROR_REQ:
-                    me->fpNetStats->inputErrors = USBToHostLong(me->fStatValue);
+                    me->fpNetStats->inputErrors = statValue;
                     break;
                 case kRCV_CRC_ERROR_REQ:
-                    me->fpEtherStats->dot3StatsEntry.fcsErrors = USBToHostLong(me->fStatValue); 
+                    me->fpEtherStats->dot3StatsEntry.fcsErrors = statValue; 
                     break;
                 case kRCV_ERROR_ALIGNMENT_REQ:
-                    me->fpEtherStats->dot3StatsEntry.alignmentErrors = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.alignmentErrors = statValue;
                     break;
                 case kXMIT_ONE_COLLISION_REQ:
-                    me->fpEtherStats->dot3StatsEntry.singleCollisionFrames = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.singleCollisionFrames = statValue;
                     break;
                 case kXMIT_MORE_COLLISIONS_REQ:
-                    me->fpEtherStats->dot3StatsEntry.multipleCollisionFrames = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.multipleCollisionFrames = statValue;
                     break;
                 case kXMIT_DEFERRED_REQ:
-                    me->fpEtherStats->dot3StatsEntry.deferredTransmissions = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.deferredTransmissions = statValue;
                     break;
                 case kXMIT_MAX_COLLISION_REQ:
-                    me->fpNetStats->collisions = USBToHostLong(me->fStatValue);
+                    me->fpNetStats->collisions = statValue;
                     break;
                 case kRCV_OVERRUN_REQ:
-                    me->fpEtherStats->dot3StatsEntry.frameTooLongs = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.frameTooLongs = statValue;
                     break;
                 case kXMIT_TIMES_CARRIER_LOST_REQ:
-                    me->fpEtherStats->dot3StatsEntry.carrierSenseErrors = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.carrierSenseErrors = statValue;
                     break;
                 case kXMIT_LATE_COLLISIONS_REQ:
-                    me->fpEtherStats->dot3StatsEntry.lateCollisions = USBToHostLong(me->fStatValue);
+                    me->fpEtherStats->dot3StatsEntry.lateCollisions = statValue;
                     break;
                 default:
                     ELG(currStat, rc, 'sWI-', "com_apple_driver_dts_USBCDCEthernet::statsWriteComplete - Invalid stats code");
@@ -657,7 +795,7 @@ void com_apple_driver_dts_USBCDCEthernet::statsWriteComplete(void *obj, void *pa
             ELG(STREQ->bRequest, rc, 'sWC-', "com_apple_driver_dts_USBCDCEthernet::statsWriteComplete - io err");
         }
 		
-        IOFree(STREQ, sizeof(IOUSBDevRequest));
+        me->releaseControlRequest((controlRequest *)STREQ);
     } else {
         if (rc == kIOReturnSuccess)
         {
@@ -667,7 +805,6 @@ void com_apple_driver_dts_USBCDCEthernet::statsWriteComplete(void *obj, void *pa
         }
     }
 	
-    me->fStatValue = 0;
     me->fStatInProgress = false;
     return;
 	
@@ -688,12 +825,11 @@ void com_apple_driver_dts_USBCDCEthernet::statsWriteComplete(void *obj, void *pa
 bool com_apple_driver_dts_USBCDCEthernet::init(OSDictionary *properties)
 {
     UInt32	i;
+    UInt64	now;
 
-    g.evLogBufp = NULL;
-        
 #if USE_ELG
-    AllocateEventLog(kEvLogSize);
-    ELG(&g, g.evLogBufp, 'USBM', "com_apple_driver_dts_USBCDCEthernet::init - event logging set up.");
+    AllocateEventLog(&fEventLog, kEvLogSize);
+    ELG(&fEventLog, fEventLog.evLogBufp, 'USBM', "com_apple_driver_dts_USBCDCEthernet::init - event logging set up.");
 
     waitForService(resourceMatching("kdp"));
 #endif /* USE_ELG */
@@ -709,18 +845,65 @@ bool com_apple_driver_dts_USBCDCEthernet::init(OSDictionary *properties)
         // Set some defaults
     
     fMax_Block_Size = 0x1000;
+    fRxTransferSize = 0;
     fCurrStat = 0;
     fStatInProgress = false;
     fDataDead = false;
     fCommDead = false;
     fPacketFilter = kPACKET_TYPE_DIRECTED | kPACKET_TYPE_BROADCAST | kPACKET_TYPE_MULTICAST;
+    fFlowControl = true;
+    fLRO = true;
+    fRxCopybreak = kDefaultRxCopybreak;
+    fRxBudget = kDefaultRxBudget;
+    rxFilterInit(&fRxFilter);
+    fTxLimit = kTxLimitMax;
+    fTxSlack = UINT_MAX;
+    nanoseconds_to_absolutetime((UInt64)kTxLimitHoldMS * 1000000, &fTxLimitHold);
+    fCoDelTarget = kDefaultCoDelTarget;
+    fCoDelInterval = kDefaultCoDelInterval;
+    setCoDelParams();
+    txPoolInit(&fTxEntries);
+    txFifoInit(&fTxFifo);
+    codelInit(&fCoDel);
+    for (i=0; i<kTxClasses; i++)
+    {
+        txFifoInit(&fTxLanes[i]);
+    }
+    clock_get_uptime(&now);
+    fqInit(&fFQ, kDefaultFQQuantum, (UInt32)now);			// Perturb the flow hash
+    fTxBurst = kDefaultTxBurst;
+    nanoseconds_to_absolutetime((UInt64)kTxPaceSlackUS * 1000, &fPaceSlack);
+    fFlowControlHighWater = kDefaultFlowControlHighWater;
+    fFlowControlLowWater = kDefaultFlowControlLowWater;
     
     for (i=0; i<kOutBufPool; i++)
     {
         fPipeOutBuff[i].pipeOutMDP = NULL;
         fPipeOutBuff[i].pipeOutBuffer = NULL;
         fPipeOutBuff[i].m = NULL;
+        fPipeOutBuff[i].txLength = 0;
+        fPipeOutBuff[i].owner = 0;
+    }
+    for (i=0; i<kInBufPool; i++)
+    {
+        fPipeInBuff[i].pipeInMDP = NULL;
+        fPipeInBuff[i].pipeInBuffer = NULL;
+        fPipeInBuff[i].rxLength = 0;
+    }
+    
+        // The control requests are set up once, only the request specifics change per use
+    
+    for (i=0; i<kControlPoolSize; i++)
+    {
+        bzero(&fControlPool[i], sizeof(controlRequest));
+        fControlPool[i].request.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
+        fControlPool[i].request.pData = fControlPool[i].data;
     }
+    
+        // The checksum kernels for this machine (checked against the reference ones once per load)
+    
+    fChecksum = checksumSelectKernels();
+    setProperty(kChecksumKernelKey, fChecksum->name);
 
     return true;
 
@@ -741,7 +924,8 @@ bool com_apple_driver_dts_USBCDCEthernet::init(OSDictionary *properties)
 
 bool com_apple_driver_dts_USBCDCEthernet::start(IOService *provider)
 {
-    UInt8	configs;	// number of device configurations
+    UInt8		configs;	// number of device configurations
+    OSDictionary	*props;
 
     ELG(this, provider, 'strt', "com_apple_driver_dts_USBCDCEthernet::start - this, provider.");
     if(!super::start(provider))
@@ -749,6 +933,15 @@ bool com_apple_driver_dts_USBCDCEthernet::start(IOService *provider)
         ALERT(0, 0, 'SS--', "com_apple_driver_dts_USBCDCEthernet::start - start super failed");
         return false;
     }
+    
+	// Pick up any tunables from the personality
+    
+    props = dictionaryWithProperties();
+    if (props)
+    {
+        updateConfiguration(props);
+        props->release();
+    }
 
 	// Get my USB device provider - the device
 
@@ -810,10 +1003,12 @@ void com_apple_driver_dts_USBCDCEthernet::free()
 {
 
     ELG(0, 0, 'free', "com_apple_driver_dts_USBCDCEthernet::free");
+    
+    releaseEventSources();					// In case start failed part way
 	
 #if USE_ELG
-    if (g.evLogBuf)
-    	IOFree(g.evLogBuf, kEvLogSize);
+    if (fEventLog.evLogBuf)
+    	IOFree(fEventLog.evLogBuf, kEvLogSize);
 #endif /* USE_ELG */
 
     super::free();
@@ -843,7 +1038,12 @@ void com_apple_driver_dts_USBCDCEthernet::stop(IOService *provider)
         fNetworkInterface->release();
         fNetworkInterface = NULL;
     }
-
+    
+        // Buffers are kept across disable/enable, they go now
+    
+    abortPipes();
+    releaseResources();
+    releaseEventSources();
     
     if (fCommInterface)	
     {
@@ -1301,6 +1501,66 @@ bool com_apple_driver_dts_USBCDCEthernet::createNetworkInterface()
         ALERT(0, 0, 'crt-', "com_apple_driver_dts_USBCDCEthernet::start - Add Timer event source failed");        
         return false;
     }
+    
+        // Completed bulk-in transfers are processed by this one
+        
+    fRxEventSource = IOInterruptEventSource::interruptEventSource(this, rxEventOccurred);
+    if (fRxEventSource == NULL)
+    {
+        ALERT(0, 0, 'crR-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Allocate receive event source failed");
+        return false;
+    }
+    
+    if (fWorkLoop->addEventSource(fRxEventSource) != kIOReturnSuccess)
+    {
+        ALERT(0, 0, 'crr-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Add receive event source failed");
+        return false;
+    }
+    
+        // and the driver's own transmit queue (if it's being used) is drained by this one
+        
+    fTxEventSource = IOInterruptEventSource::interruptEventSource(this, txEventOccurred);
+    if (fTxEventSource == NULL)
+    {
+        ALERT(0, 0, 'crX-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Allocate transmit event source failed");
+        return false;
+    }
+    
+    if (fWorkLoop->addEventSource(fTxEventSource) != kIOReturnSuccess)
+    {
+        ALERT(0, 0, 'crx-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Add transmit event source failed");
+        return false;
+    }
+    
+        // The rate limit restarts transmission with its own timer
+        
+    fShaperTimer = IOTimerEventSource::timerEventSource(this, shaperFired);
+    if (fShaperTimer == NULL)
+    {
+        ALERT(0, 0, 'crS-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Allocate shaper timer failed");
+        return false;
+    }
+    
+    if (fWorkLoop->addEventSource(fShaperTimer) != kIOReturnSuccess)
+    {
+        ALERT(0, 0, 'crs-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Add shaper timer failed");
+        return false;
+    }
+    
+        // and pacing with another, set to the uptime the next frame is due
+        
+    fPaceTimer = IOTimerEventSource::timerEventSource(this, paceFired);
+    if (fPaceTimer == NULL)
+    {
+        ALERT(0, 0, 'crP-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Allocate pacing timer failed");
+        return false;
+    }
+    
+    if (fWorkLoop->addEventSource(fPaceTimer) != kIOReturnSuccess)
+    {
+        ALERT(0, 0, 'crp-', "com_apple_driver_dts_USBCDCEthernet::createNetworkInterface - Add pacing timer failed");
+        return false;
+    }
 
         // Attach an IOEthernetInterface client
         
@@ -1641,6 +1901,65 @@ const OSString* com_apple_driver_dts_USBCDCEthernet::newRevisionString() const
     
 }/* end newRevisionString */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::getFeatures
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - the features supported
+//
+//		Desc:		We take TCP/IPv4 large sends and segment them ourselves
+//				(see transmitSegments)
+//
+/****************************************************************************************************/
+
+UInt32 com_apple_driver_dts_USBCDCEthernet::getFeatures() const
+{
+
+    ELG(0, 0, 'gFea', "com_apple_driver_dts_USBCDCEthernet::getFeatures");
+    
+    return kIONetworkFeatureTSOIPv4;
+    
+}/* end getFeatures */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::getChecksumSupport
+//
+//		Inputs:		checksumMask - where to put the checksums supported
+//				checksumFamily - the family being asked about
+//				isOutput - transmit (true) or receive (false)
+//
+//		Outputs:	Return code - kIOReturnSuccess or kIOReturnUnsupported
+//
+//		Desc:		IPv4, TCP and UDP checksums are computed as the packet is
+//				copied into the output buffer (see copyChecksumPacket). On the
+//				way in TCP/IPv4 checksums are checked while coalescing.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput)
+{
+
+    ELG(checksumFamily, isOutput, 'gCkS', "com_apple_driver_dts_USBCDCEthernet::getChecksumSupport");
+    
+    if (checksumFamily != kChecksumFamilyTCPIP)
+    {
+        return kIOReturnUnsupported;
+    }
+    
+    if (isOutput)
+    {
+        *checksumMask = kChecksumIP | kChecksumTCP | kChecksumUDP;
+    } else {
+        *checksumMask = kChecksumIP | kChecksumTCP;		// Verified while coalescing (see coalesceFrame)
+    }
+    
+    return kIOReturnSuccess;
+    
+}/* end getChecksumSupport */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::setMulticastMode
@@ -1749,9 +2068,38 @@ IOReturn com_apple_driver_dts_USBCDCEthernet::setPromiscuousMode(bool active)
 
 IOOutputQueue* com_apple_driver_dts_USBCDCEthernet::createOutputQueue()
 {
+    OSString	*mode = OSDynamicCast(OSString, getProperty(kTxQueueKey));
+    OSBoolean	*priority = OSDynamicCast(OSBoolean, getProperty(kTxPriorityKey));
+    OSBoolean	*ackThin = OSDynamicCast(OSBoolean, getProperty(kTxAckThinningKey));
 
     ELG(0, 0, 'crOQ', "com_apple_driver_dts_USBCDCEthernet::createOutputQueue" );
     
+    fTxPriority = priority && priority->isTrue();
+    fTxAckThin = ackThin && ackThin->isTrue();
+    
+        // With the driver's own queue outputPacket runs on the workloop, like everything
+        // else that touches that queue
+    
+    if (mode && mode->isEqualTo("CoDel"))
+    {
+        fTxQueueMode = kTxQueueCoDel;
+        return IOGatedOutputQueue::withTarget(this, getWorkLoop(), TRANSMIT_QUEUE_SIZE);
+    }
+    if (mode && mode->isEqualTo("FQ-CoDel"))
+    {
+        fTxQueueMode = kTxQueueFQCoDel;
+        return IOGatedOutputQueue::withTarget(this, getWorkLoop(), TRANSMIT_QUEUE_SIZE);
+    }
+    
+    setProperty(kTxQueueKey, "FIFO");
+    if (fTxPriority || fTxAckThin)
+    {
+        fTxQueueMode = kTxQueueDropTail;			// Lanes and thinning need packets to wait in the driver
+        return IOGatedOutputQueue::withTarget(this, getWorkLoop(), TRANSMIT_QUEUE_SIZE);
+    }
+    
+    fTxQueueMode = kTxQueueFIFO;
+    
     return IOBasicOutputQueue::withTarget(this, TRANSMIT_QUEUE_SIZE);
     
 }/* end createOutputQueue */
@@ -1772,7 +2120,12 @@ IOOutputQueue* com_apple_driver_dts_USBCDCEthernet::createOutputQueue()
 
 UInt32 com_apple_driver_dts_USBCDCEthernet::outputPacket(mbuf_t pkt, void *param)
 {
-    UInt32	ret = kIOReturnOutputSuccess;
+    UInt32		ret = kIOReturnOutputSuccess;
+    UInt64		now;
+    txPacketInfo	info;
+    mbuf_t		dropped;
+    UInt32		txClass = kTxClassNormal;
+    bool		queued = false;
     
     ELG(pkt, 0, 'otPk', "com_apple_driver_dts_USBCDCEthernet::outputPacket" );
 
@@ -1780,10 +2133,47 @@ UInt32 com_apple_driver_dts_USBCDCEthernet::outputPacket(mbuf_t pkt, void *param
     {
         ELG(pkt, fLinkStatus, 'otL-', "com_apple_driver_dts_USBCDCEthernet::outputPacket - link is down" );
         if (fOutputErrsOK)
-            fpNetStats->outputErrors++;
+            fTxErrors++;
         freePacket(pkt);
+    } else if (fTxQueueMode != kTxQueueFIFO) {
+        clock_get_uptime(&now);
+        info.hash = 0;
+        if (fTxPriority || fTxAckThin || (fTxQueueMode == kTxQueueFQCoDel))
+        {
+            txClassify(pkt, fFQ.seed, &info);
+        }
+        if (fTxPriority)
+        {
+            txClass = txPriorityClass(&info);
+        }
+        if (fTxAckThin && txThinnableAck(&info) && txPoolSaturated())
+        {
+            queued = thinAck(pkt, &info, txClass);
+        }
+        if (!queued && (txClass != kTxClassNormal) && (fTxLanes[txClass].count < kTxLaneMax))
+        {
+            queued = txFifoEnqueue(&fTxEntries, &fTxLanes[txClass], pkt, mbuf_pkthdr_len(pkt), info.hash, now);
+        }
+        if (queued)
+        {
+            ELG(pkt, txClass, 'otPr', "com_apple_driver_dts_USBCDCEthernet::outputPacket - Priority lane or thinned");
+        } else if (fTxQueueMode == kTxQueueFQCoDel) {
+            queued = fqEnqueue(&fFQ, &fTxEntries, pkt, mbuf_pkthdr_len(pkt), info.hash, now, &dropped);
+            if (dropped)
+            {
+                freePacket(dropped);				// From the longest flow, to make room
+            }
+        } else {
+            queued = txFifoEnqueue(&fTxEntries, &fTxFifo, pkt, mbuf_pkthdr_len(pkt), info.hash, now);
+        }
+        if (!queued)
+        {
+            fTxQueueFull = true;				// Keep it, serviceTransmit restarts the output queue
+            ret = kIOReturnOutputStall;
+        }
+        serviceTransmit();
     } else { 
-        if (USBTransmitPacket(pkt) == false)
+        if (USBTransmitPacket(pkt, false) == false)
         {
             ret = kIOReturnOutputStall;
         }
@@ -1855,10 +2245,13 @@ bool com_apple_driver_dts_USBCDCEthernet::configureInterface(IONetworkInterface
 bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
 {
     IOReturn 	rtn = kIOReturnSuccess;
+    UInt64	start, resumed, ready, allocated, restored;
+    bool	fastResume;
 
     ELG(0, 0, 'wkUp', "com_apple_driver_dts_USBCDCEthernet::wakeUp");
     
     fReady = false;
+    clock_get_uptime(&start);
     
     if (fTimerSource)
     { 
@@ -1866,6 +2259,7 @@ bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
     }
     
     setLinkStatus(0, 0);				// Initialize the link state
+    fPauseAdvertValid = false;				// The PHY may have been reset, read the advertisement again
     
     if (fbmAttributes & kUSBAtrBusPowered)
     {
@@ -1876,29 +2270,43 @@ bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
         }
     }
     
-    IOSleep(50);
+    clock_get_uptime(&resumed);
+    
+        // Wait for the device to answer rather than sleeping for a fixed time
+    
+    if (!waitForDevice())
+    {
+        ALERT(0, 0, 'wkr-', "com_apple_driver_dts_USBCDCEthernet::wakeUp - Device not responding" );
+        return false;
+    }
+    clock_get_uptime(&ready);
+    
+        // The buffers and pipes are kept while we're attached, unless the transfer size was changed
+    
+    if (fSlabMDP && (fRxTransferSize != 0) && (fRxTransferSize != fRxBlockSize))
+    {
+        releaseResources();
+    }
     
-    if (!allocateResources()) 
+    fastResume = (fSlabMDP != NULL);
+    if (!fastResume && !allocateResources()) 
     {
+        releaseResources();				// Don't leave a half carved slab for the next enable to fast resume with
     	return false;
     }
+    clock_get_uptime(&allocated);
   
     // Initialize RX control register, enable RX
-    UInt8 control = 0;
-    rtn = ReadRegister(RegRCR, sizeof(control), &control);
-    if (rtn != kIOReturnSuccess)
-    {
-      releaseResources();
-      return false;
-    }
-    control &= ~RCRPromiscuous;
-    control |= RCRDiscardLong | RCRDiscardCRC | RCRRXEnable;
-    rtn = Write1Register(RegRCR, control);
-    if (rtn != kIOReturnSuccess)
+    if (!restoreDeviceState())
     {
       releaseResources();
       return false;
     }
+    clock_get_uptime(&restored);
+    
+        // Have clusters ready before the first frame arrives
+    
+    refillRxPool();
   
         // Read the comm interrupt pipe for status:
 		
@@ -1916,9 +2324,14 @@ bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
 			
         fReadCompletionInfo.target = this;
         fReadCompletionInfo.action = dataReadComplete;
-        fReadCompletionInfo.parameter = NULL;
+        fReadCompletionInfo.parameter = NULL;				// filled in with the buffer index when posted
 		
-        rtn = fInPipe->Read(fPipeInMDP, &fReadCompletionInfo, NULL);
+        if (postReads())
+        {
+            fDataDead = false;
+        } else {
+            rtn = kIOReturnIOError;
+        }
 			
         if (rtn == kIOReturnSuccess)
         {
@@ -1926,7 +2339,7 @@ bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
 			
             fWriteCompletionInfo.target	= this;
             fWriteCompletionInfo.action	= dataWriteComplete;
-            fWriteCompletionInfo.parameter = NULL;				// for now, filled in with the mbuf address when sent
+            fWriteCompletionInfo.parameter = NULL;				// sendTxBuffer copies this and fills in the buffer per write
 		
                 // Set up the management element request completion routine:
 
@@ -1961,14 +2374,103 @@ bool com_apple_driver_dts_USBCDCEthernet::wakeUp()
             }
         }
 
-        fTimerSource->setTimeoutMS(WATCHDOG_TIMER_MS);
+            // Start the watchdog with a clean recovery state
+            
+        fRxTroubleTicks = 0;
+        fRecoveryInterval = 0;
+        fRecoveryBackoff = 0;
+        fRecoveryStart = 0;
+
+        fTimerSource->setTimeoutMS(WATCHDOG_TIMER_MS);
         fReady = true;
     }
+    
+    publishStartupTiming(fastResume, start, resumed, ready, allocated, restored);
 
     return true;
 	
 }/* end wakeUp */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::waitForDevice
+//
+//		Inputs:		
+//
+//		Outputs:	Return Code - true(device is answering), false(gave up)
+//
+//		Desc:		Polls the device until it answers a register read (it may take a
+//				little while after being resumed).
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::waitForDevice()
+{
+    UInt32	waited;
+    UInt8	nsr;
+
+    for (waited=0; waited<=kDeviceReadyTimeoutMS; waited+=kDeviceReadyPollMS)
+    {
+        if (ReadRegister(RegNSR, sizeof(nsr), &nsr) == kIOReturnSuccess)
+        {
+            ELG(0, waited, 'wFD+', "com_apple_driver_dts_USBCDCEthernet::waitForDevice - Device ready");
+            return true;
+        }
+        IOSleep(kDeviceReadyPollMS);
+    }
+    
+    return false;
+	
+}/* end waitForDevice */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::publishStartupTiming
+//
+//		Inputs:		fastResume - buffers and pipes were kept
+//				start ... restored - uptime at the end of each bring-up phase
+//
+//		Outputs:	
+//
+//		Desc:		Publishes where the time went during the last wakeUp
+//
+/****************************************************************************************************/
+
+static UInt64 elapsedMicroseconds(UInt64 from, UInt64 to)
+{
+    UInt64	ns;
+    
+    absolutetime_to_nanoseconds(to - from, &ns);
+    return ns / 1000;
+    
+}/* end elapsedMicroseconds */
+
+void com_apple_driver_dts_USBCDCEthernet::publishStartupTiming(bool fastResume, UInt64 start, UInt64 resumed, UInt64 ready, UInt64 allocated, UInt64 restored)
+{
+    OSDictionary	*dict;
+    UInt64		done;
+    
+    clock_get_uptime(&done);
+    
+    dict = OSDictionary::withCapacity(8);
+    if (!dict)
+    {
+        return;
+    }
+    
+    setStatistic(dict, "FastResume", fastResume);
+    setStatistic(dict, "ResumeUS", elapsedMicroseconds(start, resumed));
+    setStatistic(dict, "DeviceReadyUS", elapsedMicroseconds(resumed, ready));
+    setStatistic(dict, "AllocateUS", elapsedMicroseconds(ready, allocated));
+    setStatistic(dict, "RegistersUS", elapsedMicroseconds(allocated, restored));
+    setStatistic(dict, "PipesUS", elapsedMicroseconds(restored, done));
+    setStatistic(dict, "TotalUS", elapsedMicroseconds(start, done));
+    
+    setProperty(kStartupTimingKey, dict);
+    dict->release();
+    
+}/* end publishStartupTiming */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::putToSleep
@@ -1993,12 +2495,27 @@ void com_apple_driver_dts_USBCDCEthernet::putToSleep()
     { 
         fTimerSource->cancelTimeout();
     }
+    if (fShaperTimer)
+    {
+        fShaperTimer->cancelTimeout();
+        fShaperArmed = 0;
+    }
+    if (fPaceTimer)
+    {
+        fPaceTimer->cancelTimeout();
+        fPaceArmed = 0;
+    }
 
     setLinkStatus(0, 0);
 	
-        // Release all resources
+        // Stop all the I/O but keep the buffers and pipes for the next wakeUp,
+        // unless the device is going away
 		
-    releaseResources();
+    abortPipes();
+    if (fTerminate)
+    {
+        releaseResources();
+    }
     
     if (!fTerminate)
     {
@@ -2020,6 +2537,125 @@ void com_apple_driver_dts_USBCDCEthernet::putToSleep()
     
 }/* end putToSleep */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::abortPipes
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Aborts all outstanding I/O and frees any packets still waiting
+//				to be sent.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::abortPipes()
+{
+    UInt32	i;
+
+    ELG(0, 0, 'abPi', "com_apple_driver_dts_USBCDCEthernet::abortPipes");
+    
+    if (fCommPipe)
+    {
+        fCommPipe->Abort();
+    }
+    if (fInPipe)
+    {
+        fRxGeneration++;
+        fInPipe->Abort();
+    }
+    if (fOutPipe)
+    {
+        fOutPipe->Abort();
+    }
+    
+        // Aborted writes free their own mbufs, this catches any that never completed
+    
+    for (i=0; i<kOutBufPool; i++)
+    {
+        releaseTxBuffer(i, 0);
+    }
+    fTxInflight = 0;
+    fTxStalled = false;
+    fTxResume.m = NULL;				// The queue is flushed or restarted from scratch
+    flushTransmitQueue();
+    
+        // Completed transfers that weren't processed are dropped
+    
+    fRxPosted = 0;
+    fRxDone = 0;
+    fRxProcessed = 0;
+    fRxCarryLen = 0;
+    
+}/* end abortPipes */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::getControlRequest
+//
+//		Inputs:		bRequest - the class request
+//				wValue - request value
+//				wLength - length of the inline data
+//
+//		Outputs:	the request block, NULL if the pool is empty
+//
+//		Desc:		Takes a request block from the control pool and fills in the
+//				request specifics. pData already points at the block's inline data.
+//
+/****************************************************************************************************/
+
+controlRequest *com_apple_driver_dts_USBCDCEthernet::getControlRequest(UInt8 bRequest, UInt16 wValue, UInt16 wLength)
+{
+    controlRequest	*ctl;
+    UInt32		i;
+    
+    if (wLength > kControlDataSize)
+    {
+        return NULL;
+    }
+    
+    for (i=0; i<kControlPoolSize; i++)
+    {
+        ctl = &fControlPool[i];
+        if (OSCompareAndSwap(0, 1, &ctl->inUse))
+        {
+            ctl->request.bRequest = bRequest;
+            ctl->request.wValue = wValue;
+            ctl->request.wIndex = fCommInterfaceNumber;
+            ctl->request.wLength = wLength;
+            ctl->request.wLenDone = 0;
+            bzero(ctl->data, wLength);
+            return ctl;
+        }
+    }
+    
+    fControlPoolExhausted++;
+    ELG(0, fControlPoolExhausted, 'gCR-', "com_apple_driver_dts_USBCDCEthernet::getControlRequest - Pool exhausted");
+    
+    return NULL;
+	
+}/* end getControlRequest */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::releaseControlRequest
+//
+//		Inputs:		ctl - the request block
+//
+//		Outputs:	
+//
+//		Desc:		Returns a request block to the control pool
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::releaseControlRequest(controlRequest *ctl)
+{
+    
+    ctl->inUse = 0;
+    
+}/* end releaseControlRequest */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::createMediumTables
@@ -2086,6 +2722,7 @@ bool com_apple_driver_dts_USBCDCEthernet::createMediumTables()
 bool com_apple_driver_dts_USBCDCEthernet::allocateResources()
 {
     IOUSBFindEndpointRequest	epReq;		// endPoint request struct on stack
+    IOByteCount			offset;
     UInt32			i;
 
     ELG(0, 0, 'Allo', "com_apple_driver_dts_USBCDCEthernet::allocateResources.");
@@ -2102,6 +2739,7 @@ bool com_apple_driver_dts_USBCDCEthernet::allocateResources()
         ELG(0, 0, 'inP-', "com_apple_driver_dts_USBCDCEthernet::allocateResources - no bulk input pipe.");
         return false;
     }
+    fInPacketSize = epReq.maxPacketSize;
     ELG(epReq.maxPacketSize << 16 |epReq.interval, fInPipe, 'inP+', "com_apple_driver_dts_USBCDCEthernet::allocateResources - bulk input pipe.");
 
     epReq.direction = kUSBOut;
@@ -2122,53 +2760,117 @@ bool com_apple_driver_dts_USBCDCEthernet::allocateResources()
     if (!fCommPipe)
     {
         ELG(0, 0, 'cmP-', "com_apple_driver_dts_USBCDCEthernet::allocateResources - no interrupt in pipe.");
-        fCommPipeMDP = NULL;
-        fCommPipeBuffer = NULL;
 //        return false;
     } else {
         ELG(epReq.maxPacketSize << 16 |epReq.interval, fCommPipe, 'cmP+', "com_apple_driver_dts_USBCDCEthernet::allocateResources - comm pipe.");
-
-            // Allocate Memory Descriptor Pointer with memory for the Comm pipe:
-
-        fCommPipeMDP = IOBufferMemoryDescriptor::withCapacity(COMM_BUFF_SIZE, kIODirectionIn);
+    }
+    fCommPipeMDP = NULL;
+    fCommPipeBuffer = NULL;
+    
+        // One wired slab holds every buffer, carved up below:
+        //
+        //	comm pipe buffer | data-in buffer pool | carry buffer | data-out buffer pool
+        //
+        // The output buffers only ever hold one frame so they're sized to the MTU, not a page.
+    
+    fRxBlockSize = chooseRxTransferSize();
+    fSlabSize = CACHE_ALIGN(COMM_BUFF_SIZE) + (kInBufPool * CACHE_ALIGN(fRxBlockSize)) + CACHE_ALIGN(kRxCarrySize) + (kOutBufPool * kTxBufferSize);
+    
+    fSlabMDP = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionInOut | kIOMemoryPhysicallyContiguous, fSlabSize, PAGE_SIZE);
+    if (!fSlabMDP)
+    {
+        ELG(0, fSlabSize, 'slb-', "com_apple_driver_dts_USBCDCEthernet::allocateResources - Allocate buffer slab failed");
+        return false;
+    }
+    fSlabMDP->setLength(fSlabSize);
+    bzero(fSlabMDP->getBytesNoCopy(), fSlabSize);
+    ELG(fSlabSize, fSlabMDP->getBytesNoCopy(), 'slab', "com_apple_driver_dts_USBCDCEthernet::allocateResources - buffer slab");
+    
+    offset = 0;
+    
+        // Memory for the Comm pipe:
+    
+    if (fCommPipe)
+    {
+        fCommPipeMDP = carveBuffer(&offset, COMM_BUFF_SIZE, kIODirectionIn, &fCommPipeBuffer);
         if (!fCommPipeMDP)
             return false;
-		
-        fCommPipeMDP->setLength(COMM_BUFF_SIZE);
-        fCommPipeBuffer = (UInt8*)fCommPipeMDP->getBytesNoCopy();
         ELG(0, fCommPipeBuffer, 'cBuf', "com_apple_driver_dts_USBCDCEthernet::allocateResources - comm buffer");
+    } else {
+        offset += CACHE_ALIGN(COMM_BUFF_SIZE);
     }
 
-        // Allocate Memory Descriptor Pointer with memory for the data-in bulk pipe:
+        // Memory for the data-in bulk pipe pool:
 
-    fPipeInMDP = IOBufferMemoryDescriptor::withCapacity(fMax_Block_Size, kIODirectionIn);
-    if (!fPipeInMDP)
-        return false;
-		
-    fPipeInMDP->setLength(fMax_Block_Size);
-    fPipeInBuffer = (UInt8*)fPipeInMDP->getBytesNoCopy();
-    ELG(fMax_Block_Size, fPipeInBuffer, 'iBuf', "com_apple_driver_dts_USBCDCEthernet::allocateResources - input buffer");
+    for (i=0; i<kInBufPool; i++)
+    {
+        fPipeInBuff[i].pipeInMDP = carveBuffer(&offset, fRxBlockSize, kIODirectionIn, &fPipeInBuff[i].pipeInBuffer);
+        if (!fPipeInBuff[i].pipeInMDP)
+            return false;
+        ELG(fRxBlockSize, fPipeInBuff[i].pipeInBuffer, 'iBuf', "com_apple_driver_dts_USBCDCEthernet::allocateResources - input buffer");
+    }
+    fRxPosted = 0;
+    fRxDone = 0;
+    fRxProcessed = 0;
+    
+        // Somewhere to keep a frame that doesn't fit in one transfer (never DMA'd)
     
-        // Allocate Memory Descriptor Pointers with memory for the data-out bulk pipe pool
+    fRxCarry = (UInt8 *)fSlabMDP->getBytesNoCopy() + offset;
+    offset += CACHE_ALIGN(kRxCarrySize);
+    fRxCarryLen = 0;
+    
+        // Memory for the data-out bulk pipe pool
 
     for (i=0; i<kOutBufPool; i++)
     {
-        fPipeOutBuff[i].pipeOutMDP = IOBufferMemoryDescriptor::withCapacity(fMax_Block_Size, kIODirectionOut);
+        fPipeOutBuff[i].pipeOutMDP = carveBuffer(&offset, kTxBufferSize, kIODirectionOut, &fPipeOutBuff[i].pipeOutBuffer);
         if (!fPipeOutBuff[i].pipeOutMDP)
         {
             ELG(0, 0, 'obf-', "com_apple_driver_dts_USBCDCEthernet::allocateResources - Allocate output descriptor failed");
             return false;
         }
-		
-        fPipeOutBuff[i].pipeOutMDP->setLength(fMax_Block_Size);
-        fPipeOutBuff[i].pipeOutBuffer = (UInt8*)fPipeOutBuff[i].pipeOutMDP->getBytesNoCopy();
         ELG(fPipeOutBuff[i].pipeOutMDP, fPipeOutBuff[i].pipeOutBuffer, 'oBuf', "com_apple_driver_dts_USBCDCEthernet::allocateResources - output buffer");
     }
+    
+    fDMAAllocations++;
 		
     return true;
 	
 }/* end allocateResources */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::carveBuffer
+//
+//		Inputs:		offset - where in the slab (updated past the buffer)
+//				length - buffer length
+//				direction - transfer direction
+//
+//		Outputs:	Return code - sub-descriptor for the buffer (NULL if it failed)
+//				buffer - the buffer's address
+//
+//		Desc:		Carves a cache line aligned buffer out of the slab
+//
+/****************************************************************************************************/
+
+IOMemoryDescriptor *com_apple_driver_dts_USBCDCEthernet::carveBuffer(IOByteCount *offset, IOByteCount length, IODirection direction, UInt8 **buffer)
+{
+    IOMemoryDescriptor	*md;
+    
+    md = IOSubMemoryDescriptor::withSubRange(fSlabMDP, *offset, length, direction);
+    if (!md)
+    {
+        ELG(*offset, length, 'crB-', "com_apple_driver_dts_USBCDCEthernet::carveBuffer - Sub-descriptor allocation failed");
+        return NULL;
+    }
+    
+    *buffer = (UInt8 *)fSlabMDP->getBytesNoCopy() + *offset;
+    *offset += CACHE_ALIGN(length);
+    
+    return md;
+    
+}/* end carveBuffer */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::releaseResources
@@ -2186,6 +2888,8 @@ void com_apple_driver_dts_USBCDCEthernet::releaseResources()
     UInt32	i;
     
     ELG(0, 0, 'rlRs', "com_apple_driver_dts_USBCDCEthernet::releaseResources");
+    
+    drainRxPool();
 
     for (i=0; i<kOutBufPool; i++)
     {
@@ -2193,13 +2897,18 @@ void com_apple_driver_dts_USBCDCEthernet::releaseResources()
         { 
             fPipeOutBuff[i].pipeOutMDP->release();	
             fPipeOutBuff[i].pipeOutMDP = NULL;
+            fPipeOutBuff[i].pipeOutBuffer = NULL;
         }
     }
 	
-    if (fPipeInMDP  )	
-    { 
-        fPipeInMDP->release();	
-        fPipeInMDP = 0; 
+    for (i=0; i<kInBufPool; i++)
+    {
+        if (fPipeInBuff[i].pipeInMDP)
+        {
+            fPipeInBuff[i].pipeInMDP->release();
+            fPipeInBuff[i].pipeInMDP = NULL;
+            fPipeInBuff[i].pipeInBuffer = NULL;
+        }
     }
 	
     if (fCommPipeMDP)	
@@ -2207,22 +2916,118 @@ void com_apple_driver_dts_USBCDCEthernet::releaseResources()
         fCommPipeMDP->release();	
         fCommPipeMDP = 0; 
     }
+    
+    fRxCarry = NULL;
+    fRxCarryLen = 0;
+    
+        // The buffers all live in the slab so it goes last
+    
+    if (fSlabMDP)
+    {
+        fSlabMDP->release();
+        fSlabMDP = NULL;
+        fSlabSize = 0;
+    }
 	
 }/* end releaseResources */
 
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::releaseEventSources
+//
+//		Inputs:		None
+//
+//		Outputs:	None
+//
+//		Desc:		Takes the timers and event sources createNetworkInterface added
+//				off the workloop and releases them (and our reference to the
+//				output queue), so nothing can call back into a freed driver.
+//				Safe to call more than once.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::releaseEventSources()
+{
+    
+    ELG(0, 0, 'rlES', "com_apple_driver_dts_USBCDCEthernet::releaseEventSources");
+    
+    if (fTimerSource)
+    {
+        fTimerSource->cancelTimeout();
+        if (fWorkLoop)
+        {
+            fWorkLoop->removeEventSource(fTimerSource);
+        }
+        fTimerSource->release();
+        fTimerSource = NULL;
+    }
+    
+    if (fShaperTimer)
+    {
+        fShaperTimer->cancelTimeout();
+        if (fWorkLoop)
+        {
+            fWorkLoop->removeEventSource(fShaperTimer);
+        }
+        fShaperTimer->release();
+        fShaperTimer = NULL;
+    }
+    
+    if (fPaceTimer)
+    {
+        fPaceTimer->cancelTimeout();
+        if (fWorkLoop)
+        {
+            fWorkLoop->removeEventSource(fPaceTimer);
+        }
+        fPaceTimer->release();
+        fPaceTimer = NULL;
+    }
+    
+    if (fRxEventSource)
+    {
+        fRxEventSource->disable();
+        if (fWorkLoop)
+        {
+            fWorkLoop->removeEventSource(fRxEventSource);
+        }
+        fRxEventSource->release();
+        fRxEventSource = NULL;
+    }
+    
+    if (fTxEventSource)
+    {
+        fTxEventSource->disable();
+        if (fWorkLoop)
+        {
+            fWorkLoop->removeEventSource(fTxEventSource);
+        }
+        fTxEventSource->release();
+        fTxEventSource = NULL;
+    }
+    
+    if (fTransmitQueue)
+    {
+        fTransmitQueue->release();
+        fTransmitQueue = NULL;
+    }
+    
+}/* end releaseEventSources */
+
 /****************************************************************************************************/
 //
 //		Method:		com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket
 //
 //		Inputs:		packet - the packet
+//				priority - it may use the reserved output buffer
 //
-//		Outputs:	Return code - true (transmit started), false (it didn't)
+//		Outputs:	Return code - true (packet consumed), false (no room, stall the queue)
 //
 //		Desc:		Set up and then transmit the packet
 //
 /****************************************************************************************************/
 
-bool com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket(mbuf_t packet)
+bool com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket(mbuf_t packet, bool priority)
 {
 #if LDEBUG
     UInt32		numbufs = 0;			// number of mbufs for this packet
@@ -2230,10 +3035,10 @@ bool com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket(mbuf_t packet)
     mbuf_t m;				// current mbuf
     UInt32		total_pkt_length = 0;
     UInt32		rTotal = 0;
-    IOReturn		ior = kIOReturnSuccess;
     UInt32		poolIndx;
-    bool		gotBuffer = false;
-    UInt16		tryCount = 0;
+    mbuf_tso_request_flags_t	tsoRequest = 0;
+    UInt32		mss = 0;
+    UInt32		demand = 0;
 	
     ELG (0, packet, 'txPk', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket");
 			
@@ -2251,101 +3056,65 @@ bool com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket(mbuf_t packet)
     
     ELG(total_pkt_length, numbufs, 'txTN', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Total packet length and Number of mbufs");
     
-    if (total_pkt_length > fMax_Block_Size)
+        // Large sends are split into MSS sized frames here (the stack leaves the checksums to us),
+        // each one is admitted by the shaper and pacing before it's built
+    
+    if ((mbuf_get_tso_requested(packet, &tsoRequest, &mss) == 0) && (tsoRequest & MBUF_TSO_IPV4))
+    {
+        return transmitSegments(packet, total_pkt_length, mss);
+    }
+    
+    if (total_pkt_length > kTxMaxFrameSize)
     {
         ELG(0, 0, 'txBp', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Bad packet size");	// Note for now and revisit later
         if (fOutputErrsOK)
-            fpNetStats->outputErrors++;
-        return false;
+            fTxErrors++;
+        freePacket(packet);
+        return true;
     }
     
-            // Find an ouput buffer in the pool
+            // Wait if it's over the rate limit or not due yet, then find an ouput buffer in the pool
     
-    while (!gotBuffer)
+    if (!admitFrame(total_pkt_length))
     {
-        for (poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
-        {
-            if (fPipeOutBuff[poolIndx].m == NULL)
-            {
-                gotBuffer = true;
-                break;
-            }
-        }
-        if (gotBuffer)
-        {
-          ELG(0, poolIndx, 'txBT', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Output buffer found");
-            break;
-        } else {
-            tryCount++;
-            if (tryCount > kOutBuffThreshold)
-            {
-                ELG(0, 0, 'txBT', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Exceeded output buffer wait threshold");
-                if (fOutputErrsOK)
-                    fpNetStats->outputErrors++;
-                return false;
-            } else {
-                ELG(0, tryCount, 'txBT', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Waiting for output buffer");
-                IOSleep(1);
-            }
-        }
+        return false;
+    }
+    poolIndx = getTxBuffer(priority);
+    if (poolIndx == kOutBufPool)
+    {
+        return false;
     }
 
-        // Start filling in the send buffer
+        // Start filling in the send buffer, doing any checksums the stack left to us on the way
 
-    m = packet;							// start with the first mbuf of the packet
-    rTotal = 2;							// running total
-    do
-    {  
-        if (mbuf_len(m) == 0)					// Ignore zero length mbufs
-            continue;
+    getChecksumDemand(packet, kChecksumFamilyTCPIP, &demand);
+    if (demand & (kChecksumIP | kChecksumTCP | kChecksumUDP))
+    {
+        if (copyChecksumPacket(fChecksum, packet, total_pkt_length, &fPipeOutBuff[poolIndx].pipeOutBuffer[kTxHeaderSize], demand))
+        {
+            fTxChecksums++;
+        }
+        rTotal = kTxHeaderSize + total_pkt_length;
+    } else {
+        m = packet;						// start with the first mbuf of the packet
+        rTotal = kTxHeaderSize;					// running total
+        do
+        {  
+            if (mbuf_len(m) == 0)				// Ignore zero length mbufs
+                continue;
         
-        bcopy(mbuf_data(m), &fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal], mbuf_len(m));
-        rTotal += mbuf_len(m);
+            bcopy(mbuf_data(m), &fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal], mbuf_len(m));
+            rTotal += mbuf_len(m);
         
-    } while ((m = mbuf_next(m)) != 0);
-  
-    // additional padding byte must be transmitted in case data size
-    // to be send is multiple of pipe's max packet size
-    if ((rTotal % 0x40) == 0)
-    {
-      ELG(0, rTotal, 'txAP', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Additional padding byte added");
-      rTotal++;
-      fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal] = 0;
+        } while ((m = mbuf_next(m)) != 0);
     }
   
     ELG(total_pkt_length, rTotal, 'txAP', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Filling the send buffer");
-  
-    UInt32 tmp = rTotal-2;
-    fPipeOutBuff[poolIndx].pipeOutBuffer[0] = (UInt8)(tmp & 0xff);
-    fPipeOutBuff[poolIndx].pipeOutBuffer[1] = (UInt8)((tmp >> 8) & 0xff);
-  
-    LogData(kUSBOut, rTotal, fPipeOutBuff[poolIndx].pipeOutBuffer);
-	
-    fPipeOutBuff[poolIndx].m = packet;
-    fWriteCompletionInfo.parameter = (void *)poolIndx;
-    fPipeOutBuff[poolIndx].pipeOutMDP->setLength(rTotal);
-    ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, &fWriteCompletionInfo);
-    if (ior != kIOReturnSuccess)
+    
+    if (!sendTxBuffer(poolIndx, rTotal, packet))
     {
-        ELG(0, ior, 'txBp', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Write failed");
-        if (ior == kIOUSBPipeStalled)
-        {
-            fOutPipe->Reset();
-            ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, &fWriteCompletionInfo);
-            if (ior != kIOReturnSuccess)
-            {
-                ELG(0, ior, 'txBp', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Write really failed");
-                if (fOutputErrsOK)
-                    fpNetStats->outputErrors++;
-                return false;
-            }
-        }
+        freePacket(packet);					// Stalling wouldn't help, nothing would restart the queue
     }
-
-    ELG(0, 0, 'txSc', "com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket - Write succeeded");
-  
-    if (fOutputPktsOK)		
-        fpNetStats->outputPackets++;
     
     return true;
 
@@ -2353,583 +3122,3350 @@ bool com_apple_driver_dts_USBCDCEthernet::USBTransmitPacket(mbuf_t packet)
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter
+//		Method:		com_apple_driver_dts_USBCDCEthernet::getTxBuffer
 //
-//		Inputs:		addrs - the list of addresses
-//				count - How many
+//		Inputs:		priority - a priority lane packet
 //
-//		Outputs:	
+//		Outputs:	Return code - index of a free output buffer, kOutBufPool if none
 //
-//		Desc:		Set up and send SetMulticastFilter Management Element Request(MER).
+//		Desc:		Finds a free output buffer if the bytes in flight are under the
+//				limit. If not, the queue is marked stalled and the next write
+//				completion restarts it. The stall is set before looking a
+//				second time so a completion in between can't be missed.
+//				With TxPriority the last kTxReservedBuffers are kept for
+//				priority packets, which don't count against the limit either.
 //
 /****************************************************************************************************/
 
-bool com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter(IOEthernetAddress *addrs, UInt32 count)
+UInt32 com_apple_driver_dts_USBCDCEthernet::getTxBuffer(bool priority)
 {
-#if 1
-  return true;
-#else
-    IOReturn		rc;
-    IOUSBDevRequest	*MER;
-    UInt8		*eaddrs;
-    UInt32		eaddLen;
-    UInt32		i,j,rnum;
-	
-    ELG(fMcFilters, count, 'USMF', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter");
-
-    if (count > (UInt32)(fMcFilters & kFiltersSupportedMask))
+    UInt32		poolIndx;
+    UInt32		found;
+    UInt32		available;
+    bool		stalled = false;
+    
+    while (true)
     {
-        ELG(0, 0, 'USf-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - No multicast filters supported");
-        return false;
+        if (priority || (fTxInflight < fTxLimit))
+        {
+            found = kOutBufPool;
+            available = 0;
+            for (poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
+            {
+                if (fPipeOutBuff[poolIndx].txLength == 0)
+                {
+                    if (found == kOutBufPool)
+                    {
+                        found = poolIndx;
+                    }
+                    available++;
+                }
+            }
+            if ((found != kOutBufPool) && (priority || !fTxPriority || (available > kTxReservedBuffers)))
+            {
+                ELG(0, found, 'txBT', "com_apple_driver_dts_USBCDCEthernet::getTxBuffer - Output buffer found");
+                if (stalled)
+                {
+                    OSCompareAndSwap(1, 0, &fTxStalled);
+                }
+                return found;
+            }
+        }
+        
+        if (stalled)
+        {
+            ELG(fTxInflight, fTxLimit, 'txBS', "com_apple_driver_dts_USBCDCEthernet::getTxBuffer - Stalling");
+            fTxStalls++;
+            return kOutBufPool;
+        }
+        OSCompareAndSwap(0, 1, &fTxStalled);
+        stalled = true;
     }
+    
+}/* end getTxBuffer */
 
-    MER = (IOUSBDevRequest*)IOMalloc(sizeof(IOUSBDevRequest));
-    if (!MER)
-    {
-        ELG(0, 0, 'USM-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - allocate MER failed");
-        return false;
-    }
-    bzero(MER, sizeof(IOUSBDevRequest));
-	
-    eaddLen = count * kIOEthernetAddressSize;
-    eaddrs = (UInt8 *)IOMalloc(eaddLen);
-    if (!eaddrs)
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::sendTxBuffer
+//
+//		Inputs:		poolIndx - the output buffer, frame copied in after the header
+//				rTotal - header plus frame length
+//				packet - the mbuf to free when the write completes (NULL if some other
+//					 buffer owns it)
+//
+//		Outputs:	Return code - true (write started), false (it didn't, buffer is free again)
+//
+//		Desc:		Pads, fills in the length header and writes an output buffer
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::sendTxBuffer(UInt32 poolIndx, UInt32 rTotal, mbuf_t packet)
+{
+    IOReturn		ior = kIOReturnSuccess;
+    UInt32		tmp = rTotal - kTxHeaderSize;
+    UInt32		owner;
+    IOUSBCompletion	completion;
+  
+    // additional padding byte must be transmitted in case data size
+    // to be send is multiple of pipe's max packet size
+    if ((rTotal % 0x40) == 0)
     {
-        ELG(0, 0, 'USA-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - allocate address buffer failed");
-        return false;
+      ELG(0, rTotal, 'txAP', "com_apple_driver_dts_USBCDCEthernet::sendTxBuffer - Additional padding byte added");
+      fPipeOutBuff[poolIndx].pipeOutBuffer[rTotal] = 0;
+      rTotal++;
     }
-    bzero(eaddrs, eaddLen); 
+  
+    fPipeOutBuff[poolIndx].pipeOutBuffer[0] = (UInt8)(tmp & 0xff);
+    fPipeOutBuff[poolIndx].pipeOutBuffer[1] = (UInt8)((tmp >> 8) & 0xff);
+  
+    LogData(kUSBOut, rTotal, fPipeOutBuff[poolIndx].pipeOutBuffer);
 	
-        // Build the filter address buffer
-         
-    rnum = 0;
-    for (i=0; i<count; i++)
+    fPipeOutBuff[poolIndx].m = packet;
+    fPipeOutBuff[poolIndx].txLength = rTotal;
+    fPipeOutBuff[poolIndx].generation++;
+    OSAddAtomic(rTotal, (SInt32 *)&fTxInflight);
+    clock_get_uptime(&fPipeOutBuff[poolIndx].submitTime);
+    owner = kOutBufOwned | (fPipeOutBuff[poolIndx].generation & 0xffffff);
+    OSCompareAndSwap(0, owner, &fPipeOutBuff[poolIndx].owner);		// Publishes the fields above too
+    
+        // Each write gets its own completion, the ZLP write in dataWriteComplete can run at the same time
+    
+    completion = fWriteCompletionInfo;
+    completion.parameter = (void *)(uintptr_t)(poolIndx | ((fPipeOutBuff[poolIndx].generation & 0xffffff) << 8));
+    ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, 0, 0, rTotal, &completion);
+    if (ior != kIOReturnSuccess)
     {
-        if (rnum > eaddLen)				// Just in case
+        ELG(0, ior, 'txBp', "com_apple_driver_dts_USBCDCEthernet::sendTxBuffer - Write failed");
+        if (ior == kIOUSBPipeStalled)
         {
-            break;
+            fOutPipe->Reset();
+            ior = fOutPipe->Write(fPipeOutBuff[poolIndx].pipeOutMDP, 0, 0, rTotal, &completion);
         }
-        for (j=0; j<kIOEthernetAddressSize; j++)
+        if (ior != kIOReturnSuccess)
         {
-            eaddrs[rnum++] = addrs->bytes[j];
+            ELG(0, ior, 'txBp', "com_apple_driver_dts_USBCDCEthernet::sendTxBuffer - Write really failed");
+            fPipeOutBuff[poolIndx].m = NULL;			// The caller still owns the packet
+            releaseTxBuffer(poolIndx, owner);
+            if (fOutputErrsOK)
+                fTxErrors++;
+            return false;
         }
     }
+
+    ELG(0, 0, 'txSc', "com_apple_driver_dts_USBCDCEthernet::sendTxBuffer - Write succeeded");
     
-        // Now build the Management Element Request
-		
-    MER->bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
-    MER->bRequest = kSet_Ethernet_Multicast_Filter;
-    MER->wValue = count;
-    MER->wIndex = fCommInterfaceNumber;
-    MER->wLength = eaddLen;
-    MER->pData = eaddrs;
-	
-    fMERCompletionInfo.parameter = MER;
-	
-    rc = fpDevice->DeviceRequest(MER, &fMERCompletionInfo);
-    if (rc != kIOReturnSuccess)
+    if (fTxRateLimit)
     {
-        ELG(MER->bRequest, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - Error issueing DeviceRequest");
-        IOFree(MER->pData, eaddLen);
-        IOFree(MER, sizeof(IOUSBDevRequest));
-        return false;
+        shaperCharge(rTotal);
+    }
+    if (fTxPacing)
+    {
+        paceCharge(tmp);
     }
+  
+    if (fOutputPktsOK)		
+        fTxPackets++;
     
     return true;
-#endif
-}/* end USBSetMulticastFilter */
+
+}/* end sendTxBuffer */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter
+//		Method:		com_apple_driver_dts_USBCDCEthernet::admitFrame
 //
-//		Inputs:		
+//		Inputs:		frameLength - the Ethernet frame about to be written
 //
-//		Outputs:	
+//		Outputs:	Return code - true (send it), false (stall, a timer restarts the queue)
 //
-//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//		Desc:		Every frame written goes through here first, plain ones from
+//				USBTransmitPacket and each segment of a large send from
+//				transmitSegments, so neither the rate limit nor the pacing can
+//				be bypassed. The tokens and the pacing slot are taken by
+//				sendTxBuffer once the write has started.
 //
 /****************************************************************************************************/
 
-bool com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter()
+bool com_apple_driver_dts_USBCDCEthernet::admitFrame(UInt32 frameLength)
 {
-    IOReturn		rc;
-    UInt8 control = 0;
     
-    ELG(0, fPacketFilter, 'USPF', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter");
+    return shaperAdmit(frameLength) && paceAdmit();
     
-    rc = ReadRegister(RegRCR, sizeof(control), &control);
-    if (rc != kIOReturnSuccess)
+}/* end admitFrame */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::shaperAdmit
+//
+//		Inputs:		frameLength - the Ethernet frame about to be written
+//
+//		Outputs:	Return code - true (send it), false (over the rate limit, stall)
+//
+//		Desc:		Token bucket rate limit on the bulk-out pipe. Tokens are bytes
+//				of transfer, so the DM9601 length header and the padding byte
+//				sendTxBuffer adds are paid for as well. The bucket is refilled
+//				from the time since the last look. If there aren't enough
+//				tokens the shaper timer is set for when there will be, and
+//				restarts the queue - nothing spins waiting.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::shaperAdmit(UInt32 frameLength)
+{
+    UInt64	now, elapsed, rateBytes, full, need, wait;
+    UInt32	transfer = kTxHeaderSize + frameLength;
+    
+    if (fTxRateLimit == 0)
     {
-      ELG(0, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter - Error reading control");
-      return false;
+        return true;
+    }
+    if ((transfer % 0x40) == 0)
+    {
+        transfer++;
     }
     
-    if (fPacketFilter & kPACKET_TYPE_PROMISCUOUS)
-      control |= RCRPromiscuous;
-    else
-      control &= ~RCRPromiscuous;
+    rateBytes = (UInt64)fTxRateLimit * 125;			// kbit/s to bytes/s
+    full = (UInt64)fTxBurst * kShaperScale;
+    need = (UInt64)transfer * kShaperScale;
     
-    if (fPacketFilter & kPACKET_TYPE_ALL_MULTICAST)
-      control |= RCRAllMulticast;
-    else
-      control &= ~RCRAllMulticast;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - fShaperLast, &elapsed);
+    fShaperLast = now;
+    if (elapsed >= (full / rateBytes))				// Long enough to fill it (and keeps the multiply in range)
+    {
+        fShaperCredit = full;
+    } else {
+        fShaperCredit += elapsed * rateBytes;
+        if (fShaperCredit > full)
+        {
+            fShaperCredit = full;
+        }
+    }
     
-    rc = Write1Register(RegRCR, control);
-    if (rc != kIOReturnSuccess)
+    if (fShaperCredit >= need)
     {
-      ELG(0, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter - Error writing control");
-      return false;
+        return true;
     }
-  
-    return true;
-}/* end USBSetPacketFilter */
+    
+    fShaperStalls++;
+    if (OSCompareAndSwap(0, 1, &fShaperArmed))
+    {
+        wait = (need - fShaperCredit) / rateBytes;		// Nanoseconds
+        ELG(transfer, wait, 'shWt', "com_apple_driver_dts_USBCDCEthernet::shaperAdmit - Waiting for tokens");
+        fShaperTimer->setTimeoutUS((UInt32)(wait / 1000) + 1);
+    }
+    
+    return false;
+    
+}/* end shaperAdmit */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::ReadRegister
+//		Method:		com_apple_driver_dts_USBCDCEthernet::shaperCharge
 //
-//		Inputs:
+//		Inputs:		transferLength - bytes written, header and padding included
 //
-//		Outputs:
+//		Outputs:	
 //
-//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//		Desc:		Takes the tokens for a write that's been started
 //
 /****************************************************************************************************/
 
-IOReturn com_apple_driver_dts_USBCDCEthernet::ReadRegister(UInt16 reg, UInt16 size, UInt8* buffer)
+void com_apple_driver_dts_USBCDCEthernet::shaperCharge(UInt32 transferLength)
 {
-  IOUSBDevRequest devreq;
-  IOReturn ior = kIOReturnSuccess;
-  
-  ELG(reg, size, 'RR--', "com_apple_driver_dts_USBCDCEthernet::ReadRegister");
-  
-	if (size > 255)
-		return kIOReturnBadArgument;
-  
-  devreq.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBVendor, kUSBDevice);
-  devreq.bRequest = kVenReqReadRegister;
-  devreq.wValue = 0;
-  devreq.wIndex = reg;
-  devreq.wLength = size;
-  devreq.pData = buffer;
-  devreq.wLenDone = 0;
-  
-  ior = fpDevice->DeviceRequest(&devreq);
-  if (ior != kIOReturnSuccess)
-  {
-    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - DeviceRequest error");
-    if (ior == kIOUSBPipeStalled)
-    {
-      // Clear the stall and try it once more
-      fpDevice->GetPipeZero()->ClearPipeStall(false);
-      ior = fpDevice->DeviceRequest(&devreq);
-      if (ior != kIOReturnSuccess)
-      {
-        ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - DeviceRequest, error a second time");
-        return ior;
-      }
-    }
-  }
-  
-  if (size != devreq.wLenDone)
-  {
-    ELG(size, devreq.wLenDone, 'RRSz', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - Size mismatch reading register !");
-    return kIOReturnUnderrun;
-  }
-  
-	return ior;
-}/* end ReadRegister */
+    UInt64	cost = (UInt64)transferLength * kShaperScale;
+    
+    fShaperCredit = (fShaperCredit > cost) ? (fShaperCredit - cost) : 0;
+    fShaperBytes += transferLength;
+    
+}/* end shaperCharge */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::WriteRegister
+//		Method:		com_apple_driver_dts_USBCDCEthernet::setRateLimit
 //
-//		Inputs:
+//		Inputs:		rate - kbit/s, 0 turns the shaper off
+//				burst - bucket depth, bytes
 //
-//		Outputs:
+//		Outputs:	
 //
-//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//		Desc:		Starts the shaper over with a full bucket
 //
 /****************************************************************************************************/
 
-IOReturn com_apple_driver_dts_USBCDCEthernet::WriteRegister(UInt16 reg, UInt16 size, UInt8* buffer)
+void com_apple_driver_dts_USBCDCEthernet::setRateLimit(UInt32 rate, UInt32 burst)
 {
-  IOUSBDevRequest devreq;
-  IOReturn ior = kIOReturnSuccess;
-  
-  ELG(reg, size, 'WR--', "com_apple_driver_dts_USBCDCEthernet::WriteRegister");
-  
-	if (size > 255)
-		return kIOReturnBadArgument;
-  
-  devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
-  devreq.bRequest = kVenReqWriteRegister;
-  devreq.wValue = 0;
-  devreq.wIndex = reg;
-  devreq.wLength = size;
-  devreq.pData = buffer;
-  devreq.wLenDone = 0;
-  
-  ior = fpDevice->DeviceRequest(&devreq);
-  if (kIOReturnSuccess == ior && devreq.wLenDone != size)
-  {
-    ior = kIOReturnUnderrun;
-  }
-  if (ior != kIOReturnSuccess)
-  {
-    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::WriteRegister - DeviceRequest error");
-  }
-  
-	return ior;
-}/* end WriteRegister */
+    
+    fTxBurst = burst;
+    fShaperCredit = (UInt64)burst * kShaperScale;
+    clock_get_uptime(&fShaperLast);
+    fTxRateLimit = rate;
+    
+}/* end setRateLimit */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::Write1Register
+//		Method:		com_apple_driver_dts_USBCDCEthernet::paceLinkMbps
 //
-//		Inputs:
+//		Inputs:		
 //
-//		Outputs:
+//		Outputs:	the link speed to pace to, Mb/s
 //
-//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//		Desc:		What the PHY last reported, otherwise the selected medium's
+//				speed from mediumTable, otherwise 100
 //
 /****************************************************************************************************/
 
-IOReturn com_apple_driver_dts_USBCDCEthernet::Write1Register(UInt16 reg, UInt8 value)
+UInt32 com_apple_driver_dts_USBCDCEthernet::paceLinkMbps()
 {
-  IOUSBDevRequest devreq;
-  IOReturn ior = kIOReturnSuccess;
-  
-  ELG(reg, value, 'W1R-', "com_apple_driver_dts_USBCDCEthernet::Write1Register");
-  
-  devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
-  devreq.bRequest = kVenReqWriteRegisterByte;
-  devreq.wValue = value;
+    const IONetworkMedium	*medium;
+    
+    if (fLinkMbps)
+    {
+        return fLinkMbps;
+    }
+    
+    medium = getSelectedMedium();
+    if (medium && medium->getSpeed())
+    {
+        return (UInt32)medium->getSpeed();
+    }
+    
+    return 100;
+    
+}/* end paceLinkMbps */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::paceAdmit
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (send it), false (not due yet, stall)
+//
+//		Desc:		Pacing - a frame may go once the one before has had time to
+//				get onto the wire at the paced rate (less kTxPaceSlackUS, the
+//				timer can't do much better). If it's early the pacing timer is
+//				set for when it's due and restarts the queue, and the burst of
+//				frames that went since the last wait is recorded.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::paceAdmit()
+{
+    UInt64	now;
+    
+    if (fTxPacing == 0)
+    {
+        return true;
+    }
+    
+    clock_get_uptime(&now);
+    if ((now + fPaceSlack) >= fPaceNext)
+    {
+        return true;
+    }
+    
+    if (fPaceBurst)
+    {
+        fPaceBursts++;
+        fPaceBurstFrames += fPaceBurst;
+        if (fPaceBurst > fPaceBurstMax)
+        {
+            fPaceBurstMax = fPaceBurst;
+        }
+        fPaceBurst = 0;
+    }
+    fPaceHeld = true;
+    fPaceWaits++;
+    
+    if (OSCompareAndSwap(0, 1, &fPaceArmed))
+    {
+        fPaceTimer->wakeAtTime(fPaceNext);
+    }
+    
+    return false;
+    
+}/* end paceAdmit */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::paceCharge
+//
+//		Inputs:		frameLength - the frame that was just written
+//
+//		Outputs:	
+//
+//		Desc:		Works out when the next frame is due from this one's time on the
+//				wire (padding, preamble, FCS and gap included). If this one had
+//				been held back, how far from its slot it actually went is the
+//				pacing error. Idle time isn't banked, a frame after a quiet spell
+//				is due straight away but the one after it is paced.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::paceCharge(UInt32 frameLength)
+{
+    UInt64	now, error, wire, slot;
+    UInt32	bits;
+    
+    clock_get_uptime(&now);
+    
+    if (fPaceHeld)
+    {
+        absolutetime_to_nanoseconds((now > fPaceNext) ? (now - fPaceNext) : (fPaceNext - now), &error);
+        error /= 1000;
+        fPaceErrors++;
+        fPaceErrorTotal += error;
+        if (error > fPaceErrorMax)
+        {
+            fPaceErrorMax = error;
+        }
+        fPaceHeld = false;
+    }
+    fPaceBurst++;
+    
+    bits = (((frameLength < kTxMinFrameSize) ? kTxMinFrameSize : frameLength) + kTxWireOverhead) * 8;
+    nanoseconds_to_absolutetime(((UInt64)bits * 1000 * 100) / ((UInt64)paceLinkMbps() * fTxPacing), &wire);
+    slot = (fPaceNext > now) ? fPaceNext : now;
+    fPaceNext = slot + wire;
+    
+}/* end paceCharge */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::releaseTxBuffer
+//
+//		Inputs:		poolIndx - the output buffer
+//				owner - tag of the write being released (0 - whichever holds it)
+//
+//		Outputs:	Return code - true (released), false (not held by that write)
+//
+//		Desc:		Frees an output buffer once its write is done (or given up on),
+//				along with the packet if it owns it. The write completion (USB
+//				thread) and the watchdog (workloop) can both try, the owner tag is
+//				claimed atomically so only one of them frees anything.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::releaseTxBuffer(UInt32 poolIndx, UInt32 owner)
+{
+    
+    if (owner == 0)
+    {
+        owner = fPipeOutBuff[poolIndx].owner;
+    }
+    if ((owner == 0) || !OSCompareAndSwap(owner, 0, &fPipeOutBuff[poolIndx].owner))
+    {
+        return false;
+    }
+    
+    if (fPipeOutBuff[poolIndx].m != NULL)
+    {
+        freePacket(fPipeOutBuff[poolIndx].m);
+        fPipeOutBuff[poolIndx].m = NULL;
+    }
+    OSAddAtomic(-(SInt32)fPipeOutBuff[poolIndx].txLength, (SInt32 *)&fTxInflight);
+    fPipeOutBuff[poolIndx].txLength = 0;
+    
+    return true;
+    
+}/* end releaseTxBuffer */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::completeTransmit
+//
+//		Inputs:		success - a write completed (rather than failed or was given up on)
+//
+//		Outputs:	
+//
+//		Desc:		Adapts the in-flight byte limit, a simple form of dynamic queue
+//				limits. If the pipe runs dry while packets are waiting the limit
+//				was too low and goes up a frame. The fewest bytes seen in flight
+//				with packets waiting were never needed to keep the pipe busy,
+//				they're taken off the limit at the end of each hold period.
+//				Then restarts the output queue (or the driver's own) if it
+//				was waiting for room.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::completeTransmit(bool success)
+{
+    UInt32	inflight = fTxInflight;
+    UInt64	now;
+    
+    if (success)
+    {
+        clock_get_uptime(&now);
+        if (fTxStalled)
+        {
+            if ((inflight == 0) && (fTxLimit < kTxLimitMax))
+            {
+                fTxLimit = ((fTxLimit + kTxBufferSize) < kTxLimitMax) ? (fTxLimit + kTxBufferSize) : kTxLimitMax;
+                fTxLimitGrown++;
+                fTxSlack = UINT_MAX;
+                fTxSlackStart = now;
+            } else if (inflight < fTxSlack) {
+                fTxSlack = inflight;
+            }
+        }
+        
+        if ((now - fTxSlackStart) > fTxLimitHold)
+        {
+            if ((fTxSlack != UINT_MAX) && (fTxSlack > 0) && (fTxLimit > kTxLimitMin))
+            {
+                fTxLimit = ((fTxLimit - kTxLimitMin) > fTxSlack) ? (fTxLimit - fTxSlack) : kTxLimitMin;
+                fTxLimitShrunk++;
+            }
+            fTxSlack = UINT_MAX;
+            fTxSlackStart = now;
+        }
+    }
+    
+    if (OSCompareAndSwap(1, 0, &fTxStalled))
+    {
+        ELG(inflight, fTxLimit, 'cTxS', "com_apple_driver_dts_USBCDCEthernet::completeTransmit - Restarting the queue");
+        restartTransmit();
+    }
+    
+}/* end completeTransmit */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::restartTransmit
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Gets a stalled transmit path going again - the output queue, or
+//				the driver's own queue on the workloop
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::restartTransmit()
+{
+    
+    if (fTxQueueMode == kTxQueueFIFO)
+    {
+        fTransmitQueue->service(IOBasicOutputQueue::kServiceAsync);
+    } else {
+        fTxEventSource->interruptOccurred(NULL, NULL, 0);
+    }
+    
+}/* end restartTransmit */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::serviceTransmit
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Sends from the driver's own queue until it's empty or the pipe
+//				is full, CoDel dropping at the head as it goes (of each flow's
+//				queue with FQ-CoDel). The priority lanes go first, strictly -
+//				EF, then ARP, then ACKs. Always on the workloop (outputPacket is
+//				gated in these modes).
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::serviceTransmit()
+{
+    mbuf_t	m, next;
+    mbuf_t	dropped = NULL;
+    UInt64	now, enqueued;
+    UInt32	txClass;
+    bool	high;
+    
+    clock_get_uptime(&now);
+    
+    while (true)
+    {
+        high = true;
+        m = fTxPendingHigh;
+        fTxPendingHigh = NULL;
+        for (txClass=kTxClasses-1; !m && (txClass>kTxClassNormal); txClass--)
+        {
+            m = txFifoDequeue(&fTxEntries, &fTxLanes[txClass], &enqueued);
+            if (m)
+            {
+                noteTxDelay(txClass, now, enqueued);
+            }
+        }
+        
+        if (!m && fTxPending)
+        {
+            high = false;
+            m = fTxPending;					// Already through CoDel
+            fTxPending = NULL;
+        } else if (!m) {
+            high = false;
+            if (fTxQueueMode == kTxQueueFQCoDel)
+            {
+                m = fqDequeue(&fFQ, &fCoDelParams, &fTxEntries, now, &enqueued, &dropped, &fTxQueueDrops);
+            } else if (fTxQueueMode == kTxQueueCoDel) {
+                m = codelDequeue(&fCoDel, &fCoDelParams, &fTxEntries, &fTxFifo, now, &enqueued, &dropped, &fTxQueueDrops);
+            } else {
+                m = txFifoDequeue(&fTxEntries, &fTxFifo, &enqueued);
+            }
+            if (!m)
+            {
+                break;
+            }
+            noteTxDelay(kTxClassNormal, now, enqueued);
+        }
+        
+        if (!USBTransmitPacket(m, high))
+        {
+            if (high)						// The next write completion brings us back
+            {
+                fTxPendingHigh = m;
+            } else {
+                fTxPending = m;
+            }
+            break;
+        }
+    }
+    
+    while (dropped)
+    {
+        next = mbuf_nextpkt(dropped);
+        mbuf_setnextpkt(dropped, NULL);
+        freePacket(dropped);
+        dropped = next;
+    }
+    
+    if (fTxQueueFull && (fTxEntries.freeCount > 0))
+    {
+        fTxQueueFull = false;
+        fTransmitQueue->service(IOBasicOutputQueue::kServiceAsync);
+    }
+    
+}/* end serviceTransmit */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::flushTransmitQueue
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Frees everything waiting in the driver's own queue
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::flushTransmitQueue()
+{
+    mbuf_t	m;
+    UInt64	enqueued;
+    UInt32	i;
+    
+    if (fTxPending)
+    {
+        freePacket(fTxPending);
+        fTxPending = NULL;
+    }
+    if (fTxPendingHigh)
+    {
+        freePacket(fTxPendingHigh);
+        fTxPendingHigh = NULL;
+    }
+    for (i=0; i<kTxClasses; i++)
+    {
+        while ((m = txFifoDequeue(&fTxEntries, &fTxLanes[i], &enqueued)) != NULL)
+        {
+            freePacket(m);
+        }
+    }
+    while ((m = txFifoDequeue(&fTxEntries, &fTxFifo, &enqueued)) != NULL)
+    {
+        freePacket(m);
+    }
+    while ((m = fqRemove(&fFQ, &fTxEntries)) != NULL)
+    {
+        freePacket(m);
+    }
+    codelInit(&fCoDel);
+    fTxQueueFull = false;
+    
+}/* end flushTransmitQueue */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::txPoolSaturated
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (nothing more can be written right now)
+//
+//		Desc:		Every output buffer is busy or the bytes in flight are at the limit
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::txPoolSaturated()
+{
+    UInt32	poolIndx;
+    
+    if (fTxInflight >= fTxLimit)
+    {
+        return true;
+    }
+    for (poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
+    {
+        if (fPipeOutBuff[poolIndx].txLength == 0)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+    
+}/* end txPoolSaturated */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::thinAck
+//
+//		Inputs:		pkt - a thinnable ACK
+//				info - from txClassify
+//				txClass - its priority class
+//
+//		Outputs:	Return code - true (it took an older ACK's place), false (queue it as usual)
+//
+//		Desc:		ACK thinning - when the pipe is full, an ACK that acknowledges
+//				past one still queued for the same flow replaces it. Looks in
+//				the queue the ACK would have gone in.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::thinAck(mbuf_t pkt, const txPacketInfo *info, UInt32 txClass)
+{
+    txFifo	*fifo;
+    mbuf_t	older;
+    
+    if (txClass == kTxClassACK)
+    {
+        fifo = &fTxLanes[kTxClassACK];
+    } else if (fTxQueueMode == kTxQueueFQCoDel) {
+        fifo = fqFlowQueue(&fFQ, info->hash);
+    } else {
+        fifo = &fTxFifo;
+    }
+    
+    if (!txFifoReplaceAck(&fTxEntries, fifo, pkt, mbuf_pkthdr_len(pkt), info, fFQ.seed, &older))
+    {
+        return false;
+    }
+    
+    ELG(older, pkt, 'thAk', "com_apple_driver_dts_USBCDCEthernet::thinAck - Older ACK dropped");
+    freePacket(older);
+    fTxAcksThinned++;
+    
+    return true;
+    
+}/* end thinAck */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::noteTxDelay
+//
+//		Inputs:		txClass - the packet's class
+//				now - uptime
+//				enqueued - when it was queued
+//
+//		Outputs:	
+//
+//		Desc:		Adds a dequeued packet's time in the driver's queue to its class's
+//				statistics
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::noteTxDelay(UInt32 txClass, UInt64 now, UInt64 enqueued)
+{
+    UInt64	sojourn;
+    
+    absolutetime_to_nanoseconds(now - enqueued, &sojourn);
+    sojourn /= 1000;
+    fTxDequeued[txClass]++;
+    fTxSojournTotal[txClass] += sojourn;
+    if (sojourn > fTxSojournMax[txClass])
+    {
+        fTxSojournMax[txClass] = sojourn;
+    }
+    
+}/* end noteTxDelay */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::setCoDelParams
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Converts the configured target and interval to uptime units
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::setCoDelParams()
+{
+    
+    nanoseconds_to_absolutetime((UInt64)fCoDelTarget * 1000, &fCoDelParams.target);
+    nanoseconds_to_absolutetime((UInt64)fCoDelInterval * 1000, &fCoDelParams.interval);
+    fCoDelParams.mtu = kTxMaxFrameSize;
+    
+}/* end setCoDelParams */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::transmitSegments
+//
+//		Inputs:		packet - a TCP/IPv4 large send
+//				length - its length
+//				mss - maximum segment size the stack asked for
+//
+//		Outputs:	Return code - true (packet consumed), false (out of room, try again later)
+//
+//		Desc:		Software TSO. tsoBuildSegment (Checksum.cpp) copies the headers
+//				in front of each MSS sized piece of payload and fixes them up,
+//				checksumming the payload as it's copied into the output buffer.
+//				No segment is longer than an Ethernet frame whatever MSS the
+//				stack asks for. If the queue has to stall part way through,
+//				the queue hands the same packet back later and it carries on
+//				from where it stopped.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::transmitSegments(mbuf_t packet, UInt32 length, UInt32 mss)
+{
+    UInt8		hdr[kTxMaxHeaderSize];
+    tsoHeaders		tso;
+    UInt32		payload, offset, count;
+    UInt32		seq;
+    UInt32		poolIndx;
+    UInt32		segments = 0;
+    bool		last = false;
+    txCursor		cursor;
+    
+    ELG(length, mss, 'txSg', "com_apple_driver_dts_USBCDCEthernet::transmitSegments");
+    
+        // Pick the headers apart
+    
+    count = (length < kTxMaxHeaderSize) ? length : kTxMaxHeaderSize;
+    if ((mbuf_copydata(packet, 0, count, hdr) != 0) || !tsoParseHeaders(hdr, count, mss, &tso))
+    {
+        goto bad;
+    }
+    payload = length - tso.hdrLen;
+    seq = OSReadBigInt32(hdr, tso.ethLen + tso.ipLen + 4);
+    
+        // Picking up a large send that was part sent?
+    
+    offset = 0;
+    if ((fTxResume.m == packet) && (fTxResume.length == length) && (fTxResume.seq == seq))
+    {
+        offset = fTxResume.offset;
+        segments = fTxResume.segments;
+        fTxTSOResumes++;
+    }
+    fTxResume.m = NULL;
+    
+    cursor.m = packet;
+    cursor.offset = 0;
+    advanceCursor(&cursor, tso.hdrLen + offset);
+    
+    do
+    {
+        count = ((payload - offset) < tso.mss) ? (payload - offset) : tso.mss;
+        
+        poolIndx = admitFrame(tso.hdrLen + count) ? getTxBuffer(false) : kOutBufPool;
+        if (poolIndx == kOutBufPool)
+        {
+            fTxResume.m = packet;
+            fTxResume.length = length;
+            fTxResume.seq = seq;
+            fTxResume.offset = offset;
+            fTxResume.segments = segments;
+            return false;
+        }
+        last = ((offset + count) >= payload);
+        
+        tsoBuildSegment(fChecksum, hdr, &tso, &cursor, &fPipeOutBuff[poolIndx].pipeOutBuffer[kTxHeaderSize], offset, count, segments, last);
+        
+        if (!sendTxBuffer(poolIndx, kTxHeaderSize + tso.hdrLen + count, last ? packet : NULL))
+        {
+            last = false;					// The rest of it is dropped
+            break;
+        }
+        segments++;
+        offset += count;
+        
+    } while (!last);
+    
+    fTxTSOPackets++;
+    fTxTSOSegments += segments;
+    
+    if (!last)
+    {
+        ELG(segments, offset, 'txS-', "com_apple_driver_dts_USBCDCEthernet::transmitSegments - Large send cut short");
+        fTxTSOErrors++;
+        freePacket(packet);
+    }
+    
+    return true;
+    
+bad:
+    ELG(0, length, 'txSb', "com_apple_driver_dts_USBCDCEthernet::transmitSegments - Not a TCP/IPv4 large send");
+    fTxTSOErrors++;
+    if (fOutputErrsOK)
+        fTxErrors++;
+    freePacket(packet);
+    
+    return true;
+
+}/* end transmitSegments */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter
+//
+//		Inputs:		addrs - the list of addresses
+//				count - How many
+//
+//		Outputs:	
+//
+//		Desc:		Set up and send SetMulticastFilter Management Element Request(MER).
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter(IOEthernetAddress *addrs, UInt32 count)
+{
+#if 1
+  return true;
+#else
+    IOReturn		rc;
+    controlRequest	*ctl;
+    IOUSBDevRequest	*MER;
+    UInt8		*eaddrs;
+    UInt32		eaddLen;
+    UInt32		i,j,rnum;
+	
+    ELG(fMcFilters, count, 'USMF', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter");
+
+    if (count > (UInt32)(fMcFilters & kFiltersSupportedMask))
+    {
+        ELG(0, 0, 'USf-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - No multicast filters supported");
+        return false;
+    }
+
+    if (count > kControlInlineFilters)
+    {
+        ELG(0, count, 'USf-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - Too many addresses for a request");
+        return false;
+    }
+	
+    eaddLen = count * kIOEthernetAddressSize;
+    ctl = getControlRequest(kSet_Ethernet_Multicast_Filter, count, eaddLen);
+    if (!ctl)
+    {
+        ELG(0, 0, 'USM-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - No control request available");
+        return false;
+    }
+    MER = &ctl->request;
+    eaddrs = ctl->data;
+	
+        // Build the filter address buffer
+         
+    rnum = 0;
+    for (i=0; i<count; i++)
+    {
+        if (rnum > eaddLen)				// Just in case
+        {
+            break;
+        }
+        for (j=0; j<kIOEthernetAddressSize; j++)
+        {
+            eaddrs[rnum++] = addrs[i].bytes[j];
+        }
+    }
+	
+    fMERCompletionInfo.parameter = MER;
+	
+    rc = fpDevice->DeviceRequest(MER, &fMERCompletionInfo);
+    if (rc != kIOReturnSuccess)
+    {
+        ELG(MER->bRequest, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetMulticastFilter - Error issueing DeviceRequest");
+        releaseControlRequest(ctl);
+        return false;
+    }
+    
+    return true;
+#endif
+}/* end USBSetMulticastFilter */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter()
+{
+    IOReturn		rc;
+    UInt8 control = 0;
+    
+    ELG(0, fPacketFilter, 'USPF', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter");
+    
+    if (fRCRValid)
+    {
+      control = fRCR;
+    } else {
+      rc = ReadRegister(RegRCR, sizeof(control), &control);
+      if (rc != kIOReturnSuccess)
+      {
+        ELG(0, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter - Error reading control");
+        return false;
+      }
+    }
+    
+    if (fPacketFilter & kPACKET_TYPE_PROMISCUOUS)
+      control |= RCRPromiscuous;
+    else
+      control &= ~RCRPromiscuous;
+    
+    if (fPacketFilter & kPACKET_TYPE_ALL_MULTICAST)
+      control |= RCRAllMulticast;
+    else
+      control &= ~RCRAllMulticast;
+    
+    rc = Write1Register(RegRCR, control);
+    if (rc != kIOReturnSuccess)
+    {
+      ELG(0, rc, 'USE-', "com_apple_driver_dts_USBCDCEthernet::USBSetPacketFilter - Error writing control");
+      return false;
+    }
+    fRCR = control;
+    fRCRValid = true;
+  
+    return true;
+}/* end USBSetPacketFilter */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::ReadRegister
+//
+//		Inputs:
+//
+//		Outputs:
+//
+//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::ReadRegister(UInt16 reg, UInt16 size, UInt8* buffer)
+{
+  IOUSBDevRequest devreq;
+  IOReturn ior = kIOReturnSuccess;
+  
+  ELG(reg, size, 'RR--', "com_apple_driver_dts_USBCDCEthernet::ReadRegister");
+  
+	if (size > 255)
+		return kIOReturnBadArgument;
+  
+  devreq.bmRequestType = USBmakebmRequestType(kUSBIn, kUSBVendor, kUSBDevice);
+  devreq.bRequest = kVenReqReadRegister;
+  devreq.wValue = 0;
+  devreq.wIndex = reg;
+  devreq.wLength = size;
+  devreq.pData = buffer;
+  devreq.wLenDone = 0;
+  
+  ior = fpDevice->DeviceRequest(&devreq);
+  if (ior != kIOReturnSuccess)
+  {
+    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - DeviceRequest error");
+    if (ior == kIOUSBPipeStalled)
+    {
+      // Clear the stall and try it once more
+      fpDevice->GetPipeZero()->ClearPipeStall(false);
+      ior = fpDevice->DeviceRequest(&devreq);
+      if (ior != kIOReturnSuccess)
+      {
+        ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - DeviceRequest, error a second time");
+        return ior;
+      }
+    }
+  }
+  
+  if (size != devreq.wLenDone)
+  {
+    ELG(size, devreq.wLenDone, 'RRSz', "com_apple_driver_dts_USBCDCEthernet::ReadRegister - Size mismatch reading register !");
+    return kIOReturnUnderrun;
+  }
+  
+	return ior;
+}/* end ReadRegister */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::WriteRegister
+//
+//		Inputs:
+//
+//		Outputs:
+//
+//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::WriteRegister(UInt16 reg, UInt16 size, UInt8* buffer)
+{
+  IOUSBDevRequest devreq;
+  IOReturn ior = kIOReturnSuccess;
+  
+  ELG(reg, size, 'WR--', "com_apple_driver_dts_USBCDCEthernet::WriteRegister");
+  
+	if (size > 255)
+		return kIOReturnBadArgument;
+  
+  devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
+  devreq.bRequest = kVenReqWriteRegister;
+  devreq.wValue = 0;
+  devreq.wIndex = reg;
+  devreq.wLength = size;
+  devreq.pData = buffer;
+  devreq.wLenDone = 0;
+  
+  ior = fpDevice->DeviceRequest(&devreq);
+  if (kIOReturnSuccess == ior && devreq.wLenDone != size)
+  {
+    ior = kIOReturnUnderrun;
+  }
+  if (ior != kIOReturnSuccess)
+  {
+    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::WriteRegister - DeviceRequest error");
+  }
+  
+	return ior;
+}/* end WriteRegister */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::Write1Register
+//
+//		Inputs:
+//
+//		Outputs:
+//
+//		Desc:		Set up and send SetEthernetPackettFilters Management Element Request(MER).
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::Write1Register(UInt16 reg, UInt8 value)
+{
+  IOUSBDevRequest devreq;
+  IOReturn ior = kIOReturnSuccess;
+  
+  ELG(reg, value, 'W1R-', "com_apple_driver_dts_USBCDCEthernet::Write1Register");
+  
+  devreq.bmRequestType = USBmakebmRequestType(kUSBOut, kUSBVendor, kUSBDevice);
+  devreq.bRequest = kVenReqWriteRegisterByte;
+  devreq.wValue = value;
   devreq.wIndex = reg;
   devreq.wLength = 0;
   devreq.pData = NULL;
   devreq.wLenDone = 0;
   
-  ior = fpDevice->DeviceRequest(&devreq);
-  if (ior != kIOReturnSuccess)
-  {
-    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::Write1Register - DeviceRequest error");
-    if (ior == kIOUSBPipeStalled)
+  ior = fpDevice->DeviceRequest(&devreq);
+  if (ior != kIOReturnSuccess)
+  {
+    ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::Write1Register - DeviceRequest error");
+    if (ior == kIOUSBPipeStalled)
+    {
+      // Clear the stall and try it once more
+      fpDevice->GetPipeZero()->ClearPipeStall(false);
+      ior = fpDevice->DeviceRequest(&devreq);
+      if (ior != kIOReturnSuccess)
+      {
+        ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::Write1Register - DeviceRequest, error a second time");
+        return ior;
+      }
+    }
+  }
+  
+	return ior;
+}/* end Write1Register */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::waitPHY
+//
+//		Inputs:
+//
+//		Outputs:	Return code - kIOReturnSuccess or kIOReturnTimeout
+//
+//		Desc:		Waits for an internal PHY register access to complete.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::waitPHY()
+{
+  IOReturn ior;
+  UInt8 status;
+  UInt32 i;
+  
+  for (i=0; i<10; i++)
+  {
+    ior = ReadRegister(RegEPCR, sizeof(status), &status);
+    if (ior != kIOReturnSuccess)
+      return ior;
+    if (!(status & EPCRBusy))
+      return kIOReturnSuccess;
+    IOSleep(1);
+  }
+  
+  ELG(0, status, 'wPH-', "com_apple_driver_dts_USBCDCEthernet::waitPHY - PHY access timed out");
+  
+  return kIOReturnTimeout;
+}/* end waitPHY */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::ReadPHY
+//
+//		Inputs:		reg - the PHY register
+//
+//		Outputs:	value - the register contents
+//
+//		Desc:		Reads an internal PHY register.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::ReadPHY(UInt8 reg, UInt16 *value)
+{
+  IOReturn ior;
+  UInt8 data[2];
+  
+  ELG(0, reg, 'RPHY', "com_apple_driver_dts_USBCDCEthernet::ReadPHY");
+  
+  ior = Write1Register(RegEPAR, EPARIntPHY | (reg & EPARMask));
+  if (ior == kIOReturnSuccess)
+    ior = Write1Register(RegEPCR, EPCROpSelect | EPCRRegRead);
+  if (ior == kIOReturnSuccess)
+    ior = waitPHY();
+  Write1Register(RegEPCR, 0);
+  if (ior == kIOReturnSuccess)
+    ior = ReadRegister(RegEPDRL, sizeof(data), data);
+  if (ior == kIOReturnSuccess)
+    *value = data[0] | (data[1] << 8);
+  
+	return ior;
+}/* end ReadPHY */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::WritePHY
+//
+//		Inputs:		reg - the PHY register, value - what to write
+//
+//		Outputs:
+//
+//		Desc:		Writes an internal PHY register.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::WritePHY(UInt8 reg, UInt16 value)
+{
+  IOReturn ior;
+  UInt8 data[2];
+  
+  ELG(reg, value, 'WPHY', "com_apple_driver_dts_USBCDCEthernet::WritePHY");
+  
+  data[0] = value & 0xff;
+  data[1] = (value >> 8) & 0xff;
+  
+  ior = Write1Register(RegEPAR, EPARIntPHY | (reg & EPARMask));
+  if (ior == kIOReturnSuccess)
+    ior = WriteRegister(RegEPDRL, sizeof(data), data);
+  if (ior == kIOReturnSuccess)
+    ior = Write1Register(RegEPCR, EPCROpSelect | EPCRRegWrite);
+  if (ior == kIOReturnSuccess)
+    ior = waitPHY();
+  Write1Register(RegEPCR, 0);
+  
+	return ior;
+}/* end WritePHY */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::clearPipeStall
+//
+//		Inputs:		thePipe - the pipe
+//
+//		Outputs:	
+//
+//		Desc:		Clear a stall on the specified pipe. All outstanding I/O
+//				is returned as aborted.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::clearPipeStall(IOUSBPipe *thePipe)
+{
+    UInt8	pipeStatus;
+    IOReturn 	rtn = kIOReturnSuccess;
+    
+    ELG(0, thePipe, 'clSt', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall");
+    
+    pipeStatus = thePipe->GetStatus();
+    if (pipeStatus == kPipeStalled)
+    {
+        rtn = thePipe->ClearPipeStall(true);
+        if (rtn == kIOReturnSuccess)
+        {
+            ELG(0, 0, 'clSS', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Successful");
+        } else {
+            ELG(0, rtn, 'clSF', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Failed");
+        }
+    } else {
+        ELG(0, pipeStatus, 'clSP', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Pipe not stalled");
+    }
+    
+    return rtn;
+
+}/* end clearPipeStall */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::postReads
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (reads are outstanding), false (none, the pipe is dead)
+//
+//		Desc:		Posts a read on every bulk-in buffer that's been processed. Called
+//				from the read completion and the workloop, whichever gets the
+//				lock posts for both so the buffers are always posted in turn.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::postReads()
+{
+    pipeInBuffers	*buff;
+    IOReturn		ior = kIOReturnSuccess;
+    
+    fRxPostAgain = true;
+    while (fRxPostAgain && OSCompareAndSwap(0, 1, &fRxPostLock))
+    {
+        fRxPostAgain = false;
+        while ((fRxPosted - fRxProcessed) < kInBufPool)
+        {
+            buff = &fPipeInBuff[fRxPosted % kInBufPool];
+            fReadCompletionInfo.parameter = (void *)(uintptr_t)((fRxPosted % kInBufPool) | ((fRxGeneration & 0xffffff) << 8));
+            ior = fInPipe->Read(buff->pipeInMDP, &fReadCompletionInfo, NULL);
+            if (ior == kIOUSBPipeStalled)
+            {
+                fInPipe->Reset();
+                ior = fInPipe->Read(buff->pipeInMDP, &fReadCompletionInfo, NULL);
+            }
+            if (ior != kIOReturnSuccess)
+            {
+                ELG(fRxPosted, ior, 'pRd-', "com_apple_driver_dts_USBCDCEthernet::postReads - Failed to queue read");
+                break;
+            }
+            OSIncrementAtomic((SInt32 *)&fRxPosted);
+        }
+        OSCompareAndSwap(1, 0, &fRxPostLock);
+    }
+    
+    if ((ior != kIOReturnSuccess) && (fRxPosted == fRxDone))
+    {
+        ELG(0, 0, 'pRdd', "com_apple_driver_dts_USBCDCEthernet::postReads - Failed, read dead");
+        fDataDead = true;
+        return false;
+    }
+    
+    return true;
+    
+}/* end postReads */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::serviceReceive
+//
+//		Inputs:		poll - spin for the next completion when caught up (busy poll)
+//
+//		Outputs:	
+//
+//		Desc:		Hands up the frames in the completed bulk-in transfers, oldest
+//				first. Stops after the transfer that uses up the budget and comes
+//				back once the other event sources have had a turn. Busy polling
+//				spins with the workloop held, so the whole pass gets one busy
+//				poll window however many waits it takes.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::serviceReceive(bool poll)
+{
+    pipeInBuffers	*buff;
+    UInt32		backlog;
+    UInt32		frames = 0;
+    UInt64		now, elapsed;
+    UInt64		pollDeadline = 0;
+    
+    backlog = fRxDone - fRxProcessed;
+    if ((backlog == 0) || (backlog > kInBufPool))		// Nothing to do, or the indexes were reset under us
+    {
+        return;
+    }
+    
+    ELG(backlog, fRxBudget, 'sRcv', "com_apple_driver_dts_USBCDCEthernet::serviceReceive");
+    fRxInService = true;
+    fRxPasses++;
+    if (backlog > fRxBacklogMax)
+    {
+        fRxBacklogMax = backlog;
+    }
+    
+    while ((fRxProcessed != fRxDone) && (frames < fRxBudget))
+    {
+        buff = &fPipeInBuff[fRxProcessed % kInBufPool];
+        
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - buff->doneTime, &elapsed);
+        fRxLatency[rxLatencyBucket(elapsed / 1000)]++;
+        
+        if (buff->rxFailed)
+        {
+            fRxCarryLen = 0;					// The rest of a split frame was in the lost transfer
+        } else if (buff->rxLength) {
+            LogData(kUSBIn, buff->rxLength, buff->pipeInBuffer);
+            frames += receivePacket(buff->pipeInBuffer, buff->rxLength);
+        }
+        
+            // The buffer's been copied, it can go straight back to the pipe
+        
+        OSIncrementAtomic((SInt32 *)&fRxProcessed);
+        if (!fDataDead)
+        {
+            postReads();
+        }
+        
+            // Caught up - hand up what there is and wait a little for more
+        
+        if (poll && (fRxProcessed == fRxDone) && (frames < fRxBudget))
+        {
+            flushReceive();
+            if (pollDeadline == 0)
+            {
+                pollDeadline = now + fBusyPollTime;
+            }
+            if (waitForCompletion(pollDeadline))
+            {
+                fBusyPollHits++;
+            } else {
+                fBusyPollMisses++;
+            }
+        }
+    }
+    
+    flushReceive();
+    fRxInService = false;
+    
+    if (fRxProcessed != fRxDone)
+    {
+        fRxBudgetExhausted++;
+        fRxEventSource->interruptOccurred(NULL, NULL, 0);
+    }
+    
+}/* end serviceReceive */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::receiveInline
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (processed), false (leave it to the workloop)
+//
+//		Desc:		Busy poll mode. Processes the completed transfers in the
+//				completion itself if the workloop is free, saving the trip
+//				through the event source. Never spins, that would hold up the
+//				USB controller's completions.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::receiveInline()
+{
+    bool	done = false;
+    
+    if (!fBusyPollUS || !fWorkLoop->tryCloseGate())
+    {
+        return false;
+    }
+    
+    if (!fRxInService)						// Not if we got here from a read posted by serviceReceive
+    {
+        fRxInline++;
+        serviceReceive(false);
+        done = true;
+    }
+    fWorkLoop->openGate();
+    
+    return done;
+    
+}/* end receiveInline */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::waitForCompletion
+//
+//		Inputs:		deadline - uptime to give up at (the end of the pass's window)
+//
+//		Outputs:	Return code - true (another transfer completed), false (timed out)
+//
+//		Desc:		Spins until the next bulk-in completion or the deadline
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::waitForCompletion(UInt64 deadline)
+{
+    UInt64	now;
+    
+    while ((fRxProcessed == fRxDone) && !fDataDead)
+    {
+        clock_get_uptime(&now);
+        if (now >= deadline)
+        {
+            return false;
+        }
+    }
+    
+    return (fRxProcessed != fRxDone);
+    
+}/* end waitForCompletion */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::receivePacket
+//
+//		Inputs:		packet - the packet
+//				size - Number of bytes in the packet
+//
+//		Outputs:	Return code - number of frames handed up
+//
+//		Desc:		Build the mbufs and then send to the network stack.
+//
+/****************************************************************************************************/
+
+UInt32 com_apple_driver_dts_USBCDCEthernet::receivePacket(UInt8 *packet, UInt32 size)
+{
+    UInt32 length;
+    UInt32 need;
+    UInt32 frames = 0;
+    UInt8 status;
+    UInt8 *ptr = packet;
+    
+    ELG(fRxBlockSize, size, 'rcPk', "com_apple_driver_dts_USBCDCEthernet::receivePacket");
+    
+    if (size > fRxBlockSize)
+    {
+        ELG(0, 0, 'rcP-', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packet size error, packet dropped");
+        if (fInputErrsOK)
+            fRxErrors++;
+        return frames;
+    }
+    
+        // First finish off a frame left over from the previous transfer
+    
+    while ((fRxCarryLen > 0) && (size > 0))
+    {
+      if (fRxCarryLen < kRxHeaderSize)
+      {
+        need = kRxHeaderSize - fRxCarryLen;
+      } else {
+        need = kRxHeaderSize + (fRxCarry[1] | (fRxCarry[2] << 8)) - fRxCarryLen;
+      }
+      if (need > size)
+        need = size;
+      bcopy(ptr, &fRxCarry[fRxCarryLen], need);
+      fRxCarryLen += need;
+      ptr += need;
+      size -= need;
+      
+      if (fRxCarryLen < kRxHeaderSize)
+        break;
+      
+      length = fRxCarry[1] | (fRxCarry[2] << 8);
+      if ((length <= kEthernetCRCSize) || (length > kRxMaxFrameSize))
+      {
+        ELG(length, size, 'rcPc', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Framing error in carried frame, transfer dropped");
+        fRxCarryLen = 0;
+        fRxFramingErrors++;
+        if (fInputErrsOK)
+          fRxErrors++;
+        return frames;
+      }
+      
+      if (fRxCarryLen == kRxHeaderSize + length)
+      {
+        fRxCarried++;
+        inputFrame(fRxCarry[0], &fRxCarry[kRxHeaderSize], length);
+        fRxCarryLen = 0;
+        frames++;
+      }
+    }
+  
+        // Each frame is preceded by its receive status and length (which includes the FCS)
+    
+    while (size >= kRxHeaderSize)
+    {
+      status = ptr[0];
+      length = ptr[1] | (ptr[2] << 8);
+      
+      ELG(status, length, 'rcPl', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packet status and length");
+      
+      if ((length <= kEthernetCRCSize) || (length > kRxMaxFrameSize))
+      {
+        ELG(length, size, 'rcPf', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Framing error, rest of the transfer dropped");
+        fRxFramingErrors++;
+        if (fInputErrsOK)
+          fRxErrors++;
+        return frames;
+      }
+      
+      if (length > size - kRxHeaderSize)
+        break;						// Continues in the next transfer
+      
+      inputFrame(status, ptr + kRxHeaderSize, length);
+      frames++;
+      
+      ptr += kRxHeaderSize + length;
+      size -= kRxHeaderSize + length;
+    }
+    
+        // Keep a partial frame (or header) for the next transfer
+    
+    if (size > 0)
+    {
+      ELG(0, size, 'rcPp', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Frame straddles the transfer");
+      bcopy(ptr, fRxCarry, size);
+      fRxCarryLen = size;
+    }
+    
+    return frames;
+
+}/* end receivePacket */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::inputFrame
+//
+//		Inputs:		status - receive status
+//				frame - the frame
+//				length - its length (FCS included)
+//
+//		Outputs:	
+//
+//		Desc:		Checks the status, builds the mbuf and sends it up the stack.
+//				Frames the receive filter drops never get an mbuf.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::inputFrame(UInt8 status, UInt8 *frame, UInt32 length)
+{
+    mbuf_t	m;
+    UInt32	submit;
+    
+    if (!checkReceiveStatus(status))
+    {
+        return;
+    }
+    
+    length -= kEthernetCRCSize;
+    
+    if (frame[0] & 0x01)					// Group address (multicast or broadcast)
+        fRxMulticast++;
+    
+    if (fRxFilter.active && !rxFilterPass(&fRxFilter, frame, length, fEaddr))
+    {
+        return;
+    }
+    
+    if (fLRO && coalesceFrame(frame, length))
+    {
+        return;
+    }
+    
+    m = copyFrame(frame, length);
+    if (m)
+    {
+        submit = fNetworkInterface->inputPacket(m, length, IONetworkInterface::kInputOptionQueuePacket);
+        ELG(0, submit, 'rcSb', "com_apple_driver_dts_USBCDCEthernet::inputFrame - Packets submitted");
+        if (fInputPktsOK)
+            fRxPackets++;
+    }
+    
+}/* end inputFrame */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::copyFrame
+//
+//		Inputs:		frame - the frame
+//				length - its length
+//
+//		Outputs:	the mbuf, NULL if there wasn't one
+//
+//		Desc:		Copies a received frame into a new mbuf. Small frames go in a
+//				header mbuf (fRxCopybreak is never more than one holds), the rest
+//				in a cluster from the pool if there is one.
+//
+/****************************************************************************************************/
+
+mbuf_t com_apple_driver_dts_USBCDCEthernet::copyFrame(UInt8 *frame, UInt32 length)
+{
+    mbuf_t	m = NULL;
+    
+    if (length <= fRxCopybreak)
+    {
+        if (mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m) == 0)
+        {
+            fRxSmall++;
+        }
+    }
+    
+    if (!m)
+    {
+        if (fRxPoolCount > 0)
+        {
+            m = fRxPool[--fRxPoolCount];
+            fRxPool[fRxPoolCount] = NULL;
+        } else {
+            fRxPoolEmpty++;
+            m = allocatePacket(kRxMaxFrameSize);
+        }
+    }
+    
+    if (m)
+    {
+        bcopy(frame, mbuf_data(m), length);
+        mbuf_setlen(m, length);
+        mbuf_pkthdr_setlen(m, length);
+    } else {
+        ELG(0, 0, 'rcB-', "com_apple_driver_dts_USBCDCEthernet::copyFrame - Buffer allocation failed, packet dropped");
+        fpEtherStats->dot3RxExtraEntry.resourceErrors++;
+        if (fInputErrsOK)
+            fRxErrors++;
+    }
+    
+    return m;
+    
+}/* end copyFrame */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::refillRxPool
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Tops the receive mbuf pool up once it's below the low water mark.
+//				Called at the end of a transfer, never while frames are being copied.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::refillRxPool()
+{
+    mbuf_t	m;
+    
+    if (fRxPoolCount >= kRxPoolLowWater)
+    {
+        return;
+    }
+    
+    while (fRxPoolCount < kRxPoolSize)
+    {
+        m = allocatePacket(kRxMaxFrameSize);
+        if (!m)
+        {
+            ELG(0, fRxPoolCount, 'rRP-', "com_apple_driver_dts_USBCDCEthernet::refillRxPool - Allocation failed");
+            fRxPoolRefillFailures++;
+            break;
+        }
+        fRxPool[fRxPoolCount++] = m;
+    }
+    
+}/* end refillRxPool */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::drainRxPool
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Frees the receive mbuf pool
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::drainRxPool()
+{
+    
+    while (fRxPoolCount > 0)
+    {
+        fRxPoolCount--;
+        freePacket(fRxPool[fRxPoolCount]);
+        fRxPool[fRxPoolCount] = NULL;
+    }
+    
+}/* end drainRxPool */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::coalesceFrame
+//
+//		Inputs:		frame - the frame (FCS removed)
+//				length - its length
+//
+//		Outputs:	Return code - true (we've taken care of it), false (hand it up as is)
+//
+//		Desc:		Software receive coalescing. TCP/IPv4 frames have their checksums
+//				verified (and the stack is told so). In-order segments of the same
+//				flow (same TOS/ECN, TTL and DF) carrying nothing but data, an ACK
+//				and maybe timestamps are appended to one packet, which goes up when
+//				something can't be merged, when the next segment won't fit, or at
+//				the end of the transfer.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::coalesceFrame(UInt8 *frame, UInt32 length)
+{
+    lroSession	*session = NULL;
+    UInt8	*ip, *tcp, *head;
+    UInt32	ethLen, ipTotal, tcpLen, payload, seq, sum, i;
+    UInt8	flags;
+    bool	mergeable;
+    mbuf_t	m;
+    
+        // Only plain TCP/IPv4 (no IP options, not fragmented)
+    
+    ethLen = kIOEthernetAddressSize * 2 + 2;
+    if ((length >= ethLen + 4) && (OSReadBigInt16(frame, 12) == kEtherTypeVLAN))
+    {
+        ethLen += 4;
+    }
+    if ((length < ethLen + 40) || (OSReadBigInt16(frame, ethLen - 2) != kEtherTypeIPv4))
+    {
+        return false;
+    }
+    ip = &frame[ethLen];
+    ipTotal = OSReadBigInt16(ip, 2);
+    if ((ip[0] != 0x45) || (ip[9] != kIPProtocolTCP) || (ipTotal < 40) || (ipTotal > length - ethLen) || (OSReadBigInt16(ip, 6) & 0x3fff))
+    {
+        return false;
+    }
+    tcp = &ip[20];
+    tcpLen = (tcp[12] >> 4) * 4;
+    if ((tcpLen < 20) || (tcpLen > ipTotal - 20))
+    {
+        return false;
+    }
+    
+        // Bad ones go up unmarked and the stack drops them
+    
+    sum = fChecksum->sum(&ip[12], 8, 0, false) + kIPProtocolTCP + (ipTotal - 20);
+    if ((fChecksum->sum(ip, 20, 0, false) != 0xffff) || (fChecksum->sum(tcp, ipTotal - 20, sum, false) != 0xffff))
+    {
+        ELG(0, ipTotal, 'cFc-', "com_apple_driver_dts_USBCDCEthernet::coalesceFrame - Checksum error");
+        fRxChecksumErrors++;
+        return false;
+    }
+    
+    payload = ipTotal - 20 - tcpLen;
+    flags = tcp[13];
+    seq = OSReadBigInt32(tcp, 4);
+    mergeable = (payload != 0) && (flags & kTCPFlagACK) && ((flags & ~(kTCPFlagACK | kTCPFlagPSH)) == 0) &&
+                ((tcpLen == 20) || ((tcpLen == 32) && (OSReadBigInt32(tcp, 20) == kTCPTimestampOption)));
+    
+    for (i=0; i<kLROSessions; i++)
+    {
+        if ((fLROSessions[i].m != NULL) && (bcmp(&ip[12], fLROSessions[i].flow, 8) == 0) && (bcmp(tcp, &fLROSessions[i].flow[8], 4) == 0))
+        {
+            session = &fLROSessions[i];
+            break;
+        }
+    }
+    
+    if (session)
+    {
+        if (!mergeable || (seq != session->nextSeq) || (ethLen != session->ethLen) || (tcpLen != session->tcpLen) ||
+            (ip[1] != session->tos) || (ip[8] != session->ttl) || ((ip[6] & kIPFlagDF) != session->df))
+        {
+            flushSession(session, mergeable ? kLROFlushOrder : kLROFlushFlags);
+        } else if (session->length + payload > kLROMaxLength) {
+            flushSession(session, kLROFlushFull);
+        } else {
+            if (mbuf_copyback(session->m, session->length, payload, &tcp[tcpLen], MBUF_DONTWAIT) != 0)
+            {
+                ELG(0, session->segments, 'cFm-', "com_apple_driver_dts_USBCDCEthernet::coalesceFrame - Couldn't extend, flow dropped");
+                mbuf_freem(session->m);
+                session->m = NULL;
+                fpEtherStats->dot3RxExtraEntry.resourceErrors++;
+                if (fInputErrsOK)
+                    fRxErrors += session->segments + 1;
+                return true;
+            }
+            
+                // The packet carries the latest ACK, window and timestamps
+            
+            head = (UInt8 *)mbuf_data(session->m) + ethLen + 20;
+            bcopy(&tcp[8], &head[8], 4);
+            bcopy(&tcp[14], &head[14], 2);
+            head[13] |= flags & kTCPFlagPSH;
+            if (tcpLen > 20)
+            {
+                bcopy(&tcp[20], &head[20], tcpLen - 20);
+            }
+            
+            session->length += payload;
+            session->segments++;
+            session->nextSeq += payload;
+            fLROMerged++;
+            
+            if (flags & kTCPFlagPSH)
+            {
+                flushSession(session, kLROFlushFlags);
+            } else if (session->segments >= kLROMaxSegments) {
+                flushSession(session, kLROFlushFull);
+            }
+            return true;
+        }
+    }
+    
+    if (!mergeable)
+    {
+        m = copyFrame(frame, length);
+        if (m)
+        {
+            setChecksumResult(m, kChecksumFamilyTCPIP, kChecksumIP | kChecksumTCP, kChecksumIP | kChecksumTCP);
+            fNetworkInterface->inputPacket(m, length, IONetworkInterface::kInputOptionQueuePacket);
+            if (fInputPktsOK)
+                fRxPackets++;
+        }
+        return true;
+    }
+    
+        // Start a new session, handing up the oldest flow if there's no room
+    
+    session = NULL;
+    for (i=0; i<kLROSessions; i++)
+    {
+        if (fLROSessions[i].m == NULL)
+        {
+            session = &fLROSessions[i];
+            break;
+        }
+    }
+    if (!session)
+    {
+        session = &fLROSessions[fLRONext];
+        fLRONext = (fLRONext + 1) % kLROSessions;
+        flushSession(session, kLROFlushEvict);
+    }
+    
+    session->m = copyFrame(frame, ethLen + ipTotal);		// Without any Ethernet padding
+    if (!session->m)
+    {
+        return true;
+    }
+    session->length = ethLen + ipTotal;
+    session->segments = 1;
+    session->nextSeq = seq + payload;
+    bcopy(&ip[12], session->flow, 8);
+    bcopy(tcp, &session->flow[8], 4);
+    session->ethLen = ethLen;
+    session->tcpLen = tcpLen;
+    session->tos = ip[1];
+    session->ttl = ip[8];
+    session->df = ip[6] & kIPFlagDF;
+    
+    if (flags & kTCPFlagPSH)
+    {
+        flushSession(session, kLROFlushFlags);
+    }
+    
+    return true;
+    
+}/* end coalesceFrame */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::flushSession
+//
+//		Inputs:		session - the coalescing session
+//				reason - why it's being flushed (kLROFlush...)
+//
+//		Outputs:	
+//
+//		Desc:		Fixes up the IP header of the merged packet and queues it for the
+//				stack. The TCP checksum in it is stale, it's marked as verified.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::flushSession(lroSession *session, UInt32 reason)
+{
+    UInt8	*ip;
+    
+    if (session->m == NULL)
+    {
+        return;
+    }
+    
+    ELG(session->segments, reason, 'fSes', "com_apple_driver_dts_USBCDCEthernet::flushSession");
+    
+    if (session->segments > 1)
+    {
+        ip = (UInt8 *)mbuf_data(session->m) + session->ethLen;
+        OSWriteBigInt16(ip, 2, session->length - session->ethLen);
+        OSWriteBigInt16(ip, 10, 0);
+        OSWriteBigInt16(ip, 10, ~fChecksum->sum(ip, 20, 0, false));
+        fLROPackets++;
+    }
+    
+    mbuf_pkthdr_setlen(session->m, session->length);
+    setChecksumResult(session->m, kChecksumFamilyTCPIP, kChecksumIP | kChecksumTCP, kChecksumIP | kChecksumTCP);
+    fNetworkInterface->inputPacket(session->m, 0, IONetworkInterface::kInputOptionQueuePacket);	// Length's set, it may be a chain
+    if (fInputPktsOK)
+        fRxPackets += session->segments;
+    
+    fLROFlushes[reason]++;
+    session->m = NULL;
+    
+}/* end flushSession */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::flushReceive
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		End of a receive pass, everything received goes up the stack
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::flushReceive()
+{
+    UInt32	i;
+    
+    for (i=0; i<kLROSessions; i++)
+    {
+        flushSession(&fLROSessions[i], kLROFlushBatch);
+    }
+    
+    fNetworkInterface->flushInputQueue();
+    
+    refillRxPool();
+    
+}/* end flushReceive */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::chooseRxTransferSize
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - bulk-in transfer size
+//
+//		Desc:		Uses the configured size if there is one, otherwise picks one from
+//				the endpoint's max packet size and the link speed. Bigger transfers
+//				let several frames come up in one completion on faster buses.
+//
+/****************************************************************************************************/
+
+UInt32 com_apple_driver_dts_USBCDCEthernet::chooseRxTransferSize()
+{
+    UInt32	blockSize;
+    UInt8	nsr = 0;
+    bool	slowLink = false;
+    
+    if (fRxTransferSize != 0)
+    {
+        return fRxTransferSize;
+    }
+    
+    if ((ReadRegister(RegNSR, sizeof(nsr), &nsr) == kIOReturnSuccess) && (nsr & NSRLinkUp))
+    {
+        slowLink = (nsr & NSRSpeed10) != 0;
+    }
+    
+    if (fInPacketSize >= 512)					// High speed endpoint
+    {
+        blockSize = slowLink ? 0x2000 : kRxMaxTransferSize;
+    } else {
+        blockSize = slowLink ? kRxMinTransferSize : 0x1000;
+    }
+    
+    ELG(fInPacketSize, blockSize, 'cRTS', "com_apple_driver_dts_USBCDCEthernet::chooseRxTransferSize");
+    
+    return blockSize;
+    
+}/* end chooseRxTransferSize */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::checkReceiveStatus
+//
+//		Inputs:		status - the frame's receive status byte (RSR)
+//
+//		Outputs:	Return code - true (frame is usable), false (drop it)
+//
+//		Desc:		Decodes the receive status, counting each condition in the
+//				matching Ethernet statistic.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::checkReceiveStatus(UInt8 status)
+{
+
+    if (!(status & RSRDropMask))
+    {
+        return true;
+    }
+    
+    ELG(0, status, 'cRS-', "com_apple_driver_dts_USBCDCEthernet::checkReceiveStatus - Receive error, packet dropped");
+    
+    if (status & RSRFIFOOverflow)
+        fpEtherStats->dot3RxExtraEntry.overruns++;
+    if (status & RSRCRCError)
+        fpEtherStats->dot3StatsEntry.fcsErrors++;
+    if (status & RSRAlignError)
+        fpEtherStats->dot3StatsEntry.alignmentErrors++;
+    if (status & RSRPhyError)
+        fpEtherStats->dot3RxExtraEntry.phyErrors++;
+    if (status & RSRWatchdogTimeout)
+    {
+        fpEtherStats->dot3RxExtraEntry.watchdogTimeouts++;
+        fpEtherStats->dot3StatsEntry.frameTooLongs++;
+    }
+    if (status & RSRRuntFrame)
+        fpEtherStats->dot3RxExtraEntry.frameTooShorts++;
+    if (status & RSRLateCollision)
+        fpEtherStats->dot3RxExtraEntry.collisionErrors++;
+    
+    if (fInputErrsOK)
+        fRxErrors++;
+    
+    return false;
+    
+}/* end checkReceiveStatus */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::timeoutFired
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Static member function called when a timer event fires.
+//
+/****************************************************************************************************/
+void com_apple_driver_dts_USBCDCEthernet::timerFired(OSObject *owner, IOTimerEventSource *sender)
+{
+
+//    ELG(0, 0, 'tmFd', "com_apple_driver_dts_USBCDCEthernet::timerFired");
+    
+    if (owner)
+    {
+	com_apple_driver_dts_USBCDCEthernet* target = OSDynamicCast(com_apple_driver_dts_USBCDCEthernet, owner);
+	
+	if (target)
+	{
+	    target->timeoutOccurred(sender);
+	}
+    }
+    
+}/* end timerFired */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::timeoutOccurred
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Timeout handler, used for stats gathering.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::timeoutOccurred(IOTimerEventSource * /*timer*/)
+{
+    UInt32		*enetStats;
+    UInt16		currStat;
+    IOReturn		rc;
+    controlRequest	*ctl;
+    IOUSBDevRequest	*STREQ;
+    bool		statOk = false;
+
+    ELG(0, 0, 'tmOd', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred");
+    
+    if (fReady == false)
+    {
+        ELG(0, 0, 'tmS-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - Spurious");    
+    } else {
+    
+            // Make sure the pipes are still alive before anything else
+    
+        checkDataPath();
+        checkTransmitTimeouts();
+        foldNetStats();
+        updateFlowControlStats();
+        publishStatistics();
+    
+        enetStats = (UInt32 *)&fEthernetStatistics;
+        if (*enetStats == 0)
+        {
+            ELG(0, 0, 'tmN-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - No Ethernet statistics defined");
+        }
+    
+            // Only do it if it's not already in progress
+    
+        if ((*enetStats != 0) && !fStatInProgress)
+        {
+
+                // Check if the stat we're currently interested in is supported
+            
+            currStat = stats[fCurrStat++];
+            if (fCurrStat >= numStats)
+            {
+                fCurrStat = 0;
+            }
+            switch(currStat)
+            {
+                case kXMIT_OK_REQ:
+                    if (fEthernetStatistics[0] & kXMIT_OK)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kRCV_OK_REQ:
+                    if (fEthernetStatistics[0] & kRCV_OK)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_ERROR_REQ:
+                    if (fEthernetStatistics[0] & kXMIT_ERROR_REQ)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kRCV_ERROR_REQ:
+                    if (fEthernetStatistics[0] & kRCV_ERROR_REQ)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kRCV_CRC_ERROR_REQ:
+                    if (fEthernetStatistics[2] & kRCV_CRC_ERROR)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kRCV_ERROR_ALIGNMENT_REQ:
+                    if (fEthernetStatistics[2] & kRCV_ERROR_ALIGNMENT)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_ONE_COLLISION_REQ:
+                    if (fEthernetStatistics[2] & kXMIT_ONE_COLLISION)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_MORE_COLLISIONS_REQ:
+                    if (fEthernetStatistics[2] & kXMIT_MORE_COLLISIONS)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_DEFERRED_REQ:
+                    if (fEthernetStatistics[2] & kXMIT_DEFERRED)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_MAX_COLLISION_REQ:
+                    if (fEthernetStatistics[2] & kXMIT_MAX_COLLISION)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kRCV_OVERRUN_REQ:
+                    if (fEthernetStatistics[3] & kRCV_OVERRUN)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_TIMES_CARRIER_LOST_REQ:
+                    if (fEthernetStatistics[3] & kXMIT_TIMES_CARRIER_LOST)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                case kXMIT_LATE_COLLISIONS_REQ:
+                    if (fEthernetStatistics[3] & kXMIT_LATE_COLLISIONS)
+                    {
+                        statOk = true;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (statOk)
+        {
+            ctl = getControlRequest(kGet_Ethernet_Statistics, currStat, sizeof(UInt32));
+            if (!ctl)
+            {
+                ELG(0, 0, 'tma-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - No control request available");
+            } else {
+                STREQ = &ctl->request;
+                fStatsCompletionInfo.parameter = STREQ;
+	
+                rc = fpDevice->DeviceRequest(STREQ, &fStatsCompletionInfo);
+                if (rc != kIOReturnSuccess)
+                {
+                    ELG(STREQ->bRequest, rc, 'tmE-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - Error issueing DeviceRequest");
+                    releaseControlRequest(ctl);
+                } else {
+                    fStatInProgress = true;
+                }
+            }
+        }
+    }
+
+        // Restart the watchdog timer
+        
+    fTimerSource->setTimeoutMS(WATCHDOG_TIMER_MS);
+
+}/* end timeoutOccurred */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::checkDataPath
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Called every watchdog tick. Detects dead or failing pipes and drives
+//				the recovery state machine (with backoff between attempts). A quiet
+//				link isn't a reason to recover, reads may legitimately stay
+//				posted for as long as nothing arrives.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::checkDataPath()
+{
+    UInt32	rxCount = fRxCompletions;
+    UInt32	errCount = fRxReadErrors;
+    UInt64	now, elapsed;
+    bool	failing, stuck;
+    
+        // Reads failing, or not all of them queued (outside a receive pass),
+        // with nothing received is trouble. Receive progress ends it and
+        // relaxes the backoff.
+    
+    failing = (errCount != fLastRxReadErrors) || (!fRxInService && ((fRxPosted - fRxProcessed) < kInBufPool));
+    if (rxCount != fLastRxCompletions)
+    {
+        fRxTroubleTicks = 0;
+        fRecoveryInterval = 0;
+    } else if (failing) {
+        fRxTroubleTicks++;
+    } else {
+        fRxTroubleTicks = 0;
+    }
+    fLastRxCompletions = rxCount;
+    fLastRxReadErrors = errCount;
+    
+    stuck = fDataDead || fCommDead || (fRxTroubleTicks >= kRecoveryTroubleTicks);
+    
+    clock_get_uptime(&now);
+    
+    if (!stuck)
+    {
+        if (fRecoveryStart)
+        {
+            absolutetime_to_nanoseconds(now - fRecoveryStart, &elapsed);
+            fRecoveryTimeMS += elapsed / 1000000;
+            fRecoveryStart = 0;
+            ELG(fRecoveryCount, fRecoveryTimeMS, 'cDP+', "com_apple_driver_dts_USBCDCEthernet::checkDataPath - Data path recovered");
+        }
+        return;
+    }
+    
+    if (fRecoveryStart == 0)
+    {
+        fRecoveryStart = now;
+    }
+    
+    if (fRecoveryBackoff > 0)
+    {
+        fRecoveryBackoff--;
+        return;
+    }
+    
+    ELG(fDataDead << 8 | fCommDead, fRxTroubleTicks, 'cDP-', "com_apple_driver_dts_USBCDCEthernet::checkDataPath - Data path stuck, recovering");
+    
+    if (recoverDataPath())
+    {
+        fRecoveryCount++;
+        fRxTroubleTicks = 0;
+    } else {
+        ALERT(fDataDead << 8 | fCommDead, fRecoveryFailures, 'cDPf', "com_apple_driver_dts_USBCDCEthernet::checkDataPath - Recovery attempt failed");
+        fRecoveryFailures++;
+    }
+    
+        // Back off before trying again (1, 2, 4 ... kRecoveryMaxBackoff ticks)
+    
+    if (fRecoveryInterval == 0)
+    {
+        fRecoveryInterval = 1;
+    } else {
+        fRecoveryInterval <<= 1;
+        if (fRecoveryInterval > kRecoveryMaxBackoff)
+        {
+            fRecoveryInterval = kRecoveryMaxBackoff;
+        }
+    }
+    fRecoveryBackoff = fRecoveryInterval;
+    
+}/* end checkDataPath */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::foldNetStats
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Called every watchdog tick. The receive and transmit paths count
+//				into their own blocks, what they've counted since the last tick
+//				is added to the interface statistics here.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::foldNetStats()
+{
+    UInt32	rxPackets = fRxPackets;
+    UInt32	rxErrors = fRxErrors;
+    UInt32	txPackets = fTxPackets;
+    UInt32	txErrors = fTxErrors;
+    
+    fpNetStats->inputPackets += rxPackets - fRxPacketsFolded;
+    fpNetStats->inputErrors += rxErrors - fRxErrorsFolded;
+    fpNetStats->outputPackets += txPackets - fTxPacketsFolded;
+    fpNetStats->outputErrors += txErrors - fTxErrorsFolded;
+    fRxPacketsFolded = rxPackets;
+    fRxErrorsFolded = rxErrors;
+    fTxPacketsFolded = txPackets;
+    fTxErrorsFolded = txErrors;
+    
+}/* end foldNetStats */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::checkTransmitTimeouts
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Called every watchdog tick. Bulk-out transfers that have been
+//				outstanding longer than kTxTimeoutMS are aborted and their
+//				buffers returned to the pool so the transmit path can't wedge.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::checkTransmitTimeouts()
+{
+    UInt64	now, timeout;
+    UInt32	poolIndx;
+    UInt32	owner;
+    UInt32	hung = 0;
+    
+    nanoseconds_to_absolutetime((UInt64)kTxTimeoutMS * 1000000, &timeout);
+    clock_get_uptime(&now);
+    
+    for (poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
+    {
+        if ((fPipeOutBuff[poolIndx].txLength != 0) && ((now - fPipeOutBuff[poolIndx].submitTime) > timeout))
+        {
+            hung++;
+        }
+    }
+    
+    if (hung == 0)
+    {
+        return;
+    }
+    
+    ALERT(hung, fTxTimeouts, 'cTT-', "com_apple_driver_dts_USBCDCEthernet::checkTransmitTimeouts - Bulk-out transfers hung, aborting");
+    fTxTimeouts += hung;
+    
+        // Aborted writes complete with kIOReturnAborted and free their own mbufs
+    
+    fOutPipe->Abort();
+    
+        // Anything still held never completed, drop it. Whichever of us and the aborted
+        // completion claims the buffer first frees it, the other leaves it alone
+    
+    for (poolIndx=0; poolIndx<kOutBufPool; poolIndx++)
+    {
+        owner = fPipeOutBuff[poolIndx].owner;			// Read first so a write queued meanwhile isn't dropped
+        if ((owner != 0) && ((now - fPipeOutBuff[poolIndx].submitTime) > timeout) && releaseTxBuffer(poolIndx, owner))
+        {
+            fTxTimeoutDrops++;
+            if (fOutputErrsOK)
+                fTxErrors++;
+        }
+    }
+    
+    if (fOutPipe->ClearPipeStall(true) != kIOReturnSuccess)
+    {
+        ELG(0, 0, 'cTTc', "com_apple_driver_dts_USBCDCEthernet::checkTransmitTimeouts - Output pipe reset failed");
+    }
+    
+    completeTransmit(false);					// Buffers were freed, get the queue going again
+    
+}/* end checkTransmitTimeouts */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::recoverDataPath
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (pipes running again), false (failed)
+//
+//		Desc:		Aborts all outstanding I/O, resets the pipes, restores the device
+//				registers and rebuilds the posted reads.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::recoverDataPath()
+{
+    IOReturn	rtn;
+
+    ELG(fDataDead, fCommDead, 'rDP ', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath");
+    
+        // Abort everything outstanding. The completions come back with kIOReturnAborted
+        // and don't requeue (write completions free their mbufs)
+    
+    if (fCommPipe)
+    {
+        fCommPipe->Abort();
+    }
+    fRxGeneration++;
+    fInPipe->Abort();
+    fOutPipe->Abort();
+    fRxCarryLen = 0;
+    
+        // Reset the pipes, clearing the halt on the device side as well
+    
+    if (fCommPipe)
+    {
+        rtn = fCommPipe->ClearPipeStall(true);
+        if (rtn != kIOReturnSuccess)
+        {
+            ELG(0, rtn, 'rDPc', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Comm pipe reset failed");
+            return false;
+        }
+    }
+    
+    rtn = fInPipe->ClearPipeStall(true);
+    if (rtn != kIOReturnSuccess)
     {
-      // Clear the stall and try it once more
-      fpDevice->GetPipeZero()->ClearPipeStall(false);
-      ior = fpDevice->DeviceRequest(&devreq);
-      if (ior != kIOReturnSuccess)
-      {
-        ELG(devreq.bRequest, ior, 'USE-', "com_apple_driver_dts_USBCDCEthernet::Write1Register - DeviceRequest, error a second time");
-        return ior;
-      }
+        ELG(0, rtn, 'rDPi', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Input pipe reset failed");
+        return false;
+    }
+    
+    rtn = fOutPipe->ClearPipeStall(true);
+    if (rtn != kIOReturnSuccess)
+    {
+        ELG(0, rtn, 'rDPo', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Output pipe reset failed");
+        return false;
+    }
+    
+        // Put the receiver and filters back the way they were
+    
+    if (!restoreDeviceState() || !USBSetPacketFilter())
+    {
+        ELG(0, 0, 'rDPr', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Restoring device state failed");
+        return false;
+    }
+    fRxPosted = 0;						// Whatever was in flight is gone
+    fRxDone = 0;
+    fRxProcessed = 0;
+    
+        // Rebuild the posted reads
+    
+    if (fCommPipe)
+    {
+        rtn = fCommPipe->Read(fCommPipeMDP, &fCommCompletionInfo, NULL);
+        if (rtn != kIOReturnSuccess)
+        {
+            ELG(0, rtn, 'rDPC', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Failed to queue Comm pipe read");
+            fCommDead = true;
+            return false;
+        }
+    }
+    fCommDead = false;
+    
+    if (!postReads())
+    {
+        ELG(0, 0, 'rDPD', "com_apple_driver_dts_USBCDCEthernet::recoverDataPath - Failed to queue Data pipe read");
+        return false;
+    }
+    fDataDead = false;
+    
+    return true;
+
+}/* end recoverDataPath */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::restoreDeviceState
+//
+//		Inputs:		
+//
+//		Outputs:	Return code - true (registers written), false (failed)
+//
+//		Desc:		Initializes the RX control register and enables the receiver.
+//				Used when waking up and after a data path recovery.
+//
+/****************************************************************************************************/
+
+bool com_apple_driver_dts_USBCDCEthernet::restoreDeviceState()
+{
+    IOReturn	rtn;
+    UInt8	control = 0;
+
+    ELG(0, fRCR, 'rDSt', "com_apple_driver_dts_USBCDCEthernet::restoreDeviceState");
+    
+        // Only the first time round do we need to ask the device, after that we know
+    
+    if (fRCRValid)
+    {
+        control = fRCR;
+    } else {
+        rtn = ReadRegister(RegRCR, sizeof(control), &control);
+        if (rtn != kIOReturnSuccess)
+        {
+            ELG(0, rtn, 'rDS-', "com_apple_driver_dts_USBCDCEthernet::restoreDeviceState - Error reading control");
+            return false;
+        }
+        control &= ~RCRPromiscuous;
+    }
+    control |= RCRDiscardLong | RCRDiscardCRC | RCRRXEnable;
+    rtn = Write1Register(RegRCR, control);
+    if (rtn != kIOReturnSuccess)
+    {
+        ELG(0, rtn, 'rDS-', "com_apple_driver_dts_USBCDCEthernet::restoreDeviceState - Error writing control");
+        return false;
+    }
+    fRCR = control;
+    fRCRValid = true;
+    
+    if (!applyFlowControl())
+    {
+        ELG(0, 0, 'rDSf', "com_apple_driver_dts_USBCDCEthernet::restoreDeviceState - Flow control setup failed (continuing)");
+    }
+    
+    return true;
+
+}/* end restoreDeviceState */
+
+/****************************************************************************************************/
+//
+//		Function:	averageDelay
+//
+//		Inputs:		total - summed delay
+//				count - over how many packets
+//
+//		Outputs:	the average, 0 if there weren't any
+//
+//		Desc:		For the queueing delay statistics
+//
+/****************************************************************************************************/
+
+static UInt64 averageDelay(UInt64 total, UInt32 count)
+{
+    
+    return count ? (total / count) : 0;
+    
+}/* end averageDelay */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::publishStatistics
+//
+//		Inputs:		
+//
+//		Outputs:	
+//
+//		Desc:		Publishes the driver's own counters (those that don't fit in
+//				IONetworkStats/IOEthernetStats) in the registry.
+//
+/****************************************************************************************************/
+
+static void setStatistic(OSDictionary *dict, const char *key, UInt64 value)
+{
+    OSNumber	*num = OSNumber::withNumber(value, 64);
+    
+    if (num)
+    {
+        dict->setObject(key, num);
+        num->release();
+    }
+    
+}/* end setStatistic */
+
+/****************************************************************************************************/
+//
+//		Function:	setHitCounts
+//
+//		Inputs:		dict - the statistics
+//				key - name
+//				hits - per rule counts
+//				count - how many rules
+//
+//		Outputs:	
+//
+//		Desc:		Adds an array of counts, in the same order as the rules were
+//				configured
+//
+/****************************************************************************************************/
+
+static void setHitCounts(OSDictionary *dict, const char *key, const UInt32 *hits, UInt32 count)
+{
+    OSArray	*array = OSArray::withCapacity(count ? count : 1);
+    OSNumber	*num;
+    UInt32	i;
+    
+    if (!array)
+    {
+        return;
+    }
+    
+    for (i=0; i<count; i++)
+    {
+        num = OSNumber::withNumber(hits[i], 32);
+        if (num)
+        {
+            array->setObject(num);
+            num->release();
+        }
+    }
+    dict->setObject(key, array);
+    array->release();
+    
+}/* end setHitCounts */
+
+void com_apple_driver_dts_USBCDCEthernet::publishStatistics()
+{
+    OSDictionary	*dict;
+    UInt64		recoveryTime = fRecoveryTimeMS;
+    UInt64		now, elapsed;
+    
+    dict = OSDictionary::withCapacity(8);
+    if (!dict)
+    {
+        return;
+    }
+    
+    if (fRecoveryStart)						// Include the episode in progress
+    {
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - fRecoveryStart, &elapsed);
+        recoveryTime += elapsed / 1000000;
+    }
+    
+    setStatistic(dict, "RecoveryCount", fRecoveryCount);
+    setStatistic(dict, "RecoveryFailures", fRecoveryFailures);
+    setStatistic(dict, "RxReadErrors", fRxReadErrors);
+    setStatistic(dict, "RecoveryTimeMS", recoveryTime);
+    setStatistic(dict, "RecoveryInProgress", fRecoveryStart != 0);
+    setStatistic(dict, "TxTimeouts", fTxTimeouts);
+    setStatistic(dict, "TxTimeoutDrops", fTxTimeoutDrops);
+    setStatistic(dict, "PauseFramesReceived", fPauseReceived);
+    setStatistic(dict, "RxFifoOverflows", fRxFifoOverflows);
+    setStatistic(dict, "RxMulticast", fRxMulticast);
+    setStatistic(dict, "RxFramingErrors", fRxFramingErrors);
+    setStatistic(dict, "RxTransferSize", fRxBlockSize);
+    setStatistic(dict, "RxCarriedFrames", fRxCarried);
+    setStatistic(dict, "DMAWiredBytes", fSlabMDP ? round_page(fSlabSize) : 0);
+    setStatistic(dict, "DMAAllocations", fDMAAllocations);
+    setStatistic(dict, "ControlPoolExhausted", fControlPoolExhausted);
+    setStatistic(dict, "TxTSOPackets", fTxTSOPackets);
+    setStatistic(dict, "TxTSOSegments", fTxTSOSegments);
+    setStatistic(dict, "TxTSOErrors", fTxTSOErrors);
+    setStatistic(dict, "TxChecksumOffload", fTxChecksums);
+    setStatistic(dict, "RxCoalescedSegments", fLROMerged);
+    setStatistic(dict, "RxCoalescedPackets", fLROPackets);
+    setStatistic(dict, "RxCoalesceFlushBatch", fLROFlushes[kLROFlushBatch]);
+    setStatistic(dict, "RxCoalesceFlushFull", fLROFlushes[kLROFlushFull]);
+    setStatistic(dict, "RxCoalesceFlushOrder", fLROFlushes[kLROFlushOrder]);
+    setStatistic(dict, "RxCoalesceFlushFlags", fLROFlushes[kLROFlushFlags]);
+    setStatistic(dict, "RxCoalesceFlushEvict", fLROFlushes[kLROFlushEvict]);
+    setStatistic(dict, "RxChecksumErrors", fRxChecksumErrors);
+    setStatistic(dict, "RxCopybreakFrames", fRxSmall);
+    setStatistic(dict, "RxPoolLevel", fRxPoolCount);
+    setStatistic(dict, "RxPoolEmpty", fRxPoolEmpty);
+    setStatistic(dict, "RxPoolRefillFailures", fRxPoolRefillFailures);
+    setStatistic(dict, "RxPasses", fRxPasses);
+    setStatistic(dict, "RxBudgetExhausted", fRxBudgetExhausted);
+    setStatistic(dict, "RxBacklogMax", fRxBacklogMax);
+    setStatistic(dict, "RxInline", fRxInline);
+    setStatistic(dict, "BusyPollHits", fBusyPollHits);
+    setStatistic(dict, "BusyPollMisses", fBusyPollMisses);
+    setStatistic(dict, "RxLatencyP50US", rxLatencyPercentile(fRxLatency, 50));
+    setStatistic(dict, "RxLatencyP99US", rxLatencyPercentile(fRxLatency, 99));
+    setStatistic(dict, "RxFilterPassed", fRxFilter.passed);
+    setStatistic(dict, "RxFilterDropped", fRxFilter.dropped);
+    setStatistic(dict, "RxFilterDestinationMisses", fRxFilter.destinationMisses);
+    setStatistic(dict, "RxFilterEtherTypeMisses", fRxFilter.typeMisses);
+    setStatistic(dict, "RxFilterVLANMisses", fRxFilter.vlanMisses);
+    setHitCounts(dict, "RxFilterDestinationHits", fRxFilter.destinations.hits, fRxFilter.destinations.count);
+    setHitCounts(dict, "RxFilterEtherTypeAllowHits", fRxFilter.typeAllow.hits, fRxFilter.typeAllow.count);
+    setHitCounts(dict, "RxFilterEtherTypeDenyHits", fRxFilter.typeDeny.hits, fRxFilter.typeDeny.count);
+    setHitCounts(dict, "RxFilterVLANAllowHits", fRxFilter.vlanAllow.hits, fRxFilter.vlanAllow.count);
+    setHitCounts(dict, "RxFilterVLANDenyHits", fRxFilter.vlanDeny.hits, fRxFilter.vlanDeny.count);
+    setStatistic(dict, "TxInflightBytes", fTxInflight);
+    setStatistic(dict, "TxInflightLimit", fTxLimit);
+    setStatistic(dict, "TxStalls", fTxStalls);
+    setStatistic(dict, "TxLimitGrown", fTxLimitGrown);
+    setStatistic(dict, "TxLimitShrunk", fTxLimitShrunk);
+    setStatistic(dict, "TxTSOResumes", fTxTSOResumes);
+    setStatistic(dict, "TxQueueLength", fTxFifo.count + fFQ.count);
+    setStatistic(dict, "TxQueueDrops", fTxQueueDrops);
+    setStatistic(dict, "TxQueueDelayMaxUS", fTxSojournMax[kTxClassNormal]);
+    setStatistic(dict, "TxQueueDelayAvgUS", averageDelay(fTxSojournTotal[kTxClassNormal], fTxDequeued[kTxClassNormal]));
+    setStatistic(dict, "TxAcksThinned", fTxAcksThinned);
+    setStatistic(dict, "TxShaperStalls", fShaperStalls);
+    setStatistic(dict, "TxShaperBytes", fShaperBytes);
+    setStatistic(dict, "TxPaceRateMbps", fTxPacing ? ((paceLinkMbps() * fTxPacing) / 100) : 0);
+    setStatistic(dict, "TxPaceWaits", fPaceWaits);
+    setStatistic(dict, "TxPaceErrorAvgUS", averageDelay(fPaceErrorTotal, fPaceErrors));
+    setStatistic(dict, "TxPaceErrorMaxUS", fPaceErrorMax);
+    setStatistic(dict, "TxPaceBurstAvg", fPaceBursts ? (fPaceBurstFrames / fPaceBursts) : 0);
+    setStatistic(dict, "TxPaceBurstMax", fPaceBurstMax);
+    setStatistic(dict, "TxACKPackets", fTxDequeued[kTxClassACK]);
+    setStatistic(dict, "TxACKDelayMaxUS", fTxSojournMax[kTxClassACK]);
+    setStatistic(dict, "TxACKDelayAvgUS", averageDelay(fTxSojournTotal[kTxClassACK], fTxDequeued[kTxClassACK]));
+    setStatistic(dict, "TxARPPackets", fTxDequeued[kTxClassARP]);
+    setStatistic(dict, "TxARPDelayMaxUS", fTxSojournMax[kTxClassARP]);
+    setStatistic(dict, "TxARPDelayAvgUS", averageDelay(fTxSojournTotal[kTxClassARP], fTxDequeued[kTxClassARP]));
+    setStatistic(dict, "TxEFPackets", fTxDequeued[kTxClassEF]);
+    setStatistic(dict, "TxEFDelayMaxUS", fTxSojournMax[kTxClassEF]);
+    setStatistic(dict, "TxEFDelayAvgUS", averageDelay(fTxSojournTotal[kTxClassEF], fTxDequeued[kTxClassEF]));
+    setStatistic(dict, "TxFlowsActive", fqActiveFlows(&fFQ));
+    setStatistic(dict, "TxNewFlows", fFQ.newFlowCount);
+    setStatistic(dict, "TxQueueOverflowDrops", fFQ.overflowDrops);
+    
+    setProperty(kDriverStatisticsKey, dict);
+    dict->release();
+    
+}/* end publishStatistics */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::setProperties
+//
+//		Inputs:		properties - the new values
+//
+//		Outputs:	Return code - kIOReturnSuccess or an error
+//
+//		Desc:		Lets an administrator change the tunables at runtime. The
+//				changes are applied on the workloop.
+//
+/****************************************************************************************************/
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::setProperties(OSObject *properties)
+{
+    OSDictionary	*dict = OSDynamicCast(OSDictionary, properties);
+    IOReturn		rtn;
+
+    ELG(0, properties, 'sPrp', "com_apple_driver_dts_USBCDCEthernet::setProperties");
+    
+    if (!dict)
+    {
+        return kIOReturnBadArgument;
+    }
+    
+    rtn = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (rtn != kIOReturnSuccess)
+    {
+        ELG(0, rtn, 'sPr-', "com_apple_driver_dts_USBCDCEthernet::setProperties - Not privileged");
+        return rtn;
+    }
+    
+    return getCommandGate()->runAction(setPropertiesAction, dict);
+    
+}/* end setProperties */
+
+IOReturn com_apple_driver_dts_USBCDCEthernet::setPropertiesAction(OSObject *owner, void *arg0, void *, void *, void *)
+{
+    com_apple_driver_dts_USBCDCEthernet	*me = (com_apple_driver_dts_USBCDCEthernet *)owner;
+    
+    me->updateConfiguration((OSDictionary *)arg0);
+    
+    return kIOReturnSuccess;
+    
+}/* end setPropertiesAction */
+
+/****************************************************************************************************/
+//
+//		Function:	getConfigValue
+//
+//		Inputs:		dict - the properties, key - the tunable, min/max - valid range
+//
+//		Outputs:	Return code - true (value present and in range), false (not)
+//				value - the value
+//
+//		Desc:		Reads a numeric tunable
+//
+/****************************************************************************************************/
+
+static bool getConfigValue(OSDictionary *dict, const char *key, UInt32 min, UInt32 max, UInt32 *value)
+{
+    OSNumber	*num = OSDynamicCast(OSNumber, dict->getObject(key));
+    
+    if (!num || (num->unsigned32BitValue() < min) || (num->unsigned32BitValue() > max))
+    {
+        return false;
+    }
+    
+    *value = num->unsigned32BitValue();
+    return true;
+    
+}/* end getConfigValue */
+
+/****************************************************************************************************/
+//
+//		Method:		com_apple_driver_dts_USBCDCEthernet::updateConfiguration
+//
+//		Inputs:		dict - the properties
+//
+//		Outputs:	
+//
+//		Desc:		Picks up the tunables present in dict, publishes the values in
+//				effect and applies them to the device if it's running.
+//
+/****************************************************************************************************/
+
+void com_apple_driver_dts_USBCDCEthernet::updateConfiguration(OSDictionary *dict)
+{
+    OSBoolean	*flag;
+    OSDictionary	*filter;
+    UInt32	value;
+    bool	flowChanged = false;
+
+    ELG(0, dict, 'uCfg', "com_apple_driver_dts_USBCDCEthernet::updateConfiguration");
+    
+        // Flow control
+    
+    flag = OSDynamicCast(OSBoolean, dict->getObject(kFlowControlKey));
+    if (flag)
+    {
+        fFlowControl = flag->isTrue();
+        flowChanged = true;
+    }
+    if (getConfigValue(dict, kFlowControlHighWaterKey, 1, 15, &value))
+    {
+        fFlowControlHighWater = value;
+        flowChanged = true;
+    }
+    if (getConfigValue(dict, kFlowControlLowWaterKey, 1, 15, &value))
+    {
+        fFlowControlLowWater = value;
+        flowChanged = true;
+    }
+    flag = OSDynamicCast(OSBoolean, dict->getObject(kReceiveCoalescingKey));
+    if (flag)
+    {
+        fLRO = flag->isTrue();
+        setProperty(kReceiveCoalescingKey, fLRO);
+    }
+    if (getConfigValue(dict, kRxCopybreakKey, 0, kRxMaxFrameSize, &value))
+    {
+        fRxCopybreak = (value > mbuf_get_mhlen()) ? mbuf_get_mhlen() : value;		// No more than fits in a header mbuf
+        setProperty(kRxCopybreakKey, fRxCopybreak, 32);
+    }
+    if (getConfigValue(dict, kRxBudgetKey, 1, 1024, &value))
+    {
+        fRxBudget = value;
+        setProperty(kRxBudgetKey, fRxBudget, 32);
+    }
+    if (getConfigValue(dict, kBusyPollKey, 0, kBusyPollMaxUS, &value))
+    {
+        nanoseconds_to_absolutetime((UInt64)value * 1000, &fBusyPollTime);
+        fBusyPollUS = value;
+        setProperty(kBusyPollKey, fBusyPollUS, 32);
+    }
+    if (getConfigValue(dict, kCoDelTargetKey, 100, 1000000, &value))
+    {
+        fCoDelTarget = value;
+        setCoDelParams();
+        setProperty(kCoDelTargetKey, fCoDelTarget, 32);
+    }
+    if (getConfigValue(dict, kCoDelIntervalKey, 1000, 10000000, &value))
+    {
+        fCoDelInterval = value;
+        setCoDelParams();
+        setProperty(kCoDelIntervalKey, fCoDelInterval, 32);
+    }
+    if (getConfigValue(dict, kTxRateLimitKey, 0, 1000000, &value))
+    {
+        setRateLimit(value, fTxBurst);
+        setProperty(kTxRateLimitKey, fTxRateLimit, 32);
+    }
+    if (getConfigValue(dict, kTxBurstKey, kTxBufferSize, 65536, &value))
+    {
+        setRateLimit(fTxRateLimit, value);
+        setProperty(kTxBurstKey, fTxBurst, 32);
+    }
+    if (getConfigValue(dict, kTxPacingKey, 0, 100, &value))
+    {
+        fTxPacing = value;
+        fPaceNext = 0;
+        setProperty(kTxPacingKey, fTxPacing, 32);
+    }
+    if (getConfigValue(dict, kFQQuantumKey, 64, 16384, &value))
+    {
+        fFQ.quantum = value;
+        setProperty(kFQQuantumKey, fFQ.quantum, 32);
+    }
+    filter = OSDynamicCast(OSDictionary, dict->getObject(kRxFilterKey));
+    if (filter)
+    {
+        setRxFilter(filter);
+    }
+    if (getConfigValue(dict, kRxTransferSizeKey, 0, kRxMaxTransferSize, &value))
+    {
+        if ((value == 0) || ((value >= kRxMinTransferSize) && !(value & (value - 1))))	// Powers of two only
+        {
+            fRxTransferSize = value;				// Takes effect the next time the buffers are allocated
+            setProperty(kRxTransferSizeKey, fRxTransferSize, 32);
+        }
+    }
+    
+    if (fFlowControlLowWater < fFlowControlHighWater)		// The pause must be lifted with more room than it was sent
+    {
+        fFlowControlLowWater = fFlowControlHighWater;
+    }
+    
+    if (flowChanged)
+    {
+        setProperty(kFlowControlKey, fFlowControl);
+        setProperty(kFlowControlHighWaterKey, fFlowControlHighWater, 8);
+        setProperty(kFlowControlLowWaterKey, fFlowControlLowWater, 8);
+        if (fReady)
+        {
+            applyFlowControl();
+        }
+    }
+    
+}/* end updateConfiguration */
+
+/****************************************************************************************************/
+//
+//		Function:	parseAddress
+//
+//		Inputs:		obj - "00:11:22:33:44:55" or 6 bytes of data
+//
+//		Outputs:	Return code - true (it's an address), false (it isn't)
+//				address - the address
+//
+//		Desc:		Reads an Ethernet address from the configuration
+//
+/****************************************************************************************************/
+
+static bool parseAddress(OSObject *obj, UInt8 *address)
+{
+    OSString	*str = OSDynamicCast(OSString, obj);
+    OSData	*data = OSDynamicCast(OSData, obj);
+    const char	*p;
+    UInt32	i, digit, byte;
+    
+    if (data)
+    {
+        if (data->getLength() != 6)
+        {
+            return false;
+        }
+        bcopy(data->getBytesNoCopy(), address, 6);
+        return true;
+    }
+    if (!str || (str->getLength() != 17))
+    {
+        return false;
+    }
+    
+    p = str->getCStringNoCopy();
+    for (i=0; i<6; i++)
+    {
+        byte = 0;
+        for (digit=0; digit<2; digit++, p++)
+        {
+            byte <<= 4;
+            if ((*p >= '0') && (*p <= '9'))
+            {
+                byte |= *p - '0';
+            } else if ((*p >= 'a') && (*p <= 'f')) {
+                byte |= *p - 'a' + 10;
+            } else if ((*p >= 'A') && (*p <= 'F')) {
+                byte |= *p - 'A' + 10;
+            } else {
+                return false;
+            }
+        }
+        if ((i < 5) && (*p++ != ':'))
+        {
+            return false;
+        }
+        address[i] = (UInt8)byte;
     }
-  }
-  
-	return ior;
-}/* end Write1Register */
+    
+    return true;
+    
+}/* end parseAddress */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::clearPipeStall
+//		Function:	addFilterValues
 //
-//		Inputs:		thePipe - the pipe
+//		Inputs:		config - the filter configuration
+//				key - which set
+//				max - largest valid value
 //
-//		Outputs:	
+//		Outputs:	set - the values are added to it
 //
-//		Desc:		Clear a stall on the specified pipe. All outstanding I/O
-//				is returned as aborted.
+//		Desc:		Reads an EtherType or VLAN ID set, ignoring anything out of range
 //
 /****************************************************************************************************/
 
-IOReturn com_apple_driver_dts_USBCDCEthernet::clearPipeStall(IOUSBPipe *thePipe)
+static void addFilterValues(OSDictionary *config, const char *key, UInt32 max, rxFilterSet *set)
 {
-    UInt8	pipeStatus;
-    IOReturn 	rtn = kIOReturnSuccess;
-    
-    ELG(0, thePipe, 'clSt', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall");
+    OSArray	*list = OSDynamicCast(OSArray, config->getObject(key));
+    OSNumber	*num;
+    UInt32	i;
     
-    pipeStatus = thePipe->GetStatus();
-    if (pipeStatus == kPipeStalled)
+    for (i=0; list && (i<list->getCount()); i++)
     {
-        rtn = thePipe->ClearPipeStall(true);
-        if (rtn == kIOReturnSuccess)
+        num = OSDynamicCast(OSNumber, list->getObject(i));
+        if (num && (num->unsigned32BitValue() <= max) && !rxFilterAddValue(set, (UInt16)num->unsigned32BitValue()))
         {
-            ELG(0, 0, 'clSS', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Successful");
-        } else {
-            ELG(0, rtn, 'clSF', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Failed");
+            ALERT(set->count, i, 'aFV-', "addFilterValues - Set full, the rest are ignored");
+            break;
         }
-    } else {
-        ELG(0, pipeStatus, 'clSP', "com_apple_driver_dts_USBCDCEthernet::clearPipeStall - Pipe not stalled");
     }
     
-    return rtn;
-
-}/* end clearPipeStall */
+}/* end addFilterValues */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::receivePacket
+//		Method:		com_apple_driver_dts_USBCDCEthernet::setRxFilter
 //
-//		Inputs:		packet - the packet
-//				size - Number of bytes in the packet
+//		Inputs:		config - the filter configuration
 //
 //		Outputs:	
 //
-//		Desc:		Build the mbufs and then send to the network stack.
+//		Desc:		Replaces the receive filter (and its counters). An empty
+//				dictionary turns it off. Runs on the workloop, like the filter.
 //
 /****************************************************************************************************/
 
-void com_apple_driver_dts_USBCDCEthernet::receivePacket(UInt8 *packet, UInt32 size)
+void com_apple_driver_dts_USBCDCEthernet::setRxFilter(OSDictionary *config)
 {
-    mbuf_t		m;
-    UInt32		submit;
-    UInt32 length;
-    UInt8 *ptr = packet;
+    OSArray	*list = OSDynamicCast(OSArray, config->getObject(kRxFilterDestinationsKey));
+    UInt8	address[6];
+    UInt32	i;
+    
+    ELG(0, config, 'sRxF', "com_apple_driver_dts_USBCDCEthernet::setRxFilter");
     
-    ELG(fMax_Block_Size, size, 'rcPk', "com_apple_driver_dts_USBCDCEthernet::receivePacket");
+    rxFilterInit(&fRxFilter);
     
-    if (size > fMax_Block_Size)
+    for (i=0; list && (i<list->getCount()); i++)
     {
-        ELG(0, 0, 'rcP-', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packet size error, packet dropped");
-        if (fInputErrsOK)
-            fpNetStats->inputErrors++;
-        return;
+        if (!parseAddress(list->getObject(i), address))
+        {
+            ELG(0, i, 'sRF-', "com_apple_driver_dts_USBCDCEthernet::setRxFilter - Not an address, ignored");
+            continue;
+        }
+        if (!rxFilterAddDestination(&fRxFilter, address))
+        {
+            ALERT(fRxFilter.destinations.count, i, 'sRF+', "com_apple_driver_dts_USBCDCEthernet::setRxFilter - Destinations full, the rest are ignored");
+            break;
+        }
     }
-  
-    //while (size >0)
-    //{
-      if (*ptr != 0x40)
-      {
-        ELG(0, *ptr, 'rcP-', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packet size error, packet dropped");
-        if (fInputErrsOK)
-          fpNetStats->inputErrors++;
-        return;
-      }
+    addFilterValues(config, kRxFilterEtherTypeAllowKey, 0xffff, &fRxFilter.typeAllow);
+    addFilterValues(config, kRxFilterEtherTypeDenyKey, 0xffff, &fRxFilter.typeDeny);
+    addFilterValues(config, kRxFilterVLANAllowKey, 0x0fff, &fRxFilter.vlanAllow);
+    addFilterValues(config, kRxFilterVLANDenyKey, 0x0fff, &fRxFilter.vlanDeny);
     
-      length = ptr[1] | (ptr[2] << 8);
-      ptr += 3;
-      size -= 3;
-      
-      ELG(0, length, 'rcP-', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packet length");
-      
-      m = allocatePacket(length);
-      if (m)
-      {
-          bcopy(ptr, mbuf_data(m), length);
-          submit = fNetworkInterface->inputPacket(m, length);
-          ELG(0, submit, 'rcSb', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Packets submitted");
-          if (fInputPktsOK)
-              fpNetStats->inputPackets++;
-      } else {
-          ELG(0, 0, 'rcB-', "com_apple_driver_dts_USBCDCEthernet::receivePacket - Buffer allocation failed, packet dropped");
-          if (fInputErrsOK)
-              fpNetStats->inputErrors++;
-      }
-    //  size -= length;
-    //  ptr += length;
-    //}
-
-}/* end receivePacket */
+    fRxFilter.active = fRxFilter.destinations.count || fRxFilter.typeAllow.count || fRxFilter.typeDeny.count ||
+		       fRxFilter.vlanAllow.count || fRxFilter.vlanDeny.count;
+    
+    setProperty(kRxFilterKey, config);
+    
+}/* end setRxFilter */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::timeoutFired
+//		Method:		com_apple_driver_dts_USBCDCEthernet::applyFlowControl
 //
 //		Inputs:		
 //
-//		Outputs:	
+//		Outputs:	Return code - true (registers written), false (failed)
 //
-//		Desc:		Static member function called when a timer event fires.
+//		Desc:		Programs the 802.3x flow control registers and FIFO thresholds
+//				and advertises pause capability through the PHY.
 //
 /****************************************************************************************************/
-void com_apple_driver_dts_USBCDCEthernet::timerFired(OSObject *owner, IOTimerEventSource *sender)
+
+bool com_apple_driver_dts_USBCDCEthernet::applyFlowControl()
 {
+    IOReturn	rtn;
+    UInt16	anar, newAnar, bmcr;
+    UInt8	fcr = 0;
 
-//    ELG(0, 0, 'tmFd', "com_apple_driver_dts_USBCDCEthernet::timerFired");
+    ELG(fFlowControlHighWater, fFlowControlLowWater, 'aFlC', "com_apple_driver_dts_USBCDCEthernet::applyFlowControl");
     
-    if (owner)
+    rtn = Write1Register(RegFCTR, (fFlowControlHighWater << FCTRHighWaterShift) | (fFlowControlLowWater & FCTRLowWaterMask));
+    if (rtn == kIOReturnSuccess)
     {
-	com_apple_driver_dts_USBCDCEthernet* target = OSDynamicCast(com_apple_driver_dts_USBCDCEthernet, owner);
-	
-	if (target)
-	{
-	    target->timeoutOccurred(sender);
-	}
+        rtn = Write1Register(RegBPTR, (fFlowControlHighWater << BPTRHighWaterShift) | BPTRJamTime200us);
+    }
+    if (rtn == kIOReturnSuccess)
+    {
+        if (fFlowControl)
+        {
+            fcr = FCRTXPauseEnable | FCRBackPressure | FCRFlowControl;
+        }
+        rtn = Write1Register(RegFCR, fcr);
+    }
+    if (rtn != kIOReturnSuccess)
+    {
+        ELG(0, rtn, 'aFl-', "com_apple_driver_dts_USBCDCEthernet::applyFlowControl - Error writing flow control registers");
+        return false;
     }
     
-}/* end timerFired */
+        // Only touch the advertisement when it changes, restarting auto-negotiation drops the link.
+        // The first time after enable it's read from the PHY, whose default may advertise pause
+    
+    if (!fPauseAdvertValid || (fPauseAdvertised != fFlowControl))
+    {
+        rtn = ReadPHY(PHYANAR, &anar);
+        if (rtn == kIOReturnSuccess)
+        {
+            if (fFlowControl)
+            {
+                newAnar = anar | ANARPause;
+            } else {
+                newAnar = anar & ~ANARPause;
+            }
+            if (newAnar != anar)
+            {
+                rtn = WritePHY(PHYANAR, newAnar);
+                if (rtn == kIOReturnSuccess)
+                {
+                    rtn = ReadPHY(PHYBMCR, &bmcr);
+                }
+                if (rtn == kIOReturnSuccess)
+                {
+                    rtn = WritePHY(PHYBMCR, bmcr | BMCRAutoNeg | BMCRRestartAutoNeg);
+                }
+            }
+        }
+        if (rtn != kIOReturnSuccess)
+        {
+            ELG(0, rtn, 'aFlP', "com_apple_driver_dts_USBCDCEthernet::applyFlowControl - Error updating the PHY advertisement");
+            return false;
+        }
+        fPauseAdvertised = fFlowControl;
+        fPauseAdvertValid = true;
+    }
+    
+    return true;
+    
+}/* end applyFlowControl */
 
 /****************************************************************************************************/
 //
-//		Method:		com_apple_driver_dts_USBCDCEthernet::timeoutOccurred
+//		Method:		com_apple_driver_dts_USBCDCEthernet::updateFlowControlStats
 //
 //		Inputs:		
 //
 //		Outputs:	
 //
-//		Desc:		Timeout handler, used for stats gathering.
+//		Desc:		Called every watchdog tick. Collects the (read clear) pause and
+//				receive overflow status from the device when the link changes,
+//				and every kFlowStatsRefreshTicks otherwise.
 //
 /****************************************************************************************************/
 
-void com_apple_driver_dts_USBCDCEthernet::timeoutOccurred(IOTimerEventSource * /*timer*/)
+void com_apple_driver_dts_USBCDCEthernet::updateFlowControlStats()
 {
-    UInt32		*enetStats;
-    UInt16		currStat;
-    IOReturn		rc;
-    IOUSBDevRequest	*STREQ;
-    bool		statOk = false;
-
-    ELG(0, 0, 'tmOd', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred");
-
-    enetStats = (UInt32 *)&fEthernetStatistics;
-    if (*enetStats == 0)
+    UInt8	value;
+    
+        // Each read is a synchronous control transfer, don't hold the workloop for them every tick
+    
+    if ((fLinkStatus == fFlowStatsLink) && (++fFlowStatsTicks < kFlowStatsRefreshTicks))
     {
-        ELG(0, 0, 'tmN-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - No Ethernet statistics defined");
         return;
     }
+    fFlowStatsLink = fLinkStatus;
+    fFlowStatsTicks = 0;
     
-    if (fReady == false)
+    if (fFlowControl && (ReadRegister(RegFCR, sizeof(value), &value) == kIOReturnSuccess))
     {
-        ELG(0, 0, 'tmS-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - Spurious");    
-    } else {
-    
-            // Only do it if it's not already in progress
-    
-        if (!fStatInProgress)
+        if (value & FCRRXPauseStatus)
         {
-
-                // Check if the stat we're currently interested in is supported
-            
-            currStat = stats[fCurrStat++];
-            if (fCurrStat >= numStats)
-            {
-                fCurrStat = 0;
-            }
-            switch(currStat)
-            {
-                case kXMIT_OK_REQ:
-                    if (fEthernetStatistics[0] & kXMIT_OK)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kRCV_OK_REQ:
-                    if (fEthernetStatistics[0] & kRCV_OK)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_ERROR_REQ:
-                    if (fEthernetStatistics[0] & kXMIT_ERROR_REQ)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kRCV_ERROR_REQ:
-                    if (fEthernetStatistics[0] & kRCV_ERROR_REQ)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kRCV_CRC_ERROR_REQ:
-                    if (fEthernetStatistics[2] & kRCV_CRC_ERROR)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kRCV_ERROR_ALIGNMENT_REQ:
-                    if (fEthernetStatistics[2] & kRCV_ERROR_ALIGNMENT)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_ONE_COLLISION_REQ:
-                    if (fEthernetStatistics[2] & kXMIT_ONE_COLLISION)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_MORE_COLLISIONS_REQ:
-                    if (fEthernetStatistics[2] & kXMIT_MORE_COLLISIONS)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_DEFERRED_REQ:
-                    if (fEthernetStatistics[2] & kXMIT_DEFERRED)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_MAX_COLLISION_REQ:
-                    if (fEthernetStatistics[2] & kXMIT_MAX_COLLISION)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kRCV_OVERRUN_REQ:
-                    if (fEthernetStatistics[3] & kRCV_OVERRUN)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_TIMES_CARRIER_LOST_REQ:
-                    if (fEthernetStatistics[3] & kXMIT_TIMES_CARRIER_LOST)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                case kXMIT_LATE_COLLISIONS_REQ:
-                    if (fEthernetStatistics[3] & kXMIT_LATE_COLLISIONS)
-                    {
-                        statOk = true;
-                    }
-                    break;
-                default:
-                    break;
-            }
+            fPauseReceived++;
         }
-
-        if (statOk)
+    }
+    
+    if (ReadRegister(RegROCR, sizeof(value), &value) == kIOReturnSuccess)
+    {
+        fRxFifoOverflows += value & ROCRCountMask;
+        if (value & ROCRCountOver)
         {
-            STREQ = (IOUSBDevRequest*)IOMalloc(sizeof(IOUSBDevRequest));
-            if (!STREQ)
-            {
-                ELG(0, 0, 'tma-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - allocate STREQ failed");
-            } else {
-                bzero(STREQ, sizeof(IOUSBDevRequest));
-        
-                    // Now build the Statistics Request
-		
-                STREQ->bmRequestType = USBmakebmRequestType(kUSBOut, kUSBClass, kUSBInterface);
-                STREQ->bRequest = kGet_Ethernet_Statistics;
-                STREQ->wValue = currStat;
-                STREQ->wIndex = fCommInterfaceNumber;
-                STREQ->wLength = 4;
-                STREQ->pData = &fStatValue;
-	
-                fStatsCompletionInfo.parameter = STREQ;
-	
-                rc = fpDevice->DeviceRequest(STREQ, &fStatsCompletionInfo);
-                if (rc != kIOReturnSuccess)
-                {
-                    ELG(STREQ->bRequest, rc, 'tmE-', "com_apple_driver_dts_USBCDCEthernet::timeoutOccurred - Error issueing DeviceRequest");
-                    IOFree(STREQ, sizeof(IOUSBDevRequest));
-                } else {
-                    fStatInProgress = true;
-                }
-            }
+            fRxFifoOverflows += ROCRCountMask + 1;
         }
     }
-
-        // Restart the watchdog timer
-        
-    fTimerSource->setTimeoutMS(WATCHDOG_TIMER_MS);
-
-}/* end timeoutOccurred */
+    
+}/* end updateFlowControlStats */
 
 /****************************************************************************************************/
 //
@@ -3027,10 +6563,9 @@ IOReturn com_apple_driver_dts_USBCDCEthernet::message(UInt32 type, IOService *pr
             
             if (fDataDead)
             {
-                ior = fInPipe->Read(fPipeInMDP, &fReadCompletionInfo, NULL);
-                if (ior != kIOReturnSuccess)
+                if (!postReads())
                 {
-                    ELG(0, ior, 'msD-', "com_apple_driver_dts_USBCDCEthernet::message - Failed to queue Data pipe read");
+                    ELG(0, 0, 'msD-', "com_apple_driver_dts_USBCDCEthernet::message - Failed to queue Data pipe read");
                 } else {
                     fDataDead = false;
                 }
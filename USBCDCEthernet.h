@@ -93,10 +93,14 @@
 #include <IOKit/network/IOGatedOutputQueue.h>
 
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOUserClient.h>
 #include <IOKit/assert.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
 #include <IOKit/IOMessage.h>
 
 #include <IOKit/pwr_mgt/RootDomain.h>
@@ -110,6 +114,11 @@
 
 #include <UserNotification/KUNCUserNotifications.h>
 
+#include "Checksum.h"
+#include "TxQueue.h"
+#include "RxFilter.h"
+#include "RxLatency.h"
+
 extern "C"
 {
     #include <sys/param.h>
@@ -125,7 +134,8 @@ extern "C"
 
 #if LDEBUG
     #if USE_ELG
-        #define ELG(A,B,ASCI,STRING)    EvLog((UInt32)(A), (UInt32)(B), (UInt32)(ASCI), STRING)		
+        #define ELG(A,B,ASCI,STRING)    EvLog(&fEventLog, (UInt32)(A), (UInt32)(B), (UInt32)(ASCI), STRING)		
+        #define ELG_INSTANCE(me)	eventLog &fEventLog = (me)->fEventLog	// lets the static completions log
     #else /* not USE_ELG */
         #define ELG(A,B,ASCI,STRING)	{IOLog("com_apple_driver_dts_USBCDCEthernet: %8x %8x " STRING "\n", (unsigned int)(A), (unsigned int)(B));IOSleep(Sleep_Time);}
     #endif /* USE_ELG */
@@ -141,11 +151,59 @@ extern "C"
     #undef LOG_DATA
 #endif /* LDEBUG */
 
+#if !USE_ELG
+    #define ELG_INSTANCE(me)
+#endif /* USE_ELG */
+
 #define ALERT(A,B,ASCI,STRING)	IOLog("com_apple_driver_dts_USBCDCEthernet: %8x %8x " STRING "\n", (unsigned int)(A), (unsigned int)(B))
 
 #define TRANSMIT_QUEUE_SIZE     256				// How does this relate to MAX_BLOCK_SIZE?
 #define WATCHDOG_TIMER_MS       1000
 
+#define kRecoveryTroubleTicks	3				// Watchdog ticks with failing reads and nothing received
+#define kRecoveryMaxBackoff	32				// Maximum watchdog ticks between recovery attempts
+#define kFlowStatsRefreshTicks	30				// Watchdog ticks between flow control status reads on a steady link
+
+#define kDriverStatisticsKey	"DriverStatistics"		// Registry property holding the driver's own counters
+#define kStartupTimingKey	"StartupTiming"			// Registry property with the last wakeUp's time breakdown
+#define kChecksumKernelKey	"ChecksumKernel"		// Registry property naming the checksum kernels in use
+
+#define kDeviceReadyPollMS	2				// How often to check the device is up after a resume
+#define kDeviceReadyTimeoutMS	100				// and how long to keep trying
+
+    // Tunables (personality properties, may be changed at runtime with setProperties)
+
+#define kFlowControlKey			"FlowControl"			// Boolean - 802.3x pause frames on/off
+#define kFlowControlHighWaterKey	"FlowControlHighWater"		// KB of RX FIFO left when a pause is sent (1-15)
+#define kFlowControlLowWaterKey		"FlowControlLowWater"		// KB of RX FIFO free when the pause is lifted (1-15)
+#define kRxTransferSizeKey		"RxTransferSize"		// Bulk-in transfer size - 0 (automatic), 2048, 4096, 8192 or 16384
+#define kReceiveCoalescingKey		"ReceiveCoalescing"		// Merge in-order TCP segments before handing them up (boolean)
+#define kRxCopybreakKey			"RxCopybreak"			// Frames up to this size go in a small mbuf, not a cluster (0-1522, capped at MHLEN)
+#define kRxFilterKey			"RxFilter"			// Early receive filter - a dictionary of the sets below (empty - off)
+#define kRxFilterDestinationsKey	"Destinations"			// Unicast addresses allowed besides ours ("00:11:22:33:44:55" or 6 byte data)
+#define kRxFilterEtherTypeAllowKey	"EtherTypeAllow"		// EtherTypes (numbers)
+#define kRxFilterEtherTypeDenyKey	"EtherTypeDeny"
+#define kRxFilterVLANAllowKey		"VLANAllow"			// VLAN IDs (numbers, 0-4095)
+#define kRxFilterVLANDenyKey		"VLANDeny"
+#define kRxBudgetKey			"RxBudget"			// Frames handed up per receive pass before other work gets a turn (1-1024)
+#define kBusyPollKey			"BusyPoll"			// Microseconds a receive pass may spin for completions (0 - off, up to kBusyPollMaxUS)
+#define kTxQueueKey			"TxQueue"			// Transmit queue - "FIFO", "CoDel" or "FQ-CoDel" (read when the driver starts)
+#define kCoDelTargetKey			"CoDelTarget"			// Acceptable standing queue delay, microseconds (100-1000000)
+#define kCoDelIntervalKey		"CoDelInterval"			// How long it may be exceeded before dropping, microseconds (1000-10000000)
+#define kTxPriorityKey			"TxPriority"			// ACKs, ARP and DSCP EF jump the queue (boolean, read when the driver starts)
+#define kTxRateLimitKey			"TxRateLimit"			// Egress cap in kbit/s of bulk-out bytes (0 - off, up to 1000000)
+#define kTxBurstKey			"TxBurst"			// Bytes that may go at once under the cap (1536-65536)
+#define kTxPacingKey			"TxPacing"			// Space frames out at this percent of the link speed (0 - off, up to 100)
+#define kTxAckThinningKey		"TxAckThinning"			// Drop queued TCP ACKs a newer one supersedes when the pipe is full (boolean, read when the driver starts)
+#define kFQQuantumKey			"FQQuantum"			// Bytes each flow sends per FQ-CoDel round (64-16384)
+
+#define kDefaultFlowControlHighWater	3
+#define kDefaultFlowControlLowWater	8
+#define kDefaultCoDelTarget		5000
+#define kDefaultCoDelInterval		100000
+#define kDefaultFQQuantum		1514
+#define kDefaultTxBurst			8192
+
 #define MAX_BLOCK_SIZE		PAGE_SIZE
 #define COMM_BUFF_SIZE		16
 
@@ -155,8 +213,59 @@ extern "C"
 #define kFiltersSupportedMask	0xefff
 #define kPipeStalled		1
 
+#define kRxHeaderSize		3				// DM9601 receive header - status byte and little endian length
+#define kEthernetCRCSize	4				// The DM9601 hands up the FCS with every frame
+#define kRxMaxFrameSize		1522				// Longest frame the receiver passes (RCRDiscardLong), VLAN tag and FCS included
+#define kRxCarrySize		(kRxHeaderSize + kRxMaxFrameSize)
+#define kRxMinTransferSize	0x0800				// Bulk-in transfer sizes (see chooseRxTransferSize)
+#define kRxMaxTransferSize	0x4000
+#define kInBufPool		4				// Bulk-in transfers kept posted
+#define kDefaultRxBudget	64
+
+#define kTxHeaderSize		2				// DM9601 transmit header - little endian length
+#define kTxBufferSize		1536				// One frame (VLAN tagged) plus header and padding, cache line multiple
+#define kTxMaxFrameSize		(kTxBufferSize - kTxHeaderSize - 1)	// Room for the length header and a padding byte
+#define kTxMaxHeaderSize	(18 + 60 + 60)			// VLAN tagged Ethernet, IPv4 and TCP headers with options
+
+#define kEtherTypeIPv4		0x0800
+#define kEtherTypeVLAN		0x8100
+#define kIPProtocolTCP		6
+#define kIPProtocolUDP		17
+#define kIPFlagDF		0x40				// In the high byte of the fragment field
+#define kTCPFlagPSH		0x08
+#define kTCPFlagACK		0x10
+#define kTCPTimestampOption	0x0101080a			// NOP, NOP, timestamp option header
+
+#define kBusyPollMaxUS		100				// The spin holds the workloop, keep it short
+
+#define kRxPoolSize		64				// Cluster mbufs kept ready for received frames
+#define kRxPoolLowWater		(kRxPoolSize / 2)		// Refill when it drops below this
+#define kDefaultRxCopybreak	128
+
+#define kLROSessions		4				// TCP flows being coalesced at once
+#define kLROMaxLength		(32 * 1024)			// Largest packet built from merged segments
+#define kLROMaxSegments		32
+
+#define kCacheLineSize		64
+#define CACHE_ALIGN(x)		(((x) + kCacheLineSize - 1) & ~(kCacheLineSize - 1))
+
 #define kOutBufPool		6
-#define kOutBuffThreshold	100
+#define kOutBufZLP		kOutBufPool			// Pool index used for zero length writes (owns no buffer)
+#define kOutBufOwned		0x80000000			// Set in an output buffer's owner tag, the generation's in the low 24 bits
+#define kTxTimeoutMS		2000				// Bulk-out transfers older than this are considered hung
+#define kTxLimitMin		kTxBufferSize			// Range of the in-flight byte limit, one frame
+#define kTxLimitMax		(kOutBufPool * kTxBufferSize)	// to the whole pool
+#define kTxLimitHoldMS		1000				// In-flight bytes that were never needed are given back after this long
+#define kTxReservedBuffers	1				// Output buffers only priority packets may use (TxPriority)
+#define kTxLaneMax		32				// Packets a priority lane holds, the rest queue as normal
+#define kShaperScale		1000000000ULL			// Shaper token units per byte (per second of nanoseconds)
+#define kTxPaceSlackUS		50				// Paced frames may go this early (timer granularity)
+#define kTxWireOverhead		24				// Preamble, FCS and inter-frame gap, bytes
+#define kTxMinFrameSize		60				// Shorter frames are padded on the wire
+
+#define kControlPoolSize	4				// Preallocated asynchronous control requests
+#define kControlInlineFilters	16				// Multicast addresses that fit in a request's inline data
+#define kControlDataSize	(kControlInlineFilters * kIOEthernetAddressSize)
 
         // USB CDC Definitions (Ethernet Control Model)
 		
@@ -298,22 +407,80 @@ typedef struct
 
 typedef struct 
 {
-    IOBufferMemoryDescriptor	*pipeOutMDP;
+    IOMemoryDescriptor		*pipeOutMDP;		// Sub-range of the buffer slab
     UInt8			*pipeOutBuffer;
     mbuf_t		 m;
+    UInt64			submitTime;		// Uptime the write was queued (transmit watchdog)
+    UInt32			generation;		// Bumped on every write, stale completions are ignored
+    volatile UInt32		owner;			// Tag of the write holding the buffer (0 - none), see releaseTxBuffer
+    UInt32			txLength;		// Bytes being written (0 - buffer free). m is only set on a packet's last frame
 } pipeOutBuffers;
 
-    // Globals
+enum
+{
+    kTxQueueFIFO = 0,					// The output queue calls straight through to the pipe
+    kTxQueueCoDel,					// Packets wait in the driver's own queue, CoDel drops from it
+    kTxQueueFQCoDel,					// The same, one queue per flow served round robin
+    kTxQueueDropTail					// FIFO with TxPriority - the driver's own queue, nothing dropped
+};
+
+typedef struct
+{
+    mbuf_t			m;			// Large send that was part sent when the queue stalled (NULL - none)
+    UInt32			length;			// Its length and first sequence number, to know it when it comes back
+    UInt32			seq;
+    UInt32			offset;			// Payload sent so far
+    UInt32			segments;		// and the frames it went in
+} txResume;
+
+typedef struct
+{
+    IOMemoryDescriptor		*pipeInMDP;		// Sub-range of the buffer slab
+    UInt8			*pipeInBuffer;
+    UInt32			rxLength;		// Bytes received, set by the completion (0 - failed or aborted)
+    bool			rxFailed;		// Failed or aborted, a frame carried over from before can't be finished
+    UInt64			doneTime;		// Uptime the transfer completed
+} pipeInBuffers;
 
-typedef struct globals      // Globals for this module (not per instance)
+typedef struct
 {
-    UInt32      evLogFlag; 				// debugging only
+    mbuf_t			m;			// Packet built so far (NULL - session free)
+    UInt32			length;			// Its length
+    UInt32			segments;		// Segments merged into it
+    UInt32			nextSeq;		// Sequence number the next in-order segment will have
+    UInt8			flow[12];		// Source and destination addresses and ports
+    UInt8			ethLen;			// Header layout, segments must match
+    UInt8			tcpLen;
+    UInt8			tos;			// IP fields that must match too, the merged packet
+    UInt8			ttl;			// only carries the first segment's (ECN marks would be lost)
+    UInt8			df;
+} lroSession;
+
+enum
+{
+    kLROFlushBatch = 0,					// End of a receive pass
+    kLROFlushFull,					// Hit kLROMaxLength or kLROMaxSegments
+    kLROFlushOrder,					// Segment out of order or headers changed
+    kLROFlushFlags,					// PSH, or a segment that can't be merged (FIN, SYN, no payload...)
+    kLROFlushEvict,					// Session table full, oldest flow handed up
+    kLROFlushReasons
+};
+
+typedef struct
+{
+    IOUSBDevRequest		request;		// Must be first, the completion parameter points here
+    volatile UInt32		inUse;
+    UInt8			data[kControlDataSize];	// Inline payload (statistic value or filter addresses)
+} controlRequest;
+
+typedef struct eventLog		// Event log (debugging only), one per instance
+{
+    UInt32      evLogFlag;
     UInt8       *evLogBuf;
     UInt8       *evLogBufe;
     UInt8       *evLogBufp;
     UInt8       intLevel;
-    class com_apple_driver_dts_USBCDCEthernet	*USBCDCEthernetInstance;
-} globals;
+} eventLog;
 	
     // Inline time conversions
 	
@@ -335,100 +502,315 @@ class com_apple_driver_dts_USBCDCEthernet : public IOEthernetController
 {
     OSDeclareDefaultStructors(com_apple_driver_dts_USBCDCEthernet);	// Constructor & Destructor stuff
 
+protected:
+    static void			*operator new(size_t size);		// Cache line aligned, so the blocks below really are
+    static void			operator delete(void *mem, size_t size);
+
 private:
+        // Cold - descriptors, configuration and state only looked at on the control path
+        
     bool			fTerminate;				// Are we being terminated (ie the device was unplugged)
     UInt8			fbmAttributes;				// Device attributes
     UInt16			fVendorID;
     UInt16			fProductID;
         
     IOEthernetInterface		*fNetworkInterface;
-    IOBasicOutputQueue		*fTransmitQueue;
-
     IOWorkLoop			*fWorkLoop;
-    IONetworkStats		*fpNetStats;
-    IOEthernetStats		*fpEtherStats;
     IOTimerEventSource		*fTimerSource;
     
     OSDictionary		*fMediumDict;
 
-    bool			fReady;
     bool			fNetifEnabled;
     bool			fWOL;
-    bool			fDataDead;
-    bool			fCommDead;
-    UInt8			fLinkStatus;
     UInt32			fUpSpeed;
     UInt32			fDownSpeed;
-    UInt16			fPacketFilter;
+    UInt32			fLinkMbps;				// Link speed the PHY last reported (0 - not yet)
      
     IOUSBInterface		*fCommInterface;
     IOUSBInterface		*fDataInterface;
     
-    IOUSBPipe			*fInPipe;
-    IOUSBPipe			*fOutPipe;
-    IOUSBPipe			*fCommPipe;
-    
-    IOBufferMemoryDescriptor	*fCommPipeMDP;
-    IOBufferMemoryDescriptor	*fPipeInMDP;
-
-    UInt8			*fCommPipeBuffer;
-    UInt8			*fPipeInBuffer;
-    
-    pipeOutBuffers		fPipeOutBuff[kOutBufPool];
+    IOBufferMemoryDescriptor	*fSlabMDP;				// Every pipe buffer lives in this one allocation
+    IOByteCount			fSlabSize;
+    UInt32			fDMAAllocations;			// Number of times the slab was allocated
     
     UInt8			fCommInterfaceNumber;
     UInt8			fDataInterfaceNumber;
     UInt32			fCount;
-    UInt32			fOutPacketSize;
     
     UInt8			fEaddr[6];
     UInt16			fMax_Block_Size;
     UInt16			fMcFilters;
     UInt8 			fEthernetStatistics[4];
     
-    UInt16			fCurrStat;
-    UInt32			fStatValue;
-    bool			fStatInProgress;
     bool			fInputPktsOK;
     bool			fInputErrsOK;
     bool			fOutputPktsOK;
     bool			fOutputErrsOK;
-
-    IOUSBCompletion		fCommCompletionInfo;
+    
+        // Data path recovery (driven by the watchdog timer)
+    
+    UInt32			fRxReadErrors;				// Bulk-in completions that failed (not aborted)
+    UInt32			fLastRxCompletions;			// Values seen at the previous watchdog tick
+    UInt32			fLastRxReadErrors;
+    UInt32			fRxTroubleTicks;			// Ticks with failed reads, or reads that couldn't be queued, and nothing received
+    UInt32			fRecoveryInterval;			// Current backoff interval (ticks)
+    UInt32			fRecoveryBackoff;			// Ticks left before the next recovery attempt
+    UInt64			fRecoveryStart;				// Uptime the current recovery episode started (0 - none)
+    UInt32			fRecoveryCount;				// Successful recoveries
+    UInt32			fRecoveryFailures;			// Failed recovery attempts
+    UInt64			fRecoveryTimeMS;			// Total time spent in recovery
+    UInt32			fTxTimeouts;				// Hung bulk-out transfers detected
+    UInt32			fTxTimeoutDrops;			// Packets freed by the transmit watchdog
+    UInt32			fRxPacketsFolded;			// Counts already added to fpNetStats (see foldNetStats)
+    UInt32			fRxErrorsFolded;
+    UInt32			fTxPacketsFolded;
+    UInt32			fTxErrorsFolded;
+    
+        // 802.3x flow control
+    
+    bool			fFlowControl;
+    UInt8			fFlowControlHighWater;			// KB
+    UInt8			fFlowControlLowWater;			// KB
+    bool			fPauseAdvertised;			// PHY currently advertises pause capability
+    bool			fPauseAdvertValid;			// fPauseAdvertised read from the PHY since enable
+    UInt8			fFlowStatsLink;				// Link status at the last status refresh
+    UInt32			fFlowStatsTicks;			// Watchdog ticks since the last status refresh
+    UInt32			fPauseReceived;				// Pause frames seen (latched status, lower bound)
+    UInt32			fRxFifoOverflows;			// From the receive overflow counter
+    UInt32			fRxTransferSize;			// Configured bulk-in transfer size (0 - automatic)
+    
+        // Read mostly - looked at per packet by both directions, rarely written
+    
+    bool			fReady __attribute__((aligned(kCacheLineSize)));
+    bool			fDataDead;
+    bool			fCommDead;
+    UInt8			fLinkStatus;
+    IONetworkStats		*fpNetStats;
+    IOEthernetStats		*fpEtherStats;
+    const checksumKernels	*fChecksum;				// Checksum and copy kernels (see Checksum.h)
+    
+        // Receive - touched by every bulk-in completion
+    
+    IOUSBPipe			*fInPipe __attribute__((aligned(kCacheLineSize)));
+    IOInterruptEventSource	*fRxEventSource;			// Completed transfers are processed on the workloop
+    pipeInBuffers		fPipeInBuff[kInBufPool];		// Used in turn, transfers complete in the order they're posted
+    volatile UInt32		fRxPosted;				// Transfers posted, completed and processed (free running,
+    volatile UInt32		fRxDone;				// the next of each is in fPipeInBuff[count % kInBufPool])
+    volatile UInt32		fRxProcessed;
+    UInt32			fRxGeneration;				// Bumped when the pipe is aborted, stale completions are ignored
+    volatile UInt32		fRxPostLock;				// Reads are posted by the completion and the workloop
+    volatile UInt32		fRxPostAgain;
+    UInt32			fRxBlockSize;				// Bulk-in transfer size in use
+    UInt16			fInPacketSize;				// Bulk-in endpoint max packet size
+    UInt32			fRxCompletions;				// Successful bulk-in completions
+    UInt32			fRxPackets;				// Interface counts, folded into fpNetStats by the watchdog
+    UInt32			fRxErrors;				// so the directions don't share its cache line
+    UInt32			fRxBudget;				// Frames per receive pass
+    UInt32			fRxPasses;				// Receive passes run
+    UInt32			fRxBudgetExhausted;			// Passes that stopped with transfers still waiting
+    UInt32			fRxBacklogMax;				// Most completed transfers waiting for a pass
+    bool			fRxInService;				// serviceReceive is running
+    UInt32			fBusyPollUS;				// Busy poll window per receive pass (0 - off)
+    UInt64			fBusyPollTime;				// and as an uptime interval
+    UInt32			fRxInline;				// Transfers processed straight from the completion
+    UInt32			fBusyPollHits;				// Spins that found another completion
+    UInt32			fBusyPollMisses;			// and those that gave up
+    UInt32			fRxLatency[kRxLatencyBuckets];		// Completion to processing time histogram
+    UInt8			*fRxCarry;				// Frame straddling two bulk-in transfers
+    UInt32			fRxCarryLen;
+    UInt32			fRxCarried;				// Frames reassembled from two transfers
+    UInt32			fRxMulticast;				// Group addressed frames received (broadcast included)
+    UInt32			fRxFramingErrors;			// Transfers whose frame headers didn't add up
+    UInt32			fRxCopybreak;				// Small frames are copied into header mbufs
+    UInt32			fRxSmall;				// Frames that went into a header mbuf
+    mbuf_t			fRxPool[kRxPoolSize];			// Preallocated cluster mbufs (refilled at the end of a transfer)
+    UInt32			fRxPoolCount;
+    UInt32			fRxPoolEmpty;				// Frames that found the pool empty
+    UInt32			fRxPoolRefillFailures;			// Refills that couldn't get an mbuf
+    bool			fLRO;					// Coalesce received TCP segments
+    UInt32			fLRONext;				// Session to evict next
+    lroSession			fLROSessions[kLROSessions];
+    UInt32			fLROMerged;				// Segments merged into an earlier one
+    UInt32			fLROPackets;				// Packets handed up that held more than one segment
+    UInt32			fLROFlushes[kLROFlushReasons];
+    UInt32			fRxChecksumErrors;			// TCP/IPv4 frames that failed verification
+    rxFilter			fRxFilter;				// Dropped before an mbuf is taken if they don't pass
     IOUSBCompletion		fReadCompletionInfo;
+    
+        // Transmit - touched by every packet sent and every bulk-out completion
+    
+    IOUSBPipe			*fOutPipe __attribute__((aligned(kCacheLineSize)));
+    IOBasicOutputQueue		*fTransmitQueue;
+    UInt32			fOutPacketSize;
+    UInt32			fTxCompletions;				// Successful bulk-out completions
+    UInt32			fTxPackets;				// Interface counts, folded into fpNetStats by the watchdog
+    UInt32			fTxErrors;
+    UInt32			fTxTSOPackets;				// Large sends segmented by the driver
+    UInt32			fTxTSOSegments;				// Frames they were split into
+    UInt32			fTxTSOErrors;				// Large sends that couldn't be segmented
+    UInt32			fTxChecksums;				// Packets whose checksums we computed
+    volatile UInt32		fTxInflight;				// Bytes written and not yet completed
+    UInt32			fTxLimit;				// Limit on fTxInflight, adapted by completeTransmit
+    UInt32			fTxSlack;				// Fewest bytes in flight with packets waiting, this hold period
+    UInt64			fTxSlackStart;				// Uptime the hold period started
+    UInt64			fTxLimitHold;				// kTxLimitHoldMS as an uptime interval
+    volatile UInt32		fTxStalled;				// The output queue is stalled waiting for a completion
+    UInt32			fTxStalls;
+    UInt32			fTxLimitGrown;				// Times the pipe ran dry with packets waiting
+    UInt32			fTxLimitShrunk;				// Times bytes that were never needed were given back
+    txResume			fTxResume;
+    UInt32			fTxTSOResumes;				// Large sends picked up again after a stall
+    UInt32			fTxQueueMode;				// kTxQueueFIFO or the driver's own queue
+    IOInterruptEventSource	*fTxEventSource;			// Drains the driver's queue on the workloop
+    mbuf_t			fTxPending;				// Dequeued but stalled, goes first next time
+    bool			fTxQueueFull;				// The output queue is stalled because ours is full
+    txFifo			fTxFifo;
+    codelState			fCoDel;
+    codelParams			fCoDelParams;
+    UInt32			fCoDelTarget;				// Microseconds, as configured
+    UInt32			fCoDelInterval;
+    UInt32			fTxQueueDrops;				// Packets CoDel dropped
+    bool			fTxPriority;				// Priority lanes and a reserved output buffer
+    txFifo			fTxLanes[kTxClasses];			// Priority lanes (kTxClassNormal's isn't used, see fTxFifo and fFQ)
+    mbuf_t			fTxPendingHigh;				// Priority packet dequeued but stalled
+    bool			fTxAckThin;				// ACK thinning
+    UInt32			fTxAcksThinned;				// Queued ACKs dropped for a newer one
+    UInt32			fTxDequeued[kTxClasses];		// Packets that left the driver's queue, by class
+    UInt64			fTxSojournTotal[kTxClasses];		// and the time they spent in it (microseconds)
+    UInt64			fTxSojournMax[kTxClasses];
+    fqScheduler			fFQ;					// Flow queues (FQ-CoDel mode)
+    UInt32			fTxRateLimit;				// Token bucket shaper - kbit/s, 0 off
+    UInt32			fTxBurst;				// Bucket depth, bytes
+    UInt64			fShaperCredit;				// Tokens, in bytes x kShaperScale so refills don't lose fractions
+    UInt64			fShaperLast;				// Uptime of the last refill
+    IOTimerEventSource		*fShaperTimer;				// Restarts transmission once there are tokens again
+    volatile UInt32		fShaperArmed;
+    UInt32			fShaperStalls;				// Times a frame had to wait for tokens
+    UInt64			fShaperBytes;				// Bytes charged, DM9601 header and padding included
+    UInt32			fTxPacing;				// Percent of the link speed, 0 off
+    UInt64			fPaceNext;				// Uptime the next frame may go
+    UInt64			fPaceSlack;				// kTxPaceSlackUS as an uptime interval
+    IOTimerEventSource		*fPaceTimer;				// Wakes at fPaceNext when a frame is waiting
+    volatile UInt32		fPaceArmed;
+    bool			fPaceHeld;				// A frame was held back, the next one sent measures the error
+    UInt32			fPaceWaits;
+    UInt32			fPaceErrors;				// Held frames sent, and how far from their slot (microseconds)
+    UInt64			fPaceErrorTotal;
+    UInt64			fPaceErrorMax;
+    UInt32			fPaceBurst;				// Frames sent since the last wait
+    UInt32			fPaceBursts;
+    UInt64			fPaceBurstFrames;
+    UInt32			fPaceBurstMax;
+    txEntryPool			fTxEntries;				// Last, it's big and only the queue's ends are touched
     IOUSBCompletion		fWriteCompletionInfo;
+    pipeOutBuffers		fPipeOutBuff[kOutBufPool];
+    
+        // Control - interrupt pipe, register and class requests
+    
+    IOUSBPipe			*fCommPipe __attribute__((aligned(kCacheLineSize)));
+    IOMemoryDescriptor		*fCommPipeMDP;				// Sub-range of the slab
+    UInt8			*fCommPipeBuffer;
+    UInt16			fPacketFilter;
+    UInt8			fRCR;					// Last value written to RegRCR
+    bool			fRCRValid;
+    UInt16			fCurrStat;
+    bool			fStatInProgress;
+    IOUSBCompletion		fCommCompletionInfo;
     IOUSBCompletion		fMERCompletionInfo;
     IOUSBCompletion		fStatsCompletionInfo;
+    controlRequest		fControlPool[kControlPoolSize];
+    UInt32			fControlPoolExhausted;			// Requests not sent because the pool was empty
+    
+#if USE_ELG
+    mutable eventLog		fEventLog __attribute__((aligned(kCacheLineSize)));	// Written by every ELG, keep it off the packet state's lines
+#endif /* USE_ELG */
 
     static void			commReadComplete(void *obj, void *param, IOReturn ior, UInt32 remaining);
     static void			dataReadComplete(void *obj, void *param, IOReturn ior, UInt32 remaining);
+    static void			rxEventOccurred(OSObject *owner, IOInterruptEventSource *sender, int count);
     static void			dataWriteComplete(void *obj, void *param, IOReturn ior, UInt32 remaining);
+    static void			txEventOccurred(OSObject *owner, IOInterruptEventSource *sender, int count);
     static void			merWriteComplete(void *obj, void *param, IOReturn ior, UInt32 remaining);
     static void			statsWriteComplete(void *obj, void *param, IOReturn rc, UInt32 remaining);
     
            // CDC Driver instance Methods
 	
     bool			wakeUp(void);
+    bool			waitForDevice(void);
+    void			publishStartupTiming(bool fastResume, UInt64 start, UInt64 resumed, UInt64 ready, UInt64 allocated, UInt64 restored);
     void			putToSleep(void);
+    void			abortPipes(void);
+    controlRequest		*getControlRequest(UInt8 bRequest, UInt16 wValue, UInt16 wLength);
+    void			releaseControlRequest(controlRequest *ctl);
     bool			createMediumTables(void);
     bool 			allocateResources(void);
+    IOMemoryDescriptor		*carveBuffer(IOByteCount *offset, IOByteCount length, IODirection direction, UInt8 **buffer);
     void			releaseResources(void);
+    void			releaseEventSources(void);
     bool 			configureDevice(UInt8 numConfigs);
     bool			initDevice(UInt8 numConfigs);
     bool			getFunctionalDescriptors(void);
     bool			createNetworkInterface(void);
     UInt32			outputPacket(mbuf_t pkt, void *param);
-    bool			USBTransmitPacket(mbuf_t packet);
+    bool			USBTransmitPacket(mbuf_t packet, bool priority);
+    bool			transmitSegments(mbuf_t packet, UInt32 length, UInt32 mss);
+    UInt32			getTxBuffer(bool priority);
+    bool			sendTxBuffer(UInt32 poolIndx, UInt32 rTotal, mbuf_t packet);
+    bool			releaseTxBuffer(UInt32 poolIndx, UInt32 owner);
+    void			completeTransmit(bool success);
+    void			serviceTransmit(void);
+    void			flushTransmitQueue(void);
+    void			noteTxDelay(UInt32 txClass, UInt64 now, UInt64 enqueued);
+    bool			txPoolSaturated(void);
+    bool			thinAck(mbuf_t pkt, const txPacketInfo *info, UInt32 txClass);
+    void			restartTransmit(void);
+    bool			admitFrame(UInt32 frameLength);
+    bool			shaperAdmit(UInt32 frameLength);
+    void			shaperCharge(UInt32 transferLength);
+    void			setRateLimit(UInt32 rate, UInt32 burst);
+    static void			shaperFired(OSObject *owner, IOTimerEventSource *sender);
+    UInt32			paceLinkMbps(void);
+    bool			paceAdmit(void);
+    void			paceCharge(UInt32 frameLength);
+    static void			paceFired(OSObject *owner, IOTimerEventSource *sender);
+    void			setCoDelParams(void);
     bool			USBSetMulticastFilter(IOEthernetAddress *addrs, UInt32 count);
     bool			USBSetPacketFilter(void);
     IOReturn			clearPipeStall(IOUSBPipe *thePipe);
-    void			receivePacket(UInt8 *packet, UInt32 size);
+    bool			postReads(void);
+    void			serviceReceive(bool poll);
+    bool			receiveInline(void);
+    bool			waitForCompletion(UInt64 deadline);
+    UInt32			receivePacket(UInt8 *packet, UInt32 size);
+    bool			checkReceiveStatus(UInt8 status);
+    void			inputFrame(UInt8 status, UInt8 *frame, UInt32 length);
+    mbuf_t			copyFrame(UInt8 *frame, UInt32 length);
+    void			refillRxPool(void);
+    void			drainRxPool(void);
+    bool			coalesceFrame(UInt8 *frame, UInt32 length);
+    void			flushSession(lroSession *session, UInt32 reason);
+    void			flushReceive(void);
+    UInt32			chooseRxTransferSize(void);
     static void 		timerFired(OSObject *owner, IOTimerEventSource *sender);
     void			timeoutOccurred(IOTimerEventSource *timer);
+    void			checkDataPath(void);
+    void			checkTransmitTimeouts(void);
+    void			foldNetStats(void);
+    bool			recoverDataPath(void);
+    bool			restoreDeviceState(void);
+    void			publishStatistics(void);
+    void			updateConfiguration(OSDictionary *dict);
+    void			setRxFilter(OSDictionary *config);
+    static IOReturn		setPropertiesAction(OSObject *owner, void *arg0, void *arg1, void *arg2, void *arg3);
+    bool			applyFlowControl(void);
+    void			updateFlowControlStats(void);
 
     IOReturn  ReadRegister(UInt16 reg, UInt16 size, UInt8* buffer);
     IOReturn  WriteRegister(UInt16 reg, UInt16 size, UInt8* buffer);
     IOReturn  Write1Register(UInt16 reg, UInt8 value);
+    IOReturn  ReadPHY(UInt8 reg, UInt16 *value);
+    IOReturn  WritePHY(UInt8 reg, UInt16 value);
+    IOReturn  waitPHY(void);
   
 public:
 
@@ -441,6 +823,7 @@ public:
     virtual void		free(void);
     virtual void		stop(IOService *provider);
     virtual IOReturn 		message(UInt32 type, IOService *provider, void *argument = 0);
+    virtual IOReturn		setProperties(OSObject *properties);
 
         // IOEthernetController methods
 
@@ -458,5 +841,7 @@ public:
     virtual const OSString	*newModelString(void) const;
     virtual const OSString	*newRevisionString(void) const;
     virtual bool		configureInterface(IONetworkInterface *netif);
+    virtual UInt32		getFeatures(void) const;
+    virtual IOReturn		getChecksumSupport(UInt32 *checksumMask, UInt32 checksumFamily, bool isOutput);
 												
 }; /* end class com_apple_driver_dts_USBCDCEthernet */